@@ -6,461 +6,9973 @@
 #include <memory>
 #include <stdexcept>
 #include <algorithm>
+#include <iterator>
 #include <cstdio>
 #include <cstring>
+#include <cctype>
+#include <charconv>
 #include <ctime>
 #include <cstdlib>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <array>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <poll.h>
+#include <csignal>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include <arrow/api.h>
 #include <arrow/io/api.h>
 #include <parquet/api/reader.h>
 #include <parquet/arrow/reader.h>
+#include <parquet/arrow/writer.h>
+#include <arrow/util/thread_pool.h>
 
-// OpenSSL for SHA-512 (install libssl-dev on Linux)
+// OpenSSL for SHA-512 / SHA-256 (install libssl-dev on Linux)
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 
+// zlib inflates the XML inside DOCX / ODT packages (install zlib1g-dev)
+#include <zlib.h>
+
+// Optional digests: -DCHUNK_WITH_BLAKE3 -lblake3, -DCHUNK_WITH_XXHASH -lxxhash
+#ifdef CHUNK_WITH_BLAKE3
+#include <blake3.h>
+#endif
+#ifdef CHUNK_WITH_XXHASH
+#include <xxhash.h>
+#endif
+
+// Optional multi-buffer SHA-2 for batches of small chunks: -DCHUNK_WITH_ISAL
+// -lisal_crypto (isa-l_crypto)
+#ifdef CHUNK_WITH_ISAL
+#include <sha256_mb.h>
+#include <sha512_mb.h>
+#endif
+
+// Optional per-chunk compression of segment output and .zst input:
+// -DCHUNK_WITH_ZSTD -lzstd
+#ifdef CHUNK_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+// Optional compressed input (gzip is always available through zlib):
+// -DCHUNK_WITH_BZIP2 -lbz2, -DCHUNK_WITH_LZMA -llzma
+#ifdef CHUNK_WITH_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef CHUNK_WITH_LZMA
+#include <lzma.h>
+#endif
+
+// Optional io_uring chunk writer (--io uring): -DCHUNK_WITH_URING -luring
+#ifdef CHUNK_WITH_URING
+#include <liburing.h>
+#endif
+
+// Optional upload of chunks to S3-compatible storage or an HTTP ingest endpoint
+// (--output s3|http): -DCHUNK_WITH_CURL -lcurl
+#ifdef CHUNK_WITH_CURL
+#include <curl/curl.h>
+#include <openssl/hmac.h>
+#endif
+
+// Optional in-process PDF text extraction: -DCHUNK_WITH_POPPLER -lpoppler-cpp
+#ifdef CHUNK_WITH_POPPLER
+#include <poppler/cpp/poppler-document.h>
+#include <poppler/cpp/poppler-page.h>
+#endif
+
 // -----------------------------------------------------------------------------
 // 1) Constants
 // -----------------------------------------------------------------------------
 
-// ~5MB chunk (5 * 1024 * 1024) plus ~5KB variance
-static const size_t CHUNK_BASE_SIZE = 5 * 1024 * 1024; // 5 MB
-static const size_t CHUNK_VARIANCE  = 5 * 1024;        // 5 KB
-static const size_t CHUNK_LIMIT     = CHUNK_BASE_SIZE + CHUNK_VARIANCE;
+// Default chunk geometry (--chunk-size, --chunk-variance): ~5MB chunk
+// (5 * 1024 * 1024) plus ~5KB variance
+static const size_t DEFAULT_CHUNK_SIZE     = 5 * 1024 * 1024; // 5 MB
+static const size_t DEFAULT_CHUNK_VARIANCE = 5 * 1024;        // 5 KB
+static const size_t MIN_CHUNK_SIZE         = 256;
+static const size_t MAX_CHUNK_SIZE         = 1024ULL * 1024 * 1024;
 
-// Suppose we allow up to ~500 MB total => 100 buffers * ~5MB each
+// Chunks are handed from a chunker to the flush workers, and on to the sink,
+// in batches of about CHUNK_BATCH_BYTES (at most MAX_CHUNK_BATCH chunks), so
+// small chunks do not pay a lock round trip and a system call each. ~5MB
+// chunks travel one at a time.
+static const size_t CHUNK_BATCH_BYTES = 1024 * 1024;
+static const size_t MAX_CHUNK_BATCH   = 256;
+
+// Buffers are allocated on demand; by default at most ~500 MB => 100 buffers * ~5MB.
+// Smaller chunks get as many buffers as fit in the same ~500 MB.
 static const size_t NUM_BUFFERS     = 100;
 
+// Flush workers hash and write chunks in the background; each worker holds one
+// buffer and the queue holds up to FLUSH_QUEUE_PER_WORKER buffers per worker.
+static const size_t DEFAULT_FLUSH_THREADS  = 4;
+static const size_t FLUSH_QUEUE_PER_WORKER = 2;
+
+// Parquet reads stream record batches of this many rows
+static const int64_t DEFAULT_PARQUET_BATCH_ROWS = 64 * 1024;
+
+// Poppler: only split a PDF across threads when each gets this many pages
+static const size_t PDF_PAGES_PER_THREAD = 8;
+
+// --output segments starts a new segment file past this many bytes
+static const size_t DEFAULT_SEGMENT_SIZE = 1024ULL * 1024 * 1024;
+
+// --io uring: chunks in flight (one registered file slot each), SQE batch
+// size, and the block alignment O_DIRECT (--direct) needs
+static const unsigned URING_QUEUE_DEPTH  = 32;
+static const size_t URING_SUBMIT_BATCH   = 8;
+static const size_t DIRECT_IO_ALIGNMENT  = 4096;
+
+// --output s3|http: requests in flight and bytes per request (an S3 part or
+// an ingest batch). S3 parts other than the last must be at least 5MB, and an
+// upload has at most 10000 of them. A request is tried UPLOAD_ATTEMPTS times.
+static const size_t DEFAULT_UPLOAD_CONCURRENCY = 4;
+static const size_t DEFAULT_UPLOAD_BATCH       = 8 * 1024 * 1024;
+static const size_t S3_MIN_PART_SIZE           = 5 * 1024 * 1024;
+static const size_t S3_MAX_PARTS               = 10000;
+static const int UPLOAD_ATTEMPTS               = 3;
+
+// The run journal is made durable (output directory synced, records written
+// and fdatasync'ed) in one group at most this often
+static const int JOURNAL_COMMIT_MS = 500;
+
+// --manifest rows are written in batches of this many chunks
+static const size_t MANIFEST_BATCH_ROWS = 4096;
+
+// --bench generates inputs of this many bytes per format
+static const size_t DEFAULT_BENCH_SIZE = 256 * 1024 * 1024;
+
 // We'll store our output directory globally once it's created
 static std::string g_outputDir;
 
-// -----------------------------------------------------------------------------
-// 2) Compute SHA-512 for a chunk of data
-// -----------------------------------------------------------------------------
-std::string compute_sha512(const char* data, size_t length) {
-    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
-    if (!ctx) {
-        throw std::runtime_error("Failed to create EVP_MD_CTX");
-    }
-    if (EVP_DigestInit_ex(ctx, EVP_sha512(), nullptr) != 1) {
-        EVP_MD_CTX_free(ctx);
-        throw std::runtime_error("Failed to init SHA-512");
-    }
-    if (EVP_DigestUpdate(ctx, data, length) != 1) {
-        EVP_MD_CTX_free(ctx);
-        throw std::runtime_error("Failed to update SHA-512");
-    }
+// PDF text extraction: external pdftotext, or Poppler linked in-process
+enum class PdfEngine { Pdftotext, Poppler };
+#ifdef CHUNK_WITH_POPPLER
+static PdfEngine g_pdfEngine = PdfEngine::Poppler;
+#else
+static PdfEngine g_pdfEngine = PdfEngine::Pdftotext;
+#endif
+static size_t g_pdfThreads = 1; // page-extraction threads per PDF
 
-    unsigned char hash[EVP_MAX_MD_SIZE];
-    unsigned int hashLen = 0;
-    if (EVP_DigestFinal_ex(ctx, hash, &hashLen) != 1) {
-        EVP_MD_CTX_free(ctx);
-        throw std::runtime_error("Failed to finalize SHA-512");
-    }
-    EVP_MD_CTX_free(ctx);
+// Compressed input is read and inflated in DECODE_BLOCK_BYTES blocks. With
+// --decompress-threads, independent zstd frames or BGZF blocks are decoded
+// in tasks of about DECODE_TASK_BYTES output, and only frames that decompress
+// to at most DECODE_MAX_FRAME_BYTES are split off
+static const size_t DECODE_BLOCK_BYTES     = 1024 * 1024;
+static const size_t DECODE_TASK_BYTES      = 4 * 1024 * 1024;
+static const size_t DECODE_MAX_FRAME_BYTES = 64 * 1024 * 1024;
+static size_t g_decompressThreads = 1;
 
-    std::ostringstream oss;
-    for (unsigned int i = 0; i < hashLen; ++i) {
-        oss << std::hex << std::nouppercase
-        << ((hash[i] & 0xF0) >> 4)
-        << (hash[i] & 0x0F);
+// --file-threads: uncompressed files of at least FILE_RANGE_MIN_BYTES are read
+// and chunked in ranges on that many threads (fixed and boundary splits)
+static const uint64_t FILE_RANGE_MIN_BYTES = 64 * 1024 * 1024;
+static size_t g_fileThreads = 1;
+
+// ChunkGeometry - chunk sizes, fixed from the command line before any input is
+// read. Content-defined chunking (--split cdc) cuts between cdcMin and cdcMax
+// and averages around cdcTarget; that window has to be much wider than the
+// variance, otherwise almost every chunk is forced at cdcMax and boundaries
+// stop moving with the content.
+struct ChunkGeometry {
+    size_t base;
+    size_t variance;
+    size_t limit;         // base + variance, the fixed-size cut
+    size_t cdcMin;
+    size_t cdcTarget;
+    size_t cdcMax;
+    unsigned cdcMaskBits; // ~log2(cdcTarget)
+    size_t batch;         // chunks per hand-off to the flush workers
+
+    static ChunkGeometry make(size_t base, size_t variance) {
+        ChunkGeometry g;
+        g.base        = base;
+        g.variance    = variance;
+        g.limit       = base + variance;
+        g.cdcMin      = base / 2;
+        g.cdcTarget   = base;
+        g.cdcMax      = base * 2;
+        g.cdcMaskBits = 63 - static_cast<unsigned>(__builtin_clzll(base));
+        g.batch       = std::clamp<size_t>(CHUNK_BATCH_BYTES / g.limit, 1, MAX_CHUNK_BATCH);
+        return g;
     }
-    return oss.str();
-}
+};
+static ChunkGeometry g_chunk = ChunkGeometry::make(DEFAULT_CHUNK_SIZE, DEFAULT_CHUNK_VARIANCE);
 
-// -----------------------------------------------------------------------------
-// 3) Data structure: A single chunk buffer
-// -----------------------------------------------------------------------------
-struct ChunkBuffer {
-    std::unique_ptr<char[]> data;
-    size_t capacity;
-    size_t used;
+// How chunk boundaries are chosen
+enum class SplitMode { Fixed, ContentDefined, Boundary, Tokens };
+static SplitMode g_splitMode = SplitMode::Fixed;
+static size_t g_maxTokens    = 0; // --max-tokens: token budget per chunk
+static size_t g_tokenOverlap = 0; // tokens repeated at the start of the next chunk
 
-    ChunkBuffer(size_t cap) : data(new char[cap]), capacity(cap), used(0) {}
+// Parquet reader settings, filled in from the command line before any file is read
+static int64_t g_parquetBatchRows = DEFAULT_PARQUET_BATCH_ROWS;
+static std::vector<std::string> g_parquetColumns; // empty => every column
+static int g_parquetReadahead = 0;                // row groups decoded ahead
 
-    void clear() { used = 0; }
-};
+// JSONL input: dotted paths of the string fields that are chunked
+static std::vector<std::string> g_jsonFields = { "text" };
+
+// CSV input: raw mode (the default) chunks the file bytes as they are;
+// records mode splits rows into fields and writes the --csv-columns as text
+// lines. With --csv-threads, uncompressed files are parsed in
+// CSV_RANGE_BYTES ranges.
+enum class CsvMode { Records, Raw };
+static CsvMode g_csvMode   = CsvMode::Raw;
+static std::vector<std::string> g_csvColumns; // empty => every column
+static char g_csvDelimiter = 0; // 0 => ',' (tab for .tsv files)
+static size_t g_csvThreads = 1;
+static const size_t CSV_RANGE_BYTES = 8 * 1024 * 1024;
+
+// Serializes console output coming from the flush workers and the main thread
+static std::mutex g_logMutex;
+
+// Print a "Flushed chunk -> ..." line per chunk (off while benchmarking)
+static bool g_logChunks = true;
 
 // -----------------------------------------------------------------------------
-// 4) BufferPool - manages a pool of chunk buffers
+// 2) Chunk digest (--hash). SHA-2 goes through OpenSSL with one reusable
+//    EVP_MD_CTX per thread; BLAKE3 and xxh3-128 are available when compiled
+//    in with CHUNK_WITH_BLAKE3 / CHUNK_WITH_XXHASH. Batches of chunks can be
+//    hashed together (compute_chunk_hashes), which with CHUNK_WITH_ISAL runs
+//    SHA-2 through isa-l_crypto's multi-buffer kernels.
 // -----------------------------------------------------------------------------
-class BufferPool {
-public:
-    BufferPool(size_t bufferCount, size_t bufferSize) : bufferSize_(bufferSize) {
-        for (size_t i = 0; i < bufferCount; i++) {
-            freeBuffers_.emplace_back(std::make_unique<ChunkBuffer>(bufferSize_));
-        }
+enum class HashAlgo : uint32_t { Sha512 = 1, Sha256 = 2, Blake3 = 3, Xxh3 = 4 };
+static HashAlgo g_hashAlgo = HashAlgo::Sha512;
+
+const char* hash_algo_name(HashAlgo algo) {
+    switch (algo) {
+        case HashAlgo::Sha512: return "sha512";
+        case HashAlgo::Sha256: return "sha256";
+        case HashAlgo::Blake3: return "blake3";
+        case HashAlgo::Xxh3:   return "xxh3";
     }
+    return "unknown";
+}
 
-    std::unique_ptr<ChunkBuffer> acquireBuffer() {
-        if (freeBuffers_.empty()) {
-            throw std::runtime_error("No free chunk buffers available!");
-        }
-        auto buf = std::move(freeBuffers_.back());
-        freeBuffers_.pop_back();
-        buf->clear();
-        return buf;
+// parse_hash_algo - false for unknown names or algorithms not compiled in
+bool parse_hash_algo(const std::string& name, HashAlgo& out) {
+    if (name == "sha512") {
+        out = HashAlgo::Sha512;
+    } else if (name == "sha256") {
+        out = HashAlgo::Sha256;
+#ifdef CHUNK_WITH_BLAKE3
+    } else if (name == "blake3") {
+        out = HashAlgo::Blake3;
+#endif
+#ifdef CHUNK_WITH_XXHASH
+    } else if (name == "xxh3") {
+        out = HashAlgo::Xxh3;
+#endif
+    } else {
+        return false;
     }
+    return true;
+}
 
-    void releaseBuffer(std::unique_ptr<ChunkBuffer> buf) {
-        buf->clear();
-        freeBuffers_.push_back(std::move(buf));
+// table-driven lowercase hex: two output chars per input byte, no iostreams
+static void hex_encode(const unsigned char* in, size_t n, std::string& out) {
+    static const char* digits = "0123456789abcdef";
+    static const std::vector<uint16_t> table = [] {
+        std::vector<uint16_t> t(256);
+        for (int i = 0; i < 256; i++) {
+            char pair[2] = { digits[i >> 4], digits[i & 0x0F] };
+            std::memcpy(&t[i], pair, 2);
+        }
+        return t;
+    }();
+    out.resize(n * 2);
+    char* dst = &out[0];
+    for (size_t i = 0; i < n; i++) {
+        std::memcpy(dst + 2 * i, &table[in[i]], 2);
     }
+}
 
-private:
-    size_t bufferSize_;
-    std::vector<std::unique_ptr<ChunkBuffer>> freeBuffers_;
-};
+// per-thread OpenSSL context, created on first use and freed at thread exit
+struct ThreadDigestContext {
+    EVP_MD_CTX* ctx = nullptr;
 
-// -----------------------------------------------------------------------------
-// 5) Chunker - streams data into ~5MB chunks, writes them out to disk
-// -----------------------------------------------------------------------------
-class Chunker {
-public:
-    Chunker(BufferPool& pool, const std::string& outputDir)
-    : pool_(pool), outputDir_(outputDir)
-    {
-        currentBuffer_ = pool_.acquireBuffer();
+    ThreadDigestContext() : ctx(EVP_MD_CTX_new()) {
+        if (!ctx) {
+            throw std::runtime_error("Failed to create EVP_MD_CTX");
+        }
     }
+    ~ThreadDigestContext() { EVP_MD_CTX_free(ctx); }
+};
 
-    ~Chunker() {
-        // flush leftover data on destruction
-        flushCurrentBuffer();
+static void evp_digest(const EVP_MD* md, const char* data, size_t length,
+                       unsigned char* out, unsigned int& outLen) {
+    thread_local ThreadDigestContext tls;
+    if (EVP_DigestInit_ex(tls.ctx, md, nullptr) != 1) {
+        throw std::runtime_error("Failed to init digest");
     }
+    if (EVP_DigestUpdate(tls.ctx, data, length) != 1) {
+        throw std::runtime_error("Failed to update digest");
+    }
+    if (EVP_DigestFinal_ex(tls.ctx, out, &outLen) != 1) {
+        throw std::runtime_error("Failed to finalize digest");
+    }
+}
 
-    // push data into the chunker, splitting across multiple ~5MB chunks if needed
-    void pushData(const char* data, size_t len) {
-        size_t offset = 0;
-        while (offset < len) {
-            size_t spaceLeft = CHUNK_LIMIT - currentBuffer_->used;
-            if (spaceLeft == 0) {
-                // current buffer is full
-                flushCurrentBuffer();
-                currentBuffer_ = pool_.acquireBuffer();
-                continue;
-            }
-
-            size_t toWrite = std::min(spaceLeft, len - offset);
-            std::memcpy(currentBuffer_->data.get() + currentBuffer_->used,
-                        data + offset, toWrite);
-            currentBuffer_->used += toWrite;
-            offset += toWrite;
+std::string compute_chunk_hash(const char* data, size_t length) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashLen = 0;
 
-            if (currentBuffer_->used >= CHUNK_LIMIT) {
-                flushCurrentBuffer();
-                currentBuffer_ = pool_.acquireBuffer();
-            }
+    switch (g_hashAlgo) {
+        case HashAlgo::Sha512:
+            evp_digest(EVP_sha512(), data, length, hash, hashLen);
+            break;
+        case HashAlgo::Sha256:
+            // OpenSSL picks the SHA-NI / ARMv8 SHA2 kernels when available
+            evp_digest(EVP_sha256(), data, length, hash, hashLen);
+            break;
+#ifdef CHUNK_WITH_BLAKE3
+        case HashAlgo::Blake3: {
+            thread_local blake3_hasher hasher;
+            blake3_hasher_init(&hasher);
+            blake3_hasher_update(&hasher, data, length);
+            blake3_hasher_finalize(&hasher, hash, BLAKE3_OUT_LEN);
+            hashLen = BLAKE3_OUT_LEN;
+            break;
         }
+#endif
+#ifdef CHUNK_WITH_XXHASH
+        case HashAlgo::Xxh3: {
+            XXH128_canonical_t canonical;
+            XXH128_canonicalFromHash(&canonical, XXH3_128bits(data, length));
+            std::memcpy(hash, canonical.digest, sizeof(canonical.digest));
+            hashLen = sizeof(canonical.digest);
+            break;
+        }
+#endif
+        default:
+            throw std::runtime_error(std::string("Hash not compiled in: ") +
+                                     hash_algo_name(g_hashAlgo));
     }
 
-private:
-    BufferPool& pool_;
-    std::string outputDir_;
-    std::unique_ptr<ChunkBuffer> currentBuffer_;
-
-    // flushCurrentBuffer - finalize chunk, compute SHA-512, write to disk
-    void flushCurrentBuffer() {
-        if (!currentBuffer_ || currentBuffer_->used == 0) {
-            return;
-        }
-        const char* dataPtr = currentBuffer_->data.get();
-        size_t dataLen      = currentBuffer_->used;
-        // compute hash
-        std::string hashVal = compute_sha512(dataPtr, dataLen);
+    std::string hex;
+    hex_encode(hash, hashLen, hex);
+    return hex;
+}
 
-        // build output filename
-        std::time_t now = std::time(nullptr);
-        std::ostringstream fname;
-        fname << outputDir_ << "/" << hashVal << "_" << now << ".txt";
+struct HashInput {
+    const char* data;
+    size_t length;
+};
 
-        // write chunk to file
-        std::ofstream ofs(fname.str(), std::ios::binary);
-        if (!ofs.is_open()) {
-            std::cerr << "Error writing chunk file: " << fname.str() << "\n";
-        } else {
-            ofs.write(dataPtr, dataLen);
-            ofs.close();
-            std::cout << "Flushed chunk -> " << fname.str()
-            << " (size: " << dataLen << " bytes)\n";
+#ifdef CHUNK_WITH_ISAL
+// isa_l_multi_hash - run every input through one multi-buffer manager. The
+// manager fills its SIMD lanes (4-16 buffers, depending on the algorithm and
+// on AVX2 / AVX-512 support) and refills a lane as soon as its buffer is
+// done, so inputs of different lengths still keep the lanes busy. Digest
+// words come back in host order.
+template <typename Mgr, typename Ctx, typename Word, size_t Words>
+static void isa_l_multi_hash(void (*init)(Mgr*),
+                             Ctx* (*submit)(Mgr*, Ctx*, const void*, uint32_t, HASH_CTX_FLAG),
+                             Ctx* (*flush)(Mgr*),
+                             const std::vector<HashInput>& in, std::vector<std::string>& out) {
+    struct MgrFree {
+        void operator()(Mgr* m) const { std::free(m); }
+    };
+    thread_local std::unique_ptr<Mgr, MgrFree> mgr([init] {
+        void* mem = nullptr;
+        if (posix_memalign(&mem, 64, sizeof(Mgr)) != 0) {
+            throw std::bad_alloc();
         }
+        init(static_cast<Mgr*>(mem));
+        return static_cast<Mgr*>(mem);
+    }());
 
-        // release buffer
-        pool_.releaseBuffer(std::move(currentBuffer_));
+    std::vector<Ctx> ctx(in.size());
+    for (size_t i = 0; i < in.size(); i++) {
+        if (in[i].length > UINT32_MAX) {
+            throw std::runtime_error("Chunk too large for multi-buffer hashing");
+        }
+        hash_ctx_init(&ctx[i]);
+        submit(mgr.get(), &ctx[i], in[i].data, static_cast<uint32_t>(in[i].length),
+               HASH_ENTIRE);
+    }
+    while (flush(mgr.get())) {
     }
-};
 
-// -----------------------------------------------------------------------------
-// 6) Streaming file read helper
-// -----------------------------------------------------------------------------
-bool stream_file(const std::string &filePath, Chunker &chunker) {
-    std::ifstream ifs(filePath, std::ios::binary);
-    if (!ifs.is_open()) {
-        std::cerr << "Error: Could not open " << filePath << "\n";
-        return false;
+    out.resize(in.size());
+    for (size_t i = 0; i < in.size(); i++) {
+        if (hash_ctx_error(&ctx[i]) != HASH_CTX_ERROR_NONE) {
+            throw std::runtime_error("Multi-buffer digest failed");
+        }
+        unsigned char digest[Words * sizeof(Word)];
+        for (size_t w = 0; w < Words; w++) {
+            Word be = ctx[i].job.result_digest[w];
+            for (size_t b = 0; b < sizeof(Word); b++) {
+                digest[w * sizeof(Word) + b] =
+                    static_cast<unsigned char>(be >> (8 * (sizeof(Word) - 1 - b)));
+            }
+        }
+        hex_encode(digest, sizeof(digest), out[i]);
     }
-    const size_t BUFSZ = 64 * 1024; // read in 64KB blocks
-    char buffer[BUFSZ];
+}
+#endif
 
-    while (!ifs.eof()) {
-        ifs.read(buffer, BUFSZ);
-        std::streamsize bytesRead = ifs.gcount();
-        if (bytesRead > 0) {
-            chunker.pushData(buffer, static_cast<size_t>(bytesRead));
+// compute_chunk_hashes - compute_chunk_hash() for every input. A single
+// input, and algorithms without a multi-buffer kernel, are hashed one after
+// another: OpenSSL's single-stream SHA-NI code is the faster choice for one
+// large buffer, and BLAKE3 already spreads each input over its SIMD lanes.
+void compute_chunk_hashes(const std::vector<HashInput>& in, std::vector<std::string>& out) {
+#ifdef CHUNK_WITH_ISAL
+    if (in.size() > 1) {
+        switch (g_hashAlgo) {
+            case HashAlgo::Sha512:
+                isa_l_multi_hash<SHA512_HASH_CTX_MGR, SHA512_HASH_CTX, uint64_t,
+                                 SHA512_DIGEST_NWORDS>(
+                    sha512_ctx_mgr_init, sha512_ctx_mgr_submit, sha512_ctx_mgr_flush, in, out);
+                return;
+            case HashAlgo::Sha256:
+                isa_l_multi_hash<SHA256_HASH_CTX_MGR, SHA256_HASH_CTX, uint32_t,
+                                 SHA256_DIGEST_NWORDS>(
+                    sha256_ctx_mgr_init, sha256_ctx_mgr_submit, sha256_ctx_mgr_flush, in, out);
+                return;
+            default:
+                break;
         }
     }
-    ifs.close();
-    return true;
+#endif
+    out.resize(in.size());
+    for (size_t i = 0; i < in.size(); i++) {
+        out[i] = compute_chunk_hash(in[i].data, in[i].length);
+    }
 }
 
 // -----------------------------------------------------------------------------
-// 7) External Tools to convert PDF, DOC, ODT, RTF -> temp text file
-//    Then we stream that temp text file into the chunker
+// 3) Stage timing - wall time per pipeline stage plus a latency histogram per
+//    stage, kept in per-thread shards (each written only by its own thread,
+//    so no locked instructions) and summed when read. --bench and --metrics
+//    turn it on; while off a StageTimer costs one branch. Timers nest: an
+//    inner timer on the same thread is absorbed by the outer one, except the
+//    waits (pool, wait), which are recorded on their own and taken out of
+//    the enclosing stage's time.
 // -----------------------------------------------------------------------------
+enum Stage { STAGE_READ, STAGE_FORMAT, STAGE_COPY, STAGE_POOL, STAGE_WAIT, STAGE_HASH,
+             STAGE_SKETCH, STAGE_WRITE, STAGE_CONVERT, STAGE_COUNT };
 
-// Utility to run a command with popen and read results into chunker
-// Instead of storing in a string, we feed directly into the chunker in small blocks.
-bool stream_command_output(const std::string &command, Chunker &chunker) {
-    FILE *pipe = popen(command.c_str(), "r");
-    if (!pipe) {
-        std::cerr << "Error: popen failed for command: " << command << "\n";
-        return false;
-    }
+// pool: waiting for a free chunk buffer; wait: flush queue full; sketch:
+// --near-dup; convert: lifetime of an external converter process
+static const char* const STAGE_NAMES[STAGE_COUNT] = {
+    "read", "format", "copy", "pool", "wait", "hash", "sketch", "write", "convert"
+};
 
-    const size_t BUFSZ = 64 * 1024;
-    char buffer[BUFSZ];
-    while (!feof(pipe)) {
-        size_t bytesRead = fread(buffer, 1, BUFSZ, pipe);
-        if (bytesRead > 0) {
-            chunker.pushData(buffer, bytesRead);
-        }
-    }
-    int rc = pclose(pipe);
-    if (rc != 0) {
-        std::cerr << "Warning: command exited with code " << rc << ": " << command << "\n";
-        // Not always an error—some tools exit non-zero for certain conditions
-    }
-    return true;
-}
+enum Counter { COUNTER_BYTES_IN, COUNTER_CHUNKS, COUNTER_CHUNK_BYTES, COUNTER_NEAR_DUPLICATES,
+               COUNTER_COUNT };
 
-// For PDF:  "pdftotext <file> -"
-bool stream_pdf(const std::string &filePath, Chunker &chunker) {
-    std::string cmd = "pdftotext \"" + filePath + "\" -";
-    return stream_command_output(cmd, chunker);
-}
+static const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+    "input_bytes", "chunks", "chunk_bytes", "near_duplicates"
+};
 
-// DOC / DOCX: "doc2txt <file> -"
-bool stream_doc(const std::string &filePath, Chunker &chunker) {
-    // If doc2txt doesn't support "-", you may need a temp file approach
-    std::string cmd = "doc2txt \"" + filePath + "\" -";
-    return stream_command_output(cmd, chunker);
-}
+// HDR-style log-linear buckets: exact below 8ns, then 8 buckets per power of
+// two (at most 12.5% wide) up to 2^64 ns
+static const unsigned HIST_SUB_BITS = 3;
+static const size_t HIST_BUCKETS    = size_t(62) << HIST_SUB_BITS;
 
-// ODT: "odt2txt --stdout <file>"
-bool stream_odt(const std::string &filePath, Chunker &chunker) {
-    std::string cmd = "odt2txt --stdout \"" + filePath + "\"";
-    return stream_command_output(cmd, chunker);
+static size_t hist_bucket(uint64_t ns) {
+    if (ns < (1u << HIST_SUB_BITS)) {
+        return static_cast<size_t>(ns);
+    }
+    unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(ns));
+    unsigned shift = msb - HIST_SUB_BITS;
+    return (size_t(shift + 1) << HIST_SUB_BITS) + ((ns >> shift) & ((1u << HIST_SUB_BITS) - 1));
 }
 
-// RTF: "unrtf --text <file>" -> parse from stdout
-bool stream_rtf(const std::string &filePath, Chunker &chunker) {
-    std::string cmd = "unrtf --text \"" + filePath + "\"";
-    return stream_command_output(cmd, chunker);
+// hist_upper - largest value that lands in bucket b
+static uint64_t hist_upper(size_t b) {
+    if (b < (1u << HIST_SUB_BITS)) {
+        return b;
+    }
+    unsigned shift = static_cast<unsigned>(b >> HIST_SUB_BITS) - 1;
+    uint64_t sub = (b & ((1u << HIST_SUB_BITS) - 1)) | (1u << HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
 }
 
-// For CSV or TXT, we can read the file directly in binary mode
-bool stream_csv_or_txt(const std::string &filePath, Chunker &chunker) {
-    return stream_file(filePath, chunker);
-}
+class StageStats {
+public:
+    // Snapshot - sums over every thread's shard
+    struct Snapshot {
+        uint64_t nanos[STAGE_COUNT]  = {};
+        uint64_t events[STAGE_COUNT] = {};
+        uint64_t counters[COUNTER_COUNT] = {};
+        std::vector<uint64_t> buckets = std::vector<uint64_t>(STAGE_COUNT * HIST_BUCKETS);
 
-// For unknown extension, attempt plain text read
-bool stream_unknown(const std::string &filePath, Chunker &chunker) {
-    return stream_file(filePath, chunker);
-}
+        // quantile - upper bound of the bucket holding the q-th event, in ns
+        uint64_t quantile(int stage, double q) const {
+            uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(events[stage]));
+            uint64_t seen = 0;
+            const uint64_t* h = &buckets[stage * HIST_BUCKETS];
+            for (size_t b = 0; b < HIST_BUCKETS; b++) {
+                seen += h[b];
+                if (seen > rank) {
+                    return hist_upper(b);
+                }
+            }
+            return 0;
+        }
 
-bool stream_parquet(const std::string &filePath, Chunker &chunker) {
-    // 1. Open file as Arrow input
-    auto infileResult = arrow::io::ReadableFile::Open(filePath);
-    if (!infileResult.ok()) {
-        std::cerr << "Error: Could not open Parquet file: " << filePath
-        << "\n" << infileResult.status().ToString() << "\n";
-        return false;
+        uint64_t max(int stage) const {
+            const uint64_t* h = &buckets[stage * HIST_BUCKETS];
+            for (size_t b = HIST_BUCKETS; b-- > 0;) {
+                if (h[b]) {
+                    return hist_upper(b);
+                }
+            }
+            return 0;
+        }
+    };
+
+    // record - one event of `stage` that took `ns`, on the calling thread's shard
+    void record(Stage stage, uint64_t ns) {
+        Shard& s = local();
+        bump(s.nanos[stage], ns);
+        bump(s.events[stage], 1);
+        bump(s.buckets[stage][hist_bucket(ns)], 1);
     }
-    auto infile = *infileResult;
 
-    // 2. Create a Parquet->Arrow reader
-    std::unique_ptr<parquet::arrow::FileReader> reader;
-    auto st_reader = parquet::arrow::OpenFile(infile, arrow::default_memory_pool(), &reader);
-    if (!st_reader.ok()) {
-        std::cerr << "Error: parquet::arrow::OpenFile failed: "
-        << st_reader.ToString() << "\n";
-        return false;
+    void count(Counter counter, uint64_t n) { bump(local().counters[counter], n); }
+
+    Snapshot snapshot() {
+        Snapshot snap;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& s : shards_) {
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                snap.nanos[i]  += s->nanos[i].load(std::memory_order_relaxed);
+                snap.events[i] += s->events[i].load(std::memory_order_relaxed);
+                for (size_t b = 0; b < HIST_BUCKETS; b++) {
+                    snap.buckets[i * HIST_BUCKETS + b] +=
+                        s->buckets[i][b].load(std::memory_order_relaxed);
+                }
+            }
+            for (int i = 0; i < COUNTER_COUNT; i++) {
+                snap.counters[i] += s->counters[i].load(std::memory_order_relaxed);
+            }
+        }
+        return snap;
     }
 
-    // 3. Iterate row-group by row-group
-    int num_row_groups = reader->num_row_groups();
-    for (int rg = 0; rg < num_row_groups; rg++) {
-        std::shared_ptr<arrow::Table> table;
-        auto st_rg = reader->ReadRowGroup(rg, &table);
-        if (!st_rg.ok() || !table) {
-            std::cerr << "Warning: Could not read row group " << rg
-            << " from file " << filePath << "\n";
-            continue;
+    // reset - only while no pipeline threads are running (between bench cases)
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& s : shards_) {
+            s->clear();
         }
-        int64_t num_rows = table->num_rows();
-        int num_columns  = table->num_columns();
+    }
 
-        // We'll build a textual line for each row. Then push to chunker.
-        for (int64_t row_idx = 0; row_idx < num_rows; row_idx++) {
-            std::ostringstream rowLine;
-            for (int col_idx = 0; col_idx < num_columns; col_idx++) {
-                // This is a ChunkedArray of data for column col_idx
-                auto chunkedArr = table->column(col_idx);
+private:
+    struct Shard {
+        std::atomic<uint64_t> nanos[STAGE_COUNT];
+        std::atomic<uint64_t> events[STAGE_COUNT];
+        std::atomic<uint64_t> counters[COUNTER_COUNT];
+        std::atomic<uint64_t> buckets[STAGE_COUNT][HIST_BUCKETS];
 
-                if (chunkedArr->num_chunks() < 1) {
-                    rowLine << "[NO_CHUNKS]";
-                } else {
-                    auto arr = chunkedArr->chunk(0); // just first chunk example
-                    if (row_idx < arr->length()) {
-                        // Use GetScalar(row_idx)
-                        auto scalar_result = arr->GetScalar(row_idx);
-                        if (!scalar_result.ok()) {
-                            // Can't retrieve the scalar for some reason
-                            rowLine << "[ERROR: " << scalar_result.status().ToString() << "]";
-                        } else {
-                            auto scalar = *scalar_result;
-                            if (scalar->is_valid) {
-                                // Convert the scalar to string
-                                rowLine << scalar->ToString();
-                            } else {
-                                rowLine << "NULL";
-                            }
-                        }
-                    } else {
-                        rowLine << "[out_of_range]";
-                    }
-                }
+        Shard() { clear(); }
 
-                if (col_idx < num_columns - 1) {
-                    rowLine << " | ";
+        void clear() {
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                nanos[i]  = 0;
+                events[i] = 0;
+                for (auto& b : buckets[i]) {
+                    b = 0;
                 }
             }
-            rowLine << "\n";
+            for (auto& c : counters) {
+                c = 0;
+            }
+        }
+    };
+
+    // shards outlive their threads so finished workers still count
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
 
-            // push to chunker
-            auto lineStr = rowLine.str();
-            chunker.pushData(lineStr.data(), lineStr.size());
+    Shard& local() {
+        thread_local Shard* shard = nullptr;
+        if (!shard) {
+            auto s = std::make_unique<Shard>();
+            shard = s.get();
+            std::lock_guard<std::mutex> lock(mutex_);
+            shards_.push_back(std::move(s));
         }
+        return *shard;
     }
 
-    return true;
-}
+    // single writer per shard: a plain load/store pair, readers see either value
+    static void bump(std::atomic<uint64_t>& v, uint64_t n) {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
 
+static StageStats g_stageStats;
+static bool g_timeStages = false;
 
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage) : stage_(stage) {
+        if (g_timeStages) {
+            StageTimer*& running = current();
+            if (!running || stage == STAGE_POOL || stage == STAGE_WAIT) {
+                active_  = true;
+                outer_   = running;
+                running  = this;
+                start_   = std::chrono::steady_clock::now();
+            }
+        }
+    }
 
+    ~StageTimer() {
+        if (active_) {
+            auto elapsed = std::chrono::steady_clock::now() - start_;
+            uint64_t ns = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            current() = outer_;
+            if (outer_) {
+                outer_->waited_ += ns;
+            }
+            g_stageStats.record(stage_, ns - std::min(ns, waited_));
+        }
+    }
 
-// -----------------------------------------------------------------------------
-// 8) Help message
-// -----------------------------------------------------------------------------
-void print_help(const char* progName) {
-    std::cout << R"(
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
 
- ██████╗██╗  ██╗██╗   ██╗███╗   ██╗██╗  ██╗
-██╔════╝██║  ██║██║   ██║████╗  ██║██║ ██╔╝
-██║     ███████║██║   ██║██╔██╗ ██║█████╔╝
-██║     ██╔══██║██║   ██║██║╚██╗██║██╔═██╗
-╚██████╗██║  ██║╚██████╔╝██║ ╚████║██║  ██╗
- ╚═════╝╚═╝  ╚═╝ ╚═════╝ ╚═╝  ╚═══╝╚═╝  ╚═╝
+private:
+    Stage stage_;
+    bool active_ = false;
+    StageTimer* outer_ = nullptr; // the timer this wait interrupted
+    uint64_t waited_ = 0;         // ns spent in waits inside this timer
+    std::chrono::steady_clock::time_point start_;
 
-)" << "\n";
+    // the innermost timer that records on this thread
+    static StageTimer*& current() {
+        thread_local StageTimer* t = nullptr;
+        return t;
+    }
+};
 
-std::cout << "\n--- Chunk Stream Program ---\n\n"
-<< "Usage:\n"
-<< "  " << progName << " <file1> [file2 ...]\n\n"
-<< "Description:\n"
-<< "  - Reads each file using external tools if needed (PDF, DOC, DOCX, ODT, RTF) or\n"
-<< "    direct read (CSV, TXT).\n"
-<< "  - Streams all data in ~5MB chunks, writes them as <sha512>_<timestamp>.txt\n"
-<< "    in a directory under /tmp (like /tmp/chunked/chunked_<timestamp>).\n"
-<< "  - Up to ~500MB total buffers are possible if multiple chunks are filling.\n\n"
-<< "Requirements:\n"
-<< "  - OpenSSL (libssl-dev) for SHA-512.\n"
-<< "  - External commands: pdftotext, doc2txt, odt2txt, unrtf.\n\n"
-<< "Example:\n"
-<< "  " << progName << " big_file.pdf notes.csv doc1.docx\n\n";
+// record_since - one `stage` event lasting from `start` until now, for spans
+// that are not a scope on one thread (a converter process)
+static void record_since(Stage stage, std::chrono::steady_clock::time_point start) {
+    if (g_timeStages) {
+        g_stageStats.record(stage, static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count()));
+    }
 }
 
 // -----------------------------------------------------------------------------
-// 9) Main
+// 4) Data structure: A single chunk buffer
 // -----------------------------------------------------------------------------
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        print_help(argv[0]);
-        return 0;
+struct ChunkBuffer {
+    struct Free {
+        void operator()(char* p) const { std::free(p); }
+    };
+    std::unique_ptr<char, Free> data; // `alignment`-aligned, see allocate()
+    size_t capacity;
+    size_t used;
+
+    // a view chunk owns no storage: it points into memory kept alive by
+    // keepAlive (e.g. a mapped input file) and is never returned to the pool
+    const char* external = nullptr;
+    std::shared_ptr<const void> keepAlive;
+
+    uint32_t source = 0; // input file id, see FlushStage::addSource
+    uint64_t seq    = 0; // chunk number within the source
+    uint64_t offset = 0; // where the chunk starts in the source's text
+
+    explicit ChunkBuffer(size_t cap, size_t alignment = 64)
+    : data(allocate(cap, alignment)), capacity(cap), used(0) {}
+
+    static std::unique_ptr<ChunkBuffer> view(const char* ptr, size_t len,
+                                             std::shared_ptr<const void> owner) {
+        auto buf = std::make_unique<ChunkBuffer>(0);
+        buf->external  = ptr;
+        buf->used      = len;
+        buf->keepAlive = std::move(owner);
+        return buf;
     }
 
-    // Create an output directory in /tmp
-    std::time_t now = std::time(nullptr);
-    std::ostringstream dirss;
-    dirss << "/tmp/chunked_" << now;
-    g_outputDir = dirss.str();
+    const char* bytes() const { return external ? external : data.get(); }
 
-    if (mkdir(g_outputDir.c_str(), 0777) && errno != EEXIST) {
-        std::cerr << "Error: Could not create directory: " << g_outputDir << "\n";
-        return 1;
+    void clear() { used = 0; }
+
+private:
+    static char* allocate(size_t cap, size_t alignment) {
+        void* p = nullptr;
+        if (cap > 0 && posix_memalign(&p, alignment, cap) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<char*>(p);
     }
+};
 
-    std::cout << "Chunks will be written to: " << g_outputDir << "\n";
+// filled buffers handed over together, one chunk each
+using ChunkBatch = std::vector<std::unique_ptr<ChunkBuffer>>;
 
-    // Create a buffer pool (100 buffers => ~500MB if all in use)
-    BufferPool bufferPool(NUM_BUFFERS, CHUNK_LIMIT);
+// -----------------------------------------------------------------------------
+// 5) BufferPool - hands out chunk buffers, allocating them lazily up to a
+//    high-water mark; acquireBuffer() blocks once that many are checked out
+// -----------------------------------------------------------------------------
+class BufferPool {
+public:
+    BufferPool(size_t maxBuffers, size_t bufferSize, size_t alignment = 64)
+    : bufferSize_(bufferSize), alignment_(alignment),
+      maxBuffers_(std::max<size_t>(1, maxBuffers)) {}
 
-    // Process each file
-    for (int i = 1; i < argc; ++i) {
-        std::string filePath = argv[i];
-        std::cout << "\nProcessing file: " << filePath << "\n";
+    std::unique_ptr<ChunkBuffer> acquireBuffer() {
+        ChunkBatch one;
+        acquireBuffers(1, one);
+        return std::move(one.back());
+    }
 
-        // Derive extension
-        std::string extension;
+    // acquireBuffers - append between 1 and n buffers to `out`: free ones
+    // first, then new allocations up to the high-water mark. Blocks only
+    // while there is none at all.
+    void acquireBuffers(size_t n, ChunkBatch& out) {
+        size_t grow;
         {
-            size_t pos = filePath.rfind('.');
-            if (pos != std::string::npos) {
-                extension = filePath.substr(pos + 1);
-                std::transform(extension.begin(), extension.end(),
-                               extension.begin(), ::tolower);
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto ready = [this] { return !freeBuffers_.empty() || allocated_ < maxBuffers_; };
+            if (!ready()) {
+                StageTimer timer(STAGE_POOL); // only waits count, not the fast path
+                available_.wait(lock, ready);
+            }
+            for (; n > 0 && !freeBuffers_.empty(); n--) {
+                out.push_back(std::move(freeBuffers_.back()));
+                freeBuffers_.pop_back();
             }
+            // allocate outside the lock; the slots are reserved by bumping the count
+            grow = std::min(n, maxBuffers_ - allocated_);
+            allocated_ += grow;
         }
+        for (size_t i = 0; i < grow; i++) {
+            try {
+                out.push_back(std::make_unique<ChunkBuffer>(bufferSize_, alignment_));
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    allocated_ -= grow - i;
+                }
+                available_.notify_all();
+                if (out.empty()) {
+                    throw;
+                }
+                break;
+            }
+        }
+        for (auto& buf : out) {
+            buf->clear();
+        }
+    }
 
-        // Acquire a chunker for this file
-        Chunker chunker(bufferPool, g_outputDir);
+    // may be called from any thread (buffers come back from the flush workers)
+    void releaseBuffer(std::unique_ptr<ChunkBuffer> buf) {
+        if (buf->external) {
+            return; // view chunk: dropping it releases the mapping reference
+        }
+        buf->clear();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            freeBuffers_.push_back(std::move(buf));
+        }
+        available_.notify_one();
+    }
 
-        bool success = false;
-        if (extension == "pdf") {
-            success = stream_pdf(filePath, chunker);
-        } else if (extension == "doc" || extension == "docx") {
-            success = stream_doc(filePath, chunker);
+    // releaseBuffers - releaseBuffer() for a whole batch under one lock;
+    // empty slots are skipped and `bufs` is left empty
+    void releaseBuffers(ChunkBatch& bufs) {
+        size_t released = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& buf : bufs) {
+                if (buf && !buf->external) {
+                    buf->clear();
+                    freeBuffers_.push_back(std::move(buf));
+                    released++;
+                }
+            }
+        }
+        bufs.clear();
+        if (released == 1) {
+            available_.notify_one();
+        } else if (released > 1) {
+            available_.notify_all();
+        }
+    }
+
+    size_t capacity() const { return maxBuffers_; }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable available_;
+    size_t bufferSize_;
+    size_t alignment_;
+    size_t maxBuffers_;
+    size_t allocated_ = 0;
+    std::vector<std::unique_ptr<ChunkBuffer>> freeBuffers_;
+};
+
+// -----------------------------------------------------------------------------
+// 6) HashIndex - persistent open-addressing table of chunk digests, memory-mapped
+//    from disk, so chunks already written by an earlier run can be skipped
+// -----------------------------------------------------------------------------
+class HashIndex {
+public:
+    static constexpr size_t KEY_BYTES = 32; // leading 256 bits of the digest
+
+    struct Entry {
+        unsigned char key[KEY_BYTES];
+        uint64_t size;      // 0 => empty slot, TOMBSTONE => removed
+        uint64_t firstSeen; // unix time the chunk was first written
+    };
+
+    HashIndex(const std::string& path, HashAlgo algo) : path_(path), algo_(algo) {
+        try {
+            openFile();
+        } catch (...) {
+            // no destructor runs for a constructor that throws
+            if (fd_ >= 0) {
+                ::close(fd_); // drops the lock too
+            }
+            throw;
+        }
+    }
+
+    ~HashIndex() {
+        if (header_) {
+            msync(header_, fileSize(header_->capacity), MS_SYNC);
+            munmap(header_, fileSize(header_->capacity));
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    HashIndex(const HashIndex&) = delete;
+    HashIndex& operator=(const HashIndex&) = delete;
+
+    // insertIfAbsent - claim a digest; returns false (and fills *existing) when
+    // it was already known
+    bool insertIfAbsent(const std::string& hexDigest, uint64_t size, uint64_t now,
+                        Entry* existing) {
+        Entry probe;
+        makeKey(hexDigest, probe.key);
+        std::lock_guard<std::mutex> lock(mutex_);
+        // tombstones lengthen probes just like live entries, so both count
+        // toward the load factor
+        if ((header_->count + header_->tombstones + 1) * 10 > header_->capacity * 7) {
+            rebuild();
+        }
+        Entry* free = nullptr;
+        Entry* slot = find(probe.key, &free);
+        if (slot) {
+            if (existing) {
+                *existing = *slot;
+            }
+            return false;
+        }
+        if (!free) {
+            // only when the tombstone count of an older index fell short
+            rebuild();
+            find(probe.key, &free);
+        }
+        if (free->size == TOMBSTONE && header_->tombstones > 0) {
+            header_->tombstones--;
+        }
+        std::memcpy(free->key, probe.key, KEY_BYTES);
+        free->size      = size;
+        free->firstSeen = now;
+        header_->count++;
+        return true;
+    }
+
+    // forget - drop a digest again, e.g. when writing its chunk failed
+    void forget(const std::string& hexDigest) {
+        Entry probe;
+        makeKey(hexDigest, probe.key);
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry* slot = find(probe.key, nullptr);
+        if (slot) {
+            remove(*slot);
+        }
+    }
+
+    // forgetSince - drop every digest first seen at or after `since` that is
+    // not in `keep` (hex digests): what an interrupted run claimed but never
+    // committed. Returns how many were dropped.
+    size_t forgetSince(uint64_t since, const std::unordered_set<std::string>& keep) {
+        std::unordered_set<std::string> keepKeys;
+        for (const std::string& hexDigest : keep) {
+            unsigned char key[KEY_BYTES];
+            makeKey(hexDigest, key);
+            keepKeys.emplace(reinterpret_cast<const char*>(key), KEY_BYTES);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t dropped = 0;
+        for (uint64_t i = 0; i < header_->capacity; i++) {
+            Entry& e = slots_[i];
+            if (e.size != 0 && e.size != TOMBSTONE && e.firstSeen >= since &&
+                !keepKeys.count(std::string(reinterpret_cast<const char*>(e.key), KEY_BYTES))) {
+                remove(e);
+                dropped++;
+            }
+        }
+        return dropped;
+    }
+
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t keyBytes;
+        uint32_t hashAlgo; // digests from different algorithms never mix
+        uint32_t tombstones; // removed slots (written as 0 by older versions)
+        uint64_t capacity; // slots, power of two
+        uint64_t count;    // live entries
+    };
+
+    static constexpr const char* MAGIC      = "CHUNKIDX";
+    static const uint32_t VERSION           = 2;
+    static const uint64_t INITIAL_CAPACITY  = 1 << 16;
+    static const uint64_t TOMBSTONE         = ~uint64_t(0);
+
+    std::string path_;
+    HashAlgo algo_;
+    int fd_ = -1;
+    Header* header_ = nullptr;
+    Entry* slots_   = nullptr;
+    std::mutex mutex_;
+
+    static size_t fileSize(uint64_t capacity) {
+        return sizeof(Header) + capacity * sizeof(Entry);
+    }
+
+    static void makeKey(const std::string& hexDigest, unsigned char* key) {
+        std::memset(key, 0, KEY_BYTES);
+        auto nibble = [](char c) -> unsigned char {
+            return static_cast<unsigned char>(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+        };
+        for (size_t i = 0; i < KEY_BYTES && 2 * i + 1 < hexDigest.size(); i++) {
+            key[i] = static_cast<unsigned char>((nibble(hexDigest[2 * i]) << 4) |
+                                                nibble(hexDigest[2 * i + 1]));
+        }
+    }
+
+    void remove(Entry& e) {
+        e.size = TOMBSTONE;
+        header_->count--;
+        if (header_->tombstones < UINT32_MAX) {
+            header_->tombstones++;
+        }
+    }
+
+    // linear probing; *free receives the first reusable slot when not found
+    // (nullptr only if the table has no empty slot and no tombstone left)
+    Entry* find(const unsigned char* key, Entry** free) {
+        uint64_t mask = header_->capacity - 1;
+        uint64_t h;
+        std::memcpy(&h, key, sizeof(h));
+        Entry* firstTombstone = nullptr;
+        uint64_t i = h & mask;
+        for (uint64_t n = 0; n < header_->capacity; n++, i = (i + 1) & mask) {
+            Entry& e = slots_[i];
+            if (e.size == 0) {
+                if (free) {
+                    *free = firstTombstone ? firstTombstone : &e;
+                }
+                return nullptr;
+            }
+            if (e.size == TOMBSTONE) {
+                if (!firstTombstone) {
+                    firstTombstone = &e;
+                }
+            } else if (std::memcmp(e.key, key, KEY_BYTES) == 0) {
+                return &e;
+            }
+        }
+        if (free) {
+            *free = firstTombstone;
+        }
+        return nullptr;
+    }
+
+    // openFile - open and lock the index file, then map it (a new table when
+    // it is empty); throws, leaving fd_ for the constructor to close
+    void openFile() {
+        struct stat st;
+        for (bool waited = false;;) {
+            fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd_ < 0) {
+                throw std::runtime_error("Could not open hash index " + path_ + ": " +
+                                         std::strerror(errno));
+            }
+            // one chunk process per index at a time; the table is not shared live
+            if (flock(fd_, LOCK_EX | LOCK_NB) != 0) {
+                if (!waited) {
+                    std::lock_guard<std::mutex> lock(g_logMutex);
+                    std::cerr << "Waiting for hash index lock: " << path_ << "\n";
+                }
+                waited = true;
+                flock(fd_, LOCK_EX);
+            }
+            if (fstat(fd_, &st) != 0) {
+                throw std::runtime_error("Could not stat hash index " + path_);
+            }
+            // the holder may have grown the table and renamed a new file over
+            // the one this lock is on; then wait for the new file's lock
+            struct stat current;
+            if (stat(path_.c_str(), &current) == 0 && current.st_ino == st.st_ino &&
+                current.st_dev == st.st_dev) {
+                break;
+            }
+            ::close(fd_);
+        }
+        if (st.st_size == 0) {
+            mapFile(fd_, INITIAL_CAPACITY, true);
+        } else {
+            if (static_cast<size_t>(st.st_size) < sizeof(Header)) {
+                throw std::runtime_error("Hash index is truncated: " + path_);
+            }
+            Header h;
+            if (pread(fd_, &h, sizeof(h), 0) != static_cast<ssize_t>(sizeof(h)) ||
+                std::memcmp(h.magic, MAGIC, sizeof(h.magic)) != 0 || h.version != VERSION ||
+                h.capacity == 0 || (h.capacity & (h.capacity - 1)) != 0 ||
+                static_cast<size_t>(st.st_size) < fileSize(h.capacity)) {
+                throw std::runtime_error("Not a valid chunk hash index: " + path_);
+            }
+            if (h.hashAlgo != static_cast<uint32_t>(algo_)) {
+                throw std::runtime_error("Hash index " + path_ + " holds " +
+                                         hash_algo_name(static_cast<HashAlgo>(h.hashAlgo)) +
+                                         " digests, not " + hash_algo_name(algo_));
+            }
+            mapFile(fd_, h.capacity, false);
+        }
+    }
+
+    void mapFile(int fd, uint64_t capacity, bool init) {
+        size_t bytes = fileSize(capacity);
+        if (init && ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+            throw std::runtime_error("Could not size hash index " + path_ + ": " +
+                                     std::strerror(errno));
+        }
+        void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            throw std::runtime_error("Could not map hash index " + path_ + ": " +
+                                     std::strerror(errno));
+        }
+        header_ = static_cast<Header*>(mem);
+        slots_  = reinterpret_cast<Entry*>(static_cast<char*>(mem) + sizeof(Header));
+        if (init) {
+            std::memcpy(header_->magic, MAGIC, sizeof(header_->magic));
+            header_->version  = VERSION;
+            header_->keyBytes = KEY_BYTES;
+            header_->hashAlgo = static_cast<uint32_t>(algo_);
+            header_->tombstones = 0;
+            header_->capacity = capacity;
+            header_->count    = 0;
+        }
+    }
+
+    // rebuild - rehash without tombstones into a table twice the size (or the
+    // same size, when mostly tombstones filled it), written beside the index
+    // and renamed over it so a crash never leaves a half-built table behind.
+    // The rename happens under the lock of the new file, so a process waiting
+    // for the old one finds the new inode afterwards.
+    void rebuild() {
+        uint64_t oldCapacity = header_->capacity;
+        uint64_t capacity = header_->count * 10 < oldCapacity * 4 ? oldCapacity
+                                                                  : oldCapacity * 2;
+        std::string tmpPath = path_ + ".grow";
+        int newFd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (newFd < 0) {
+            throw std::runtime_error("Could not grow hash index " + path_ + ": " +
+                                     std::strerror(errno));
+        }
+        Header* oldHeader = header_;
+        Entry* oldSlots   = slots_;
+        auto restore = [&] {
+            if (header_ != oldHeader) {
+                munmap(header_, fileSize(header_->capacity));
+            }
+            ::close(newFd);
+            unlink(tmpPath.c_str());
+            header_ = oldHeader;
+            slots_  = oldSlots;
+        };
+        try {
+            mapFile(newFd, capacity, true);
+        } catch (...) {
+            restore();
+            throw;
+        }
+        for (uint64_t i = 0; i < oldCapacity; i++) {
+            const Entry& e = oldSlots[i];
+            if (e.size == 0 || e.size == TOMBSTONE) {
+                continue;
+            }
+            Entry* free = nullptr;
+            find(e.key, &free);
+            *free = e;
+            header_->count++;
+        }
+        msync(header_, fileSize(header_->capacity), MS_SYNC);
+        flock(newFd, LOCK_EX);
+        if (rename(tmpPath.c_str(), path_.c_str()) != 0) {
+            int err = errno;
+            restore();
+            throw std::runtime_error("Could not replace hash index " + path_ + ": " +
+                                     std::strerror(err));
+        }
+        munmap(oldHeader, fileSize(oldCapacity));
+        ::close(fd_);
+        fd_ = newFd;
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 7) Near-duplicate detection (--near-dup tag|drop). Every chunk gets a MinHash
+//    sketch of its 8-byte shingles built with one-permutation hashing: one
+//    hash per shingle, kept as the minimum of the bin its top bits select, so
+//    the work per byte does not grow with the sketch. Sketches are banded into
+//    an in-memory LSH table; a candidate whose estimated Jaccard similarity
+//    reaches the threshold makes the new chunk a near duplicate of it.
+// -----------------------------------------------------------------------------
+enum class NearDupMode { Off, Tag, Drop };
+
+class NearDupIndex {
+public:
+    static const size_t SKETCH_BINS   = 128;
+    static const size_t BANDS         = 16; // of SKETCH_BINS / BANDS bins each
+    static const size_t SHINGLE_BYTES = 8;
+
+    using Sketch = std::array<uint32_t, SKETCH_BINS>;
+
+    // the earlier chunk a near duplicate resembles
+    struct Match {
+        std::string of;        // its digest
+        double similarity = 0; // estimated Jaccard similarity
+    };
+
+    NearDupIndex(NearDupMode mode, double threshold) : mode_(mode), threshold_(threshold) {}
+
+    NearDupMode mode() const { return mode_; }
+
+    static const uint32_t NONE = UINT32_MAX;
+
+    // check - true with `match` filled in when the chunk is a near duplicate
+    // of one seen before; otherwise it is remembered under `digest` as `id`
+    // (NONE for chunks shorter than a shingle, which are never near
+    // duplicates). In drop mode a remembered chunk only matches once it is
+    // written(), so nothing is dropped in favour of a chunk whose write fails.
+    bool check(const char* data, size_t n, const std::string& digest, Match& match,
+               uint32_t& id) {
+        id = NONE;
+        Sketch s;
+        if (!sketch(data, n, s)) {
+            return false;
+        }
+        std::array<uint64_t, BANDS> keys;
+        for (size_t b = 0; b < BANDS; b++) {
+            keys[b] = bandKey(s, b);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t best = SIZE_MAX;
+        double bestSimilarity = 0;
+        std::array<uint32_t, BANDS> seen;
+        size_t seenCount = 0;
+        for (size_t b = 0; b < BANDS; b++) {
+            auto it = bands_[b].find(keys[b]);
+            if (it == bands_[b].end() || (mode_ == NearDupMode::Drop && !written_[it->second]) ||
+                std::find(seen.begin(), seen.begin() + seenCount, it->second) !=
+                    seen.begin() + seenCount) {
+                continue;
+            }
+            seen[seenCount++] = it->second;
+            double similarity = estimate(s, sketches_[it->second]);
+            if (similarity > bestSimilarity) {
+                bestSimilarity = similarity;
+                best = it->second;
+            }
+        }
+        if (best != SIZE_MAX && bestSimilarity >= threshold_) {
+            match.of = digests_[best];
+            match.similarity = bestSimilarity;
+            return true;
+        }
+        id = static_cast<uint32_t>(sketches_.size());
+        sketches_.push_back(s);
+        digests_.push_back(digest);
+        written_.push_back(false);
+        for (size_t b = 0; b < BANDS; b++) {
+            bands_[b].emplace(keys[b], id); // a bucket keeps its first chunk
+        }
+        return false;
+    }
+
+    // written - the chunk remembered as `id` is stored
+    void written(uint32_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        written_[id] = true;
+    }
+
+    // failed - the chunk remembered as `id` could not be stored; it leaves
+    // the table, so the chunks that resemble it are written instead
+    void failed(uint32_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t b = 0; b < BANDS; b++) {
+            auto it = bands_[b].find(bandKey(sketches_[id], b));
+            if (it != bands_[b].end() && it->second == id) {
+                bands_[b].erase(it);
+            }
+        }
+        digests_[id].clear();
+    }
+
+private:
+    static constexpr size_t SHINGLE_BLOCK = 256;
+
+    NearDupMode mode_;
+    double threshold_;
+    std::mutex mutex_;
+    std::vector<Sketch> sketches_;
+    std::vector<std::string> digests_;
+    std::vector<bool> written_;
+    std::array<std::unordered_map<uint64_t, uint32_t>, BANDS> bands_;
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // sketch - the shingles are hashed a block at a time into a scratch array
+    // (a loop without dependences between iterations, which the compiler
+    // vectorizes where the target has 64-bit multiplies) and then folded
+    // into the bins; empty bins borrow from the next filled one
+    static bool sketch(const char* data, size_t n, Sketch& out) {
+        if (n < SHINGLE_BYTES) {
+            return false;
+        }
+        out.fill(UINT32_MAX);
+        uint64_t hashes[SHINGLE_BLOCK];
+        size_t shingles = n - SHINGLE_BYTES + 1;
+        for (size_t base = 0; base < shingles; base += SHINGLE_BLOCK) {
+            size_t m = std::min(SHINGLE_BLOCK, shingles - base);
+            for (size_t i = 0; i < m; i++) {
+                uint64_t x;
+                std::memcpy(&x, data + base + i, sizeof(x));
+                hashes[i] = mix(x);
+            }
+            for (size_t i = 0; i < m; i++) {
+                uint32_t& bin = out[hashes[i] >> 57];
+                bin = std::min(bin, static_cast<uint32_t>(hashes[i]));
+            }
+        }
+        Sketch filled = out;
+        for (size_t i = 0; i < SKETCH_BINS; i++) {
+            for (size_t d = 1; out[i] == UINT32_MAX && d < SKETCH_BINS; d++) {
+                uint32_t v = filled[(i + d) % SKETCH_BINS];
+                if (v != UINT32_MAX) {
+                    out[i] = v + static_cast<uint32_t>(d) * 0x9e3779b9u;
+                }
+            }
+        }
+        return true;
+    }
+
+    static uint64_t bandKey(const Sketch& s, size_t band) {
+        const size_t rows = SKETCH_BINS / BANDS;
+        uint64_t key = band;
+        for (size_t r = 0; r < rows; r++) {
+            key = mix(key ^ s[band * rows + r]);
+        }
+        return key;
+    }
+
+    static double estimate(const Sketch& a, const Sketch& b) {
+        size_t same = 0;
+        for (size_t i = 0; i < SKETCH_BINS; i++) {
+            same += a[i] == b[i];
+        }
+        return static_cast<double>(same) / SKETCH_BINS;
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 8) Chunk sinks - where the flush workers put a hashed chunk. DirectorySink
+//    writes one <hash>_<timestamp>.txt per chunk, under a temporary name that
+//    is renamed once the chunk is complete (and, for the run journal, synced
+//    to disk before that); SegmentSink (--output
+//    segments) appends chunks to large segment files and records each one in
+//    a fixed-size, memory-mappable index.
+// -----------------------------------------------------------------------------
+// pwrite_all - pwrite that retries short writes and EINTR
+static bool pwrite_all(int fd, const char* data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = ::pwrite(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+        offset += n;
+    }
+    return true;
+}
+
+class ChunkSink {
+public:
+    virtual ~ChunkSink() = default;
+
+    // addSource - input `id` starts; ids are handed out from 0 in order by
+    // FlushStage::addSource and every chunk of the input carries its id
+    virtual void addSource(uint32_t /*id*/, const std::string& /*path*/) {}
+
+    // write - store one chunk; `where` describes the location for the log
+    // (or the failed target). Called from several flush workers at once.
+    virtual bool write(const std::string& hexDigest, const char* data, size_t len,
+                       uint32_t source, std::string& where) = 0;
+
+    // submit - store a chunk and report the outcome through done(ok, where,
+    // errno). The default writes synchronously. An asynchronous sink takes
+    // `buf`, calls done() from its own thread and returns the buffer to the
+    // pool once the chunk is on disk.
+    using WriteDone = std::function<void(bool, const std::string&, int)>;
+    virtual void submit(const std::string& hexDigest, std::unique_ptr<ChunkBuffer>& buf,
+                        const WriteDone& done) {
+        std::string where;
+        bool ok = write(hexDigest, buf->bytes(), buf->used, buf->source, where);
+        done(ok, where, ok ? 0 : errno);
+    }
+
+    // submitBatch - submit() for several chunks; sinks that can store a batch
+    // with fewer system calls override it. A sink that keeps a buffer moves
+    // it out of its PendingChunk.
+    struct PendingChunk {
+        std::string hexDigest;
+        std::unique_ptr<ChunkBuffer> buf;
+        WriteDone done;
+    };
+    virtual void submitBatch(std::vector<PendingChunk>& batch) {
+        for (PendingChunk& p : batch) {
+            submit(p.hexDigest, p.buf, p.done);
+        }
+    }
+
+    // kick - the flush queue ran empty; start whatever is batched up
+    virtual void kick() {}
+
+    // drain - wait until every submitted chunk has completed
+    virtual void drain() {}
+
+    // detach - the calling thread, which submitted chunks, is about to exit
+    virtual void detach() {}
+
+    // close - finish any metadata; no write() may follow
+    virtual void close() {}
+
+    const std::string& directory() const { return dir_; }
+
+protected:
+    explicit ChunkSink(const std::string& dir) : dir_(dir) {}
+
+    // temp_path - where a chunk is written before it is renamed to `final`,
+    // so a crash never leaves a partial file under a chunk's name
+    static std::string temp_path(const std::string& final) {
+        static std::atomic<uint64_t> counter{0};
+        return final + "." + std::to_string(counter++) + ".tmp";
+    }
+
+private:
+    std::string dir_;
+};
+
+class DirectorySink : public ChunkSink {
+public:
+    // durable: fdatasync every chunk before its rename, so a journal record
+    // naming the file only needs the directory synced
+    DirectorySink(const std::string& dir, bool durable) : ChunkSink(dir), durable_(durable) {}
+
+    bool write(const std::string& hexDigest, const char* data, size_t len,
+               uint32_t /*source*/, std::string& where) override {
+        where = chunkPath(hexDigest);
+        std::string tmp = temp_path(where);
+
+        bool ok;
+        if (durable_) {
+            int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            ok = fd >= 0 && pwrite_all(fd, data, len, 0) && ::fdatasync(fd) == 0;
+            if (fd >= 0) {
+                int err = errno;
+                ::close(fd);
+                errno = err;
+            }
+        } else {
+            std::ofstream ofs(tmp, std::ios::binary);
+            if (ofs.is_open()) {
+                ofs.write(data, len);
+                ofs.close();
+            }
+            ok = static_cast<bool>(ofs);
+        }
+        if (!ok || std::rename(tmp.c_str(), where.c_str()) != 0) {
+            int err = errno;
+            ::unlink(tmp.c_str());
+            errno = err;
+            return false;
+        }
+        return true;
+    }
+
+protected:
+    bool durable_;
+
+    std::string chunkPath(const std::string& hexDigest) const {
+        std::ostringstream fname;
+        fname << directory() << "/" << hexDigest << "_" << std::time(nullptr) << ".txt";
+        return fname.str();
+    }
+};
+
+#ifdef CHUNK_WITH_URING
+// UringSink (--io uring) - the DirectorySink layout written through one
+// io_uring. Each chunk is a linked open -> write -> close on a registered
+// (direct) descriptor slot: flush workers queue the SQEs and submit them in
+// batches, a reaper thread handles the completions and hands buffers back to
+// the pool, so no flush worker waits on the disk. With --direct files are
+// opened O_DIRECT; pool buffers are then page aligned and the write is padded
+// to whole blocks and truncated back to the chunk length afterwards. The
+// reaper renames each finished file from its temporary name into place. When
+// durable, an fdatasync joins the chain (or, for a padded O_DIRECT write,
+// follows the truncate), so the data is on disk before the rename.
+class UringSink : public DirectorySink {
+public:
+    UringSink(const std::string& dir, BufferPool& pool, bool direct, bool durable)
+    : DirectorySink(dir, durable), pool_(pool), direct_(direct)
+    {
+        int rc = io_uring_queue_init(URING_QUEUE_DEPTH * 3, &ring_, 0);
+        if (rc < 0) {
+            throw std::runtime_error(std::string("io_uring_queue_init failed: ") +
+                                     std::strerror(-rc));
+        }
+        rc = io_uring_register_files_sparse(&ring_, URING_QUEUE_DEPTH);
+        if (rc < 0) {
+            io_uring_queue_exit(&ring_);
+            throw std::runtime_error(std::string("io_uring file table (Linux 5.19+): ") +
+                                     std::strerror(-rc));
+        }
+        for (unsigned slot = 0; slot < URING_QUEUE_DEPTH; slot++) {
+            freeSlots_.push_back(slot);
+        }
+        reaper_ = std::thread(&UringSink::reapLoop, this);
+    }
+
+    ~UringSink() override {
+        drain();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            if (!broken_) {
+                io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+                io_uring_prep_nop(sqe);
+                io_uring_sqe_set_data64(sqe, 0); // tells the reaper to exit right away
+                io_uring_submit(&ring_);
+            }
+        }
+        reaper_.join();
+        io_uring_queue_exit(&ring_);
+    }
+
+    void submit(const std::string& hexDigest, std::unique_ptr<ChunkBuffer>& buf,
+                const WriteDone& done) override {
+        auto req = std::make_unique<Request>();
+        req->final  = chunkPath(hexDigest);
+        req->path   = temp_path(req->final);
+        req->length = buf->used;
+        req->done   = done;
+        req->buf    = std::move(buf);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (freeSlots_.empty() && !unsubmitted_.empty()) {
+            submitLocked(lock);
+        }
+        slotFree_.wait(lock, [this] { return !freeSlots_.empty() || broken_; });
+        if (broken_) {
+            lock.unlock();
+            req->done(false, req->final, EIO);
+            pool_.releaseBuffer(std::move(req->buf));
+            return;
+        }
+        req->slot = freeSlots_.back();
+        freeSlots_.pop_back();
+        inFlight_++;
+        queueLocked(req.release());
+        if (unsubmitted_.size() >= URING_SUBMIT_BATCH) {
+            submitLocked(lock);
+        }
+    }
+
+    void kick() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!unsubmitted_.empty()) {
+            submitLocked(lock);
+        }
+    }
+
+    void drain() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!unsubmitted_.empty()) {
+            submitLocked(lock);
+        }
+        idle_.wait(lock, [this] { return inFlight_ == 0 || reaperFailed_; });
+    }
+
+    // detach - io_uring cancels the requests of an exiting thread, so the
+    // thread waits for them first
+    void detach() override {
+        drain();
+    }
+
+private:
+    enum Op : uint64_t { OP_OPEN = 1, OP_WRITE = 2, OP_SYNC = 3, OP_CLOSE = 4 }; // low bits of user_data
+
+    struct alignas(8) Request {
+        std::string path;  // temporary name until complete() renames it
+        std::string final;
+        std::unique_ptr<ChunkBuffer> buf;
+        WriteDone done;
+        size_t length      = 0;
+        size_t writeLength = 0; // length padded to DIRECT_IO_ALIGNMENT for O_DIRECT
+        unsigned slot      = 0;
+        std::atomic<int> pending{0}; // completions still to come
+        int unconsumed     = 0; // SQEs the kernel has not taken yet
+        int lost           = 0; // errno when some of them never will be
+        bool direct        = false;
+        bool ok            = true;
+        int err            = 0;
+        uint64_t failedOp  = 0;
+    };
+
+    BufferPool& pool_;
+    io_uring ring_;
+    std::mutex mutex_; // guards the submission queue and the fields below
+    std::condition_variable slotFree_;
+    std::condition_variable idle_;
+    std::vector<unsigned> freeSlots_;
+    size_t inFlight_    = 0;
+    std::deque<Request*> unsubmitted_; // SQEs queued, not all taken by the kernel
+    bool direct_;
+    bool reaperFailed_ = false;
+    bool broken_       = false; // submission failed for good; nothing more is queued
+    bool stop_         = false;
+    std::thread reaper_;
+
+    // queueLocked - add the open/write[/fdatasync]/close chain of one request
+    // to the SQ
+    void queueLocked(Request* req) {
+        const ChunkBuffer& buf = *req->buf;
+        size_t padded = (req->length + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1);
+        req->direct = direct_ && !buf.external && buf.capacity >= padded &&
+                      reinterpret_cast<uintptr_t>(buf.bytes()) % DIRECT_IO_ALIGNMENT == 0;
+        req->writeLength = req->direct ? padded : req->length;
+        if (req->writeLength > req->length) {
+            std::memset(req->buf->data.get() + req->length, 0, req->writeLength - req->length);
+        }
+        bool sync = durable_ && req->writeLength == req->length;
+        int sqes = sync ? 4 : 3;
+        req->pending    = sqes;
+        req->unconsumed = sqes;
+        req->lost       = 0;
+        req->ok         = true;
+        req->err        = 0;
+        req->failedOp   = 0;
+
+        uint64_t tag = reinterpret_cast<uintptr_t>(req);
+        // no O_CLOEXEC: a direct descriptor never enters the fd table, and the
+        // kernel rejects the flag for it
+        int flags = O_WRONLY | O_CREAT | O_TRUNC | (req->direct ? O_DIRECT : 0);
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+        io_uring_prep_openat_direct(sqe, AT_FDCWD, req->path.c_str(), flags, 0644, req->slot);
+        sqe->flags |= IOSQE_IO_LINK;
+        io_uring_sqe_set_data64(sqe, tag | OP_OPEN);
+
+        sqe = io_uring_get_sqe(&ring_);
+        io_uring_prep_write(sqe, static_cast<int>(req->slot), buf.bytes(),
+                            static_cast<unsigned>(req->writeLength), 0);
+        sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK; // close even if the write fails
+        io_uring_sqe_set_data64(sqe, tag | OP_WRITE);
+
+        if (sync) {
+            sqe = io_uring_get_sqe(&ring_);
+            io_uring_prep_fsync(sqe, static_cast<int>(req->slot), IORING_FSYNC_DATASYNC);
+            sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+            io_uring_sqe_set_data64(sqe, tag | OP_SYNC);
+        }
+
+        sqe = io_uring_get_sqe(&ring_);
+        io_uring_prep_close_direct(sqe, req->slot);
+        io_uring_sqe_set_data64(sqe, tag | OP_CLOSE);
+        unsubmitted_.push_back(req);
+    }
+
+    // submitLocked - hand every queued SQE to the kernel. A full completion
+    // queue or a short-lived lack of memory is waited out with the lock
+    // released, so the reaper can catch up; any other failure ends the sink
+    // and fails the requests the kernel never took.
+    void submitLocked(std::unique_lock<std::mutex>& lock) {
+        int stalls = 0;
+        while (!unsubmitted_.empty() && !broken_) {
+            int rc = io_uring_submit(&ring_);
+            if (rc > 0) {
+                consumedLocked(rc);
+                stalls = 0;
+                continue;
+            }
+            if (rc == -EINTR) {
+                continue;
+            }
+            if ((rc == 0 || rc == -EAGAIN || rc == -EBUSY) && ++stalls < 1000) {
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                lock.lock();
+                continue;
+            }
+            int err = rc < 0 ? -rc : EBUSY;
+            {
+                std::lock_guard<std::mutex> logLock(g_logMutex);
+                std::cerr << "Error: io_uring_submit failed: " << std::strerror(err) << "\n";
+            }
+            failUnsubmittedLocked(lock, err);
+        }
+    }
+
+    // consumedLocked - the kernel took the next `n` SQEs, in queue order
+    void consumedLocked(int n) {
+        while (n > 0 && !unsubmitted_.empty()) {
+            Request* req = unsubmitted_.front();
+            int take = std::min(n, req->unconsumed);
+            req->unconsumed -= take;
+            n -= take;
+            if (req->unconsumed == 0) {
+                unsubmitted_.pop_front();
+            }
+        }
+    }
+
+    void failUnsubmittedLocked(std::unique_lock<std::mutex>& lock, int err) {
+        broken_ = true;
+        slotFree_.notify_all();
+        std::vector<Request*> failed;
+        for (Request* req : unsubmitted_) {
+            // SQEs the kernel took still complete through the reaper
+            req->lost = err;
+            if (req->pending.fetch_sub(req->unconsumed) == req->unconsumed) {
+                failed.push_back(req);
+            }
+        }
+        unsubmitted_.clear();
+        lock.unlock();
+        for (Request* req : failed) {
+            complete(req);
+        }
+        lock.lock();
+    }
+
+    void reapLoop() {
+        for (;;) {
+            io_uring_cqe* cqe = nullptr;
+            // a timeout, so the reaper also stops when the exit NOP cannot be submitted
+            __kernel_timespec wait = { 0, 100 * 1000 * 1000 };
+            int rc = io_uring_wait_cqe_timeout(&ring_, &cqe, &wait);
+            if (rc == -ETIME) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_) {
+                    return;
+                }
+                continue;
+            }
+            if (rc == -EINTR) {
+                continue;
+            }
+            if (rc < 0) {
+                {
+                    std::lock_guard<std::mutex> lock(g_logMutex);
+                    std::cerr << "Error: io_uring_wait_cqe failed: " << std::strerror(-rc) << "\n";
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                reaperFailed_ = true;
+                idle_.notify_all();
+                return;
+            }
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+            io_uring_cqe_seen(&ring_, cqe);
+            if (tag == 0) {
+                return;
+            }
+            Request* req = reinterpret_cast<Request*>(tag & ~uint64_t(7));
+            uint64_t op = tag & 7;
+            if (req->ok && (res < 0 || (op == OP_WRITE &&
+                                        static_cast<size_t>(res) != req->writeLength))) {
+                req->ok       = false;
+                req->err      = res < 0 ? -res : EIO; // the first failure in the chain
+                req->failedOp = op;
+            }
+            if (req->pending.fetch_sub(1) == 1) {
+                complete(req);
+            }
+        }
+    }
+
+    void complete(Request* req) {
+        if (req->lost) {
+            req->ok  = false;
+            req->err = req->lost;
+        }
+        if (!req->ok && req->direct && req->failedOp == OP_OPEN && req->err == EINVAL) {
+            // file system without O_DIRECT (e.g. tmpfs): carry on buffered
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (direct_) {
+                direct_ = false;
+                std::lock_guard<std::mutex> logLock(g_logMutex);
+                std::cerr << "Warning: O_DIRECT not supported in " << directory()
+                << ", writing buffered\n";
+            }
+            if (!broken_) {
+                queueLocked(req);
+                submitLocked(lock);
+                return;
+            }
+            req->err = EIO;
+            lock.unlock();
+        }
+        if (req->ok && req->writeLength != req->length && !truncate(*req)) {
+            req->ok  = false;
+            req->err = errno;
+        }
+        if (req->ok && std::rename(req->path.c_str(), req->final.c_str()) != 0) {
+            req->ok  = false;
+            req->err = errno;
+        }
+        if (!req->ok) {
+            ::unlink(req->path.c_str());
+        }
+        req->done(req->ok, req->final, req->err);
+        pool_.releaseBuffer(std::move(req->buf));
+        unsigned slot = req->slot;
+        delete req;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        freeSlots_.push_back(slot);
+        slotFree_.notify_one();
+        if (--inFlight_ == 0) {
+            idle_.notify_all();
+        }
+    }
+
+    // truncate - cut the padding of an O_DIRECT write; when durable the new
+    // size is synced too, the chain had no fdatasync for it
+    bool truncate(const Request& req) {
+        if (!durable_) {
+            return ::truncate(req.path.c_str(), static_cast<off_t>(req.length)) == 0;
+        }
+        int fd = ::open(req.path.c_str(), O_WRONLY | O_CLOEXEC);
+        bool ok = fd >= 0 && ::ftruncate(fd, static_cast<off_t>(req.length)) == 0 &&
+                  ::fdatasync(fd) == 0;
+        if (fd >= 0) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+        }
+        return ok;
+    }
+};
+#endif
+
+// pwritev_all - pwrite_all for buffers stored back to back from `offset`;
+// `iov` is consumed
+static bool pwritev_all(int fd, std::vector<iovec>& iov, off_t offset) {
+    size_t first = 0;
+    while (first < iov.size()) {
+        int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+        ssize_t n = pwritev(fd, &iov[first], count, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        offset += n;
+        size_t left = static_cast<size_t>(n);
+        while (first < iov.size() && left >= iov[first].iov_len) {
+            left -= iov[first++].iov_len;
+        }
+        if (left > 0) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+            iov[first].iov_len -= left;
+        }
+    }
+    return true;
+}
+
+// SegmentSink layout (integers in host byte order):
+//   segment-NNNNNN.dat  chunk payloads back to back, a new file every --segment-size
+//   chunks.idx          64-byte header, then one Record per chunk in write order;
+//                       an all-zero record is a chunk whose write failed
+//   sources.txt         input paths, line N (from 0) is source id N
+// Workers reserve a payload range and a record slot under a mutex and then
+// pwrite both outside it, so appends from several workers proceed in parallel.
+class SegmentSink : public ChunkSink {
+public:
+    struct Header {
+        char magic[8];        // "CHUNKSEG"
+        uint32_t version;
+        uint32_t recordSize;  // sizeof(Record)
+        uint32_t digestBytes; // significant bytes of Record::digest
+        uint32_t hashAlgo;    // HashAlgo value
+        uint64_t count;       // records, filled in by close()
+        unsigned char reserved[32];
+    };
+
+    struct Record {
+        unsigned char digest[64]; // binary digest, zero-padded
+        uint64_t offset;          // in the segment file
+        uint64_t length;          // stored bytes
+        uint64_t rawLength;       // chunk bytes before compression
+        uint32_t segment;
+        uint32_t source;          // line in sources.txt
+        uint32_t flags;           // FLAG_ZSTD
+        uint32_t reserved;
+    };
+
+    static const uint32_t FLAG_ZSTD = 1;
+
+    SegmentSink(const std::string& dir, uint64_t segmentSize, int zstdLevel)
+    : ChunkSink(dir), segmentSize_(segmentSize), zstdLevel_(zstdLevel)
+    {
+        std::string indexPath = dir + "/chunks.idx";
+        indexFd_ = ::open(indexPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (indexFd_ < 0) {
+            throw std::runtime_error("Could not create " + indexPath + ": " +
+                                     std::strerror(errno));
+        }
+        sources_.open(dir + "/sources.txt", std::ios::trunc);
+        if (!sources_ || !writeHeader()) {
+            ::close(indexFd_);
+            throw std::runtime_error("Could not initialize segment output in " + dir);
+        }
+    }
+
+    ~SegmentSink() override {
+        close();
+    }
+
+    void addSource(uint32_t /*id*/, const std::string& path) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sources_ << path << "\n";
+    }
+
+    bool write(const std::string& hexDigest, const char* data, size_t len,
+               uint32_t source, std::string& where) override {
+        std::vector<Item> items(1);
+        items[0].hexDigest = &hexDigest;
+        items[0].data      = data;
+        items[0].len       = len;
+        items[0].source    = source;
+        store(items);
+        where = items[0].where;
+        return items[0].ok;
+    }
+
+    // submitBatch - the payloads of a batch go out with one pwritev per
+    // segment they land in, and their records with a single pwrite
+    void submitBatch(std::vector<PendingChunk>& batch) override {
+        std::vector<Item> items(batch.size());
+        for (size_t i = 0; i < batch.size(); i++) {
+            items[i].hexDigest = &batch[i].hexDigest;
+            items[i].data      = batch[i].buf->bytes();
+            items[i].len       = batch[i].buf->used;
+            items[i].source    = batch[i].buf->source;
+        }
+        store(items);
+        for (size_t i = 0; i < batch.size(); i++) {
+            batch[i].done(items[i].ok, items[i].where, items[i].ok ? 0 : items[i].err);
+        }
+    }
+
+    void close() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (indexFd_ < 0) {
+            return;
+        }
+        writeHeader();
+        ::close(indexFd_);
+        indexFd_ = -1;
+        segment_.reset();
+        sources_.close();
+    }
+
+private:
+    struct Segment {
+        uint32_t number;
+        std::string path;
+        int fd;
+        Segment(uint32_t n, const std::string& p, int f) : number(n), path(p), fd(f) {}
+        ~Segment() { ::close(fd); }
+    };
+
+    // one chunk on its way through store()
+    struct Item {
+        const std::string* hexDigest = nullptr;
+        const char* data = nullptr;
+        size_t len       = 0;
+        uint32_t source  = 0;
+        Record rec{};
+        const char* payload = nullptr;
+        size_t payloadLen   = 0;
+        std::vector<char> packed; // zstd frame, when smaller
+        std::shared_ptr<Segment> segment;
+        std::string where;
+        bool ok = false;
+        int err = 0;
+    };
+
+    uint64_t segmentSize_;
+    int zstdLevel_;
+    int indexFd_ = -1;
+    std::ofstream sources_;
+    std::mutex mutex_;
+    std::shared_ptr<Segment> segment_; // in-flight writes keep older ones open
+    uint64_t segmentUsed_ = 0;
+    uint32_t nextSegment_ = 0;
+    uint64_t count_       = 0;
+    size_t digestBytes_   = 0;
+
+    // store - reserve payload ranges and consecutive record slots for all
+    // items under the mutex, then write outside it. A chunk whose segment
+    // could not be opened or written keeps an all-zero record.
+    void store(std::vector<Item>& items) {
+        size_t digestBytes = 0;
+        for (Item& it : items) {
+            const std::string& hex = *it.hexDigest;
+            digestBytes = std::min(hex.size() / 2, sizeof(it.rec.digest));
+            auto nibble = [](char c) {
+                return static_cast<unsigned>(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+            };
+            for (size_t i = 0; i < digestBytes; i++) {
+                it.rec.digest[i] = static_cast<unsigned char>((nibble(hex[2 * i]) << 4) |
+                                                              nibble(hex[2 * i + 1]));
+            }
+            it.rec.rawLength = it.len;
+            it.rec.source    = it.source;
+            it.payload       = it.data;
+            it.payloadLen    = it.len;
+#ifdef CHUNK_WITH_ZSTD
+            if (zstdLevel_ > 0 && compress(it.data, it.len, it.packed)) {
+                it.payload    = it.packed.data();
+                it.payloadLen = it.packed.size();
+                it.rec.flags |= FLAG_ZSTD;
+            }
+#endif
+            it.rec.length = it.payloadLen;
+        }
+
+        uint64_t firstSlot;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (Item& it : items) {
+                if (!segment_ ||
+                    (segmentUsed_ > 0 && segmentUsed_ + it.payloadLen > segmentSize_)) {
+                    if (!openSegment()) {
+                        it.where = segmentPath(nextSegment_);
+                        it.err   = errno;
+                        continue;
+                    }
+                }
+                it.segment     = segment_;
+                it.rec.offset  = segmentUsed_;
+                it.rec.segment = segment_->number;
+                segmentUsed_ += it.payloadLen;
+            }
+            digestBytes_ = digestBytes;
+            firstSlot = count_;
+            count_ += items.size();
+        }
+
+        // payloads: consecutive items in one segment are adjacent in the file
+        for (size_t i = 0; i < items.size();) {
+            if (!items[i].segment) {
+                i++;
+                continue;
+            }
+            size_t j = i;
+            std::vector<iovec> iov;
+            for (; j < items.size() && items[j].segment == items[i].segment; j++) {
+                iov.push_back({ const_cast<char*>(items[j].payload), items[j].payloadLen });
+            }
+            bool ok = pwritev_all(items[i].segment->fd, iov,
+                                  static_cast<off_t>(items[i].rec.offset));
+            int err = errno;
+            for (size_t k = i; k < j; k++) {
+                std::ostringstream loc;
+                loc << items[k].segment->path << "@" << items[k].rec.offset;
+                items[k].where = loc.str();
+                items[k].ok    = ok;
+                items[k].err   = ok ? 0 : err;
+            }
+            i = j;
+        }
+
+        std::vector<Record> records(items.size());
+        for (size_t i = 0; i < items.size(); i++) {
+            if (items[i].ok) {
+                records[i] = items[i].rec;
+            }
+        }
+        if (!pwrite_all(indexFd_, reinterpret_cast<const char*>(records.data()),
+                        records.size() * sizeof(Record),
+                        static_cast<off_t>(sizeof(Header) + firstSlot * sizeof(Record)))) {
+            int err = errno;
+            for (Item& it : items) {
+                it.err = it.ok ? err : it.err;
+                it.ok  = false;
+            }
+        }
+    }
+
+    std::string segmentPath(uint32_t number) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/segment-%06u.dat", number);
+        return directory() + name;
+    }
+
+    bool openSegment() {
+        std::string path = segmentPath(nextSegment_);
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        segment_ = std::make_shared<Segment>(nextSegment_++, path, fd);
+        segmentUsed_ = 0;
+        return true;
+    }
+
+    bool writeHeader() {
+        Header h{};
+        std::memcpy(h.magic, "CHUNKSEG", sizeof(h.magic));
+        h.version     = 1;
+        h.recordSize  = sizeof(Record);
+        h.digestBytes = static_cast<uint32_t>(digestBytes_);
+        h.hashAlgo    = static_cast<uint32_t>(g_hashAlgo);
+        h.count       = count_;
+        return pwrite_all(indexFd_, reinterpret_cast<const char*>(&h), sizeof(h), 0);
+    }
+
+#ifdef CHUNK_WITH_ZSTD
+    // compress - zstd frame into `out`; false when it would not save space
+    bool compress(const char* data, size_t len, std::vector<char>& out) const {
+        struct CCtxFree {
+            void operator()(ZSTD_CCtx* c) const { ZSTD_freeCCtx(c); }
+        };
+        thread_local std::unique_ptr<ZSTD_CCtx, CCtxFree> cctx(ZSTD_createCCtx());
+        out.resize(ZSTD_compressBound(len));
+        size_t n = ZSTD_compressCCtx(cctx.get(), out.data(), out.size(), data, len, zstdLevel_);
+        if (ZSTD_isError(n) || n >= len) {
+            return false;
+        }
+        out.resize(n);
+        return true;
+    }
+#endif
+};
+
+static_assert(sizeof(SegmentSink::Header) == 64, "segment index header is 64 bytes");
+static_assert(sizeof(SegmentSink::Record) == 104, "segment index records are fixed size");
+
+// -----------------------------------------------------------------------------
+// 9) Manifest (--manifest) - one row per chunk mapping it back to its source:
+//    source path and format, the chunk's number and byte range within the
+//    source's text, size, digest and where it was stored. Rows are collected
+//    as chunks complete and written MANIFEST_BATCH_ROWS at a time, as JSON
+//    lines or as Parquet row groups.
+// -----------------------------------------------------------------------------
+class Manifest {
+public:
+    struct Row {
+        std::string source;
+        std::string format;
+        uint64_t seq;      // chunk number within the source
+        uint64_t offset;   // first byte of the chunk in the source's text
+        uint64_t size;
+        std::string hash;
+        std::string status;   // written, known (in --index already), near-duplicate or failed
+        std::string location; // chunk file or segment@offset
+        std::string nearOf;   // --near-dup: digest of the chunk this one resembles
+        double similarity = 0;
+    };
+
+    virtual ~Manifest() = default;
+
+    // add - called from the flush workers (and asynchronous sink threads)
+    void add(Row row) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batch_.push_back(std::move(row));
+        if (batch_.size() >= MANIFEST_BATCH_ROWS) {
+            flushBatch();
+        }
+    }
+
+    // close - write the last batch and finish the file; no add() may follow
+    bool close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_) {
+            return ok_;
+        }
+        closed_ = true;
+        flushBatch();
+        ok_ = finish() && ok_;
+        return ok_;
+    }
+
+    const std::string& path() const { return path_; }
+
+protected:
+    explicit Manifest(const std::string& path) : path_(path) {}
+
+    virtual bool writeBatch(const std::vector<Row>& rows) = 0;
+    virtual bool finish() = 0;
+
+private:
+    std::string path_;
+    std::mutex mutex_;
+    std::vector<Row> batch_;
+    bool ok_     = true;
+    bool closed_ = false;
+
+    void flushBatch() {
+        if (batch_.empty()) {
+            return;
+        }
+        if (ok_ && !writeBatch(batch_)) {
+            ok_ = false;
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: could not write manifest " << path_ << "\n";
+        }
+        batch_.clear();
+    }
+};
+
+// json_escape - append `text` to `out` as the body of a JSON string
+static void json_escape(std::string& out, const std::string& text) {
+    static const char HEX[] = "0123456789abcdef";
+    for (unsigned char c : text) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += HEX[c >> 4];
+                    out += HEX[c & 15];
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+}
+
+class JsonlManifest : public Manifest {
+public:
+    explicit JsonlManifest(const std::string& dir) : Manifest(dir + "/manifest.jsonl") {
+        ofs_.open(path(), std::ios::trunc);
+        if (!ofs_) {
+            throw std::runtime_error("Could not create " + path());
+        }
+    }
+
+protected:
+    bool writeBatch(const std::vector<Row>& rows) override {
+        std::string out;
+        for (const Row& r : rows) {
+            out += "{\"source\":\"";
+            json_escape(out, r.source);
+            out += "\",\"format\":\"";
+            json_escape(out, r.format);
+            out += "\",\"seq\":" + std::to_string(r.seq);
+            out += ",\"offset\":" + std::to_string(r.offset);
+            out += ",\"end\":" + std::to_string(r.offset + r.size);
+            out += ",\"size\":" + std::to_string(r.size);
+            out += ",\"hash\":\"" + r.hash;
+            out += "\",\"status\":\"" + r.status;
+            out += "\",\"location\":\"";
+            json_escape(out, r.location);
+            out += '"';
+            if (!r.nearOf.empty()) {
+                char similarity[32];
+                std::snprintf(similarity, sizeof(similarity), "%.3f", r.similarity);
+                out += ",\"near_duplicate_of\":\"" + r.nearOf;
+                out += "\",\"similarity\":";
+                out += similarity;
+            }
+            out += "}\n";
+        }
+        ofs_.write(out.data(), static_cast<std::streamsize>(out.size()));
+        return static_cast<bool>(ofs_);
+    }
+
+    bool finish() override {
+        ofs_.close();
+        return static_cast<bool>(ofs_);
+    }
+
+private:
+    std::ofstream ofs_;
+};
+
+// ParquetManifest - the same columns, one row group per batch
+class ParquetManifest : public Manifest {
+public:
+    explicit ParquetManifest(const std::string& dir)
+    : Manifest(dir + "/manifest.parquet"),
+      schema_(arrow::schema({arrow::field("source", arrow::utf8()),
+                             arrow::field("format", arrow::utf8()),
+                             arrow::field("seq", arrow::int64()),
+                             arrow::field("offset", arrow::int64()),
+                             arrow::field("end", arrow::int64()),
+                             arrow::field("size", arrow::int64()),
+                             arrow::field("hash", arrow::utf8()),
+                             arrow::field("status", arrow::utf8()),
+                             arrow::field("location", arrow::utf8()),
+                             arrow::field("near_duplicate_of", arrow::utf8()),
+                             arrow::field("similarity", arrow::float64())}))
+    {
+        auto out = arrow::io::FileOutputStream::Open(path());
+        if (!out.ok()) {
+            throw std::runtime_error("Could not create " + path() + ": " +
+                                     out.status().ToString());
+        }
+        auto st = parquet::arrow::FileWriter::Open(*schema_, arrow::default_memory_pool(), *out,
+                                                   parquet::default_writer_properties(),
+                                                   &writer_);
+        if (!st.ok()) {
+            throw std::runtime_error("Could not create " + path() + ": " + st.ToString());
+        }
+    }
+
+protected:
+    bool writeBatch(const std::vector<Row>& rows) override {
+        arrow::StringBuilder source, format, hash, status, location, nearOf;
+        arrow::Int64Builder seq, offset, end, size;
+        arrow::DoubleBuilder similarity;
+        arrow::Status st;
+        for (const Row& r : rows) {
+            if (st.ok()) st = source.Append(r.source);
+            if (st.ok()) st = format.Append(r.format);
+            if (st.ok()) st = seq.Append(static_cast<int64_t>(r.seq));
+            if (st.ok()) st = offset.Append(static_cast<int64_t>(r.offset));
+            if (st.ok()) st = end.Append(static_cast<int64_t>(r.offset + r.size));
+            if (st.ok()) st = size.Append(static_cast<int64_t>(r.size));
+            if (st.ok()) st = hash.Append(r.hash);
+            if (st.ok()) st = status.Append(r.status);
+            if (st.ok()) st = location.Append(r.location);
+            if (r.nearOf.empty()) {
+                if (st.ok()) st = nearOf.AppendNull();
+                if (st.ok()) st = similarity.AppendNull();
+            } else {
+                if (st.ok()) st = nearOf.Append(r.nearOf);
+                if (st.ok()) st = similarity.Append(r.similarity);
+            }
+        }
+        std::vector<std::shared_ptr<arrow::Array>> columns(11);
+        if (st.ok()) st = source.Finish(&columns[0]);
+        if (st.ok()) st = format.Finish(&columns[1]);
+        if (st.ok()) st = seq.Finish(&columns[2]);
+        if (st.ok()) st = offset.Finish(&columns[3]);
+        if (st.ok()) st = end.Finish(&columns[4]);
+        if (st.ok()) st = size.Finish(&columns[5]);
+        if (st.ok()) st = hash.Finish(&columns[6]);
+        if (st.ok()) st = status.Finish(&columns[7]);
+        if (st.ok()) st = location.Finish(&columns[8]);
+        if (st.ok()) st = nearOf.Finish(&columns[9]);
+        if (st.ok()) st = similarity.Finish(&columns[10]);
+        if (st.ok()) {
+            auto table = arrow::Table::Make(schema_, columns);
+            st = writer_->WriteTable(*table, static_cast<int64_t>(rows.size()));
+        }
+        return st.ok();
+    }
+
+    bool finish() override {
+        return writer_->Close().ok();
+    }
+
+private:
+    std::shared_ptr<arrow::Schema> schema_;
+    std::unique_ptr<parquet::arrow::FileWriter> writer_;
+};
+
+#ifdef CHUNK_WITH_CURL
+// -----------------------------------------------------------------------------
+// 10) Upload sinks (-DCHUNK_WITH_CURL) - chunks go from their pool buffers
+//    straight to the network instead of to local files. S3Sink (--output s3)
+//    packs them into large objects, each one a multipart upload whose parts
+//    hold many chunks; HttpSink (--output http) POSTs batches of them to an
+//    ingest endpoint. Requests run on one curl multi handle driven by a
+//    transfer thread, at most --upload-concurrency at a time. A request reads
+//    its body from the chunk buffers themselves and hands them back to the
+//    pool once the server has answered.
+// -----------------------------------------------------------------------------
+
+// HttpUrl - scheme://authority/path of an endpoint
+struct HttpUrl {
+    std::string scheme;
+    std::string authority; // host[:port]
+    std::string path;      // from the first '/' on; may be empty
+
+    static bool parse(const std::string& text, HttpUrl& out) {
+        size_t sep = text.find("://");
+        if (sep == std::string::npos) {
+            return false;
+        }
+        out.scheme = text.substr(0, sep);
+        size_t slash = text.find('/', sep + 3);
+        out.authority = text.substr(sep + 3, slash == std::string::npos ? std::string::npos
+                                                                         : slash - sep - 3);
+        out.path = slash == std::string::npos ? "" : text.substr(slash);
+        return (out.scheme == "http" || out.scheme == "https") && !out.authority.empty();
+    }
+
+    std::string origin() const { return scheme + "://" + authority; }
+};
+
+class HttpUploader {
+public:
+    // Request - one HTTP request. The body is sent from `body` in order; its
+    // pieces point into `buffers`, into `owned` or into static storage.
+    struct Request {
+        std::string method = "POST";
+        std::string url;
+        std::vector<std::string> headers;
+        std::vector<iovec> body;
+        std::deque<std::string> owned;
+        ChunkBatch buffers; // back to the pool once the request is finished
+        // finished - HTTP status (0 without a response), response body and
+        // ETag header; runs on the transfer thread
+        std::function<void(long, const std::string&, const std::string&)> finished;
+
+        void add(const char* data, size_t len) {
+            body.push_back({ const_cast<char*>(data), len });
+        }
+        void addOwned(std::string text) {
+            owned.push_back(std::move(text));
+            add(owned.back().data(), owned.back().size());
+        }
+    };
+
+    HttpUploader(BufferPool& pool, size_t concurrency)
+    : pool_(pool), concurrency_(std::max<size_t>(1, concurrency))
+    {
+        static const CURLcode init = curl_global_init(CURL_GLOBAL_DEFAULT);
+        multi_ = init == CURLE_OK ? curl_multi_init() : nullptr;
+        if (!multi_) {
+            throw std::runtime_error("Could not initialize libcurl");
+        }
+        thread_ = std::thread(&HttpUploader::transferLoop, this);
+    }
+
+    ~HttpUploader() {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        curl_multi_wakeup(multi_);
+        thread_.join();
+        curl_multi_cleanup(multi_);
+    }
+
+    HttpUploader(const HttpUploader&) = delete;
+    HttpUploader& operator=(const HttpUploader&) = delete;
+
+    // start - queue a request; blocks while --upload-concurrency requests are
+    // unfinished, which holds the flush workers to the pace of the network
+    void start(std::unique_ptr<Request> req) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        room_.wait(lock, [this] { return active_ < concurrency_; });
+        queueLocked(std::move(req));
+    }
+
+    // startNow - queue a request past the limit (from a finished() callback)
+    void startNow(std::unique_ptr<Request> req) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queueLocked(std::move(req));
+    }
+
+    // wait - until every request has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return active_ == 0; });
+    }
+
+    bool busy() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return active_ > 0;
+    }
+
+    // perform - run a request on the calling thread; returns the HTTP status
+    static long perform(std::unique_ptr<Request> req, std::string& response) {
+        Transfer t;
+        t.req = std::move(req);
+        long status = 0;
+        for (;;) {
+            if (!setup(t)) {
+                cleanup(t);
+                return 0;
+            }
+            CURLcode rc = curl_easy_perform(t.easy);
+            status = 0;
+            curl_easy_getinfo(t.easy, CURLINFO_RESPONSE_CODE, &status);
+            std::string error = describe(t, rc);
+            cleanup(t);
+            if (!retryable(rc, status) || ++t.attempts >= UPLOAD_ATTEMPTS) {
+                report(*t.req, rc, error);
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(t.attempts));
+        }
+        response = std::move(t.response);
+        return status;
+    }
+
+private:
+    struct Transfer {
+        std::unique_ptr<Request> req;
+        CURL* easy = nullptr;
+        curl_slist* headers = nullptr;
+        size_t piece = 0;       // next body piece to send
+        size_t pieceOffset = 0; // bytes of it already sent
+        std::string response;
+        std::string etag;
+        int attempts = 0;
+        std::chrono::steady_clock::time_point retryAt{};
+        char error[CURL_ERROR_SIZE] = {};
+    };
+
+    BufferPool& pool_;
+    size_t concurrency_;
+    CURLM* multi_ = nullptr;
+    std::mutex mutex_;
+    std::condition_variable room_;
+    std::condition_variable idle_;
+    std::deque<std::unique_ptr<Transfer>> waiting_; // new, or due for another attempt
+    size_t active_ = 0; // requests not finished yet
+    bool stop_     = false;
+    std::thread thread_;
+
+    void queueLocked(std::unique_ptr<Request> req) {
+        auto t = std::make_unique<Transfer>();
+        t->req = std::move(req);
+        waiting_.push_back(std::move(t));
+        active_++;
+        curl_multi_wakeup(multi_);
+    }
+
+    void transferLoop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            auto now = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < waiting_.size();) {
+                if (waiting_[i]->retryAt > now) {
+                    i++;
+                    continue;
+                }
+                std::unique_ptr<Transfer> t = std::move(waiting_[i]);
+                waiting_.erase(waiting_.begin() + static_cast<std::ptrdiff_t>(i));
+                if (!setup(*t) || curl_multi_add_handle(multi_, t->easy) != CURLM_OK) {
+                    lock.unlock();
+                    finish(std::move(t), CURLE_OUT_OF_MEMORY, 0);
+                    lock.lock();
+                    continue;
+                }
+                t.release(); // owned by its easy handle (CURLOPT_PRIVATE) until it is done
+            }
+            if (stop_ && active_ == 0) {
+                return;
+            }
+            bool retrying = !waiting_.empty();
+            lock.unlock();
+
+            int running = 0;
+            curl_multi_perform(multi_, &running);
+            int left = 0;
+            while (CURLMsg* msg = curl_multi_info_read(multi_, &left)) {
+                if (msg->msg != CURLMSG_DONE) {
+                    continue;
+                }
+                Transfer* raw = nullptr;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &raw);
+                long status = 0;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+                CURLcode rc = msg->data.result;
+                curl_multi_remove_handle(multi_, msg->easy_handle);
+                finish(std::unique_ptr<Transfer>(raw), rc, status);
+            }
+            curl_multi_poll(multi_, nullptr, 0, retrying ? 100 : 1000, nullptr);
+            lock.lock();
+        }
+    }
+
+    // finish - retry a failed attempt later, or hand the outcome to the request
+    void finish(std::unique_ptr<Transfer> t, CURLcode rc, long status) {
+        std::string error = describe(*t, rc);
+        cleanup(*t);
+        if (retryable(rc, status) && ++t->attempts < UPLOAD_ATTEMPTS) {
+            t->retryAt = std::chrono::steady_clock::now() + std::chrono::seconds(t->attempts);
+            std::lock_guard<std::mutex> lock(mutex_);
+            waiting_.push_back(std::move(t));
+            return;
+        }
+        report(*t->req, rc, error);
+        if (t->req->finished) {
+            t->req->finished(rc == CURLE_OK ? status : 0, t->response, t->etag);
+        }
+        pool_.releaseBuffers(t->req->buffers);
+        t.reset();
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_--;
+        room_.notify_all();
+        if (active_ == 0) {
+            idle_.notify_all();
+        }
+    }
+
+    static bool retryable(CURLcode rc, long status) {
+        return rc != CURLE_OK || status >= 500 || status == 429;
+    }
+
+    static std::string describe(const Transfer& t, CURLcode rc) {
+        return rc == CURLE_OK ? "" : t.error[0] ? t.error : curl_easy_strerror(rc);
+    }
+
+    static void report(const Request& req, CURLcode rc, const std::string& error) {
+        if (rc != CURLE_OK) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: " << req.method << " " << req.url << ": " << error << "\n";
+        }
+    }
+
+    // setup - a fresh easy handle for the next attempt of `t`
+    static bool setup(Transfer& t) {
+        t.easy = curl_easy_init();
+        if (!t.easy) {
+            return false;
+        }
+        const Request& req = *t.req;
+        curl_off_t size = 0;
+        for (const iovec& v : req.body) {
+            size += static_cast<curl_off_t>(v.iov_len);
+        }
+        t.piece = t.pieceOffset = 0;
+        t.response.clear();
+        t.etag.clear();
+        t.error[0] = '\0';
+        for (const std::string& h : req.headers) {
+            t.headers = curl_slist_append(t.headers, h.c_str());
+        }
+        t.headers = curl_slist_append(t.headers, "Expect:"); // no 100-continue round trip
+        curl_easy_setopt(t.easy, CURLOPT_URL, req.url.c_str());
+        curl_easy_setopt(t.easy, CURLOPT_HTTPHEADER, t.headers);
+        curl_easy_setopt(t.easy, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(t.easy, CURLOPT_ERRORBUFFER, t.error);
+        curl_easy_setopt(t.easy, CURLOPT_PRIVATE, &t);
+        if (req.method == "PUT") {
+            curl_easy_setopt(t.easy, CURLOPT_UPLOAD, 1L);
+            curl_easy_setopt(t.easy, CURLOPT_INFILESIZE_LARGE, size);
+        } else if (req.method == "POST") {
+            curl_easy_setopt(t.easy, CURLOPT_POST, 1L);
+            curl_easy_setopt(t.easy, CURLOPT_POSTFIELDSIZE_LARGE, size);
+        } else {
+            curl_easy_setopt(t.easy, CURLOPT_CUSTOMREQUEST, req.method.c_str());
+        }
+        curl_easy_setopt(t.easy, CURLOPT_UPLOAD_BUFFERSIZE, 1024L * 1024);
+        curl_easy_setopt(t.easy, CURLOPT_READFUNCTION, &HttpUploader::readBody);
+        curl_easy_setopt(t.easy, CURLOPT_READDATA, &t);
+        curl_easy_setopt(t.easy, CURLOPT_SEEKFUNCTION, &HttpUploader::rewindBody);
+        curl_easy_setopt(t.easy, CURLOPT_SEEKDATA, &t);
+        curl_easy_setopt(t.easy, CURLOPT_WRITEFUNCTION, &HttpUploader::readResponse);
+        curl_easy_setopt(t.easy, CURLOPT_WRITEDATA, &t);
+        curl_easy_setopt(t.easy, CURLOPT_HEADERFUNCTION, &HttpUploader::readHeader);
+        curl_easy_setopt(t.easy, CURLOPT_HEADERDATA, &t);
+        return true;
+    }
+
+    static void cleanup(Transfer& t) {
+        if (t.easy) {
+            curl_easy_cleanup(t.easy);
+            t.easy = nullptr;
+        }
+        curl_slist_free_all(t.headers);
+        t.headers = nullptr;
+    }
+
+    // readBody - curl's send buffer is filled from the body pieces in turn
+    static size_t readBody(char* out, size_t size, size_t count, void* user) {
+        Transfer& t = *static_cast<Transfer*>(user);
+        const std::vector<iovec>& body = t.req->body;
+        size_t room = size * count;
+        size_t copied = 0;
+        while (copied < room && t.piece < body.size()) {
+            const iovec& v = body[t.piece];
+            size_t take = std::min(room - copied, v.iov_len - t.pieceOffset);
+            std::memcpy(out + copied, static_cast<const char*>(v.iov_base) + t.pieceOffset, take);
+            copied += take;
+            t.pieceOffset += take;
+            if (t.pieceOffset == v.iov_len) {
+                t.piece++;
+                t.pieceOffset = 0;
+            }
+        }
+        return copied;
+    }
+
+    static int rewindBody(void* user, curl_off_t offset, int origin) {
+        if (offset != 0 || origin != SEEK_SET) {
+            return CURL_SEEKFUNC_CANTSEEK;
+        }
+        Transfer& t = *static_cast<Transfer*>(user);
+        t.piece = t.pieceOffset = 0;
+        return CURL_SEEKFUNC_OK;
+    }
+
+    static size_t readResponse(char* data, size_t size, size_t count, void* user) {
+        Transfer& t = *static_cast<Transfer*>(user);
+        size_t n = size * count;
+        if (t.response.size() < 64 * 1024) {
+            t.response.append(data, n);
+        }
+        return n;
+    }
+
+    static size_t readHeader(char* data, size_t size, size_t count, void* user) {
+        Transfer& t = *static_cast<Transfer*>(user);
+        size_t n = size * count;
+        std::string_view line(data, n);
+        if (line.size() > 5 && (line[0] | 0x20) == 'e' && (line[1] | 0x20) == 't' &&
+            (line[2] | 0x20) == 'a' && (line[3] | 0x20) == 'g' && line[4] == ':') {
+            size_t start = line.find_first_not_of(" \t", 5);
+            size_t end = line.find_last_not_of(" \t\r\n");
+            if (start != std::string_view::npos && end >= start) {
+                t.etag = std::string(line.substr(start, end - start + 1));
+            }
+        }
+        return n;
+    }
+};
+
+// UploadSink - what the upload sinks share: write() for callers that hand
+// over bare bytes (the flush stage submits buffers, which are not copied)
+class UploadSink : public ChunkSink {
+public:
+    bool write(const std::string& hexDigest, const char* data, size_t len,
+               uint32_t source, std::string& where) override {
+        auto copy = std::make_shared<std::string>(data, len);
+        std::unique_ptr<ChunkBuffer> buf = ChunkBuffer::view(copy->data(), len, copy);
+        buf->source = source;
+        std::mutex mutex;
+        std::condition_variable doneCv;
+        bool finished = false;
+        bool ok = false;
+        int err = 0;
+        submit(hexDigest, buf, [&](bool result, const std::string& location, int error) {
+            std::lock_guard<std::mutex> lock(mutex);
+            ok = result;
+            where = location;
+            err = error;
+            finished = true;
+            doneCv.notify_all();
+        });
+        drain();
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCv.wait(lock, [&] { return finished; });
+        errno = err;
+        return ok;
+    }
+
+protected:
+    using ChunkSink::ChunkSink;
+};
+
+// S3Signer - AWS Signature Version 4 for S3 requests. Bodies are sent as
+// UNSIGNED-PAYLOAD, so signing never reads the chunks a second time.
+class S3Signer {
+public:
+    S3Signer(std::string accessKey, std::string secretKey, std::string sessionToken,
+             std::string region)
+    : accessKey_(std::move(accessKey)), secretKey_(std::move(secretKey)),
+      sessionToken_(std::move(sessionToken)), region_(std::move(region)) {}
+
+    // sign - add the x-amz-* and Authorization headers to a request for the
+    // URI-encoded `path` and canonical (sorted, encoded) `query` on `authority`
+    void sign(HttpUploader::Request& req, const std::string& authority, const std::string& path,
+              const std::string& query) const {
+        std::time_t now = std::time(nullptr);
+        std::tm tm;
+        gmtime_r(&now, &tm);
+        char amzDate[17];
+        std::strftime(amzDate, sizeof(amzDate), "%Y%m%dT%H%M%SZ", &tm);
+        std::string date(amzDate, 8);
+        std::string scope = date + "/" + region_ + "/s3/aws4_request";
+
+        std::string headers = "host:" + authority +
+                              "\nx-amz-content-sha256:UNSIGNED-PAYLOAD\nx-amz-date:" + amzDate +
+                              "\n";
+        std::string signedHeaders = "host;x-amz-content-sha256;x-amz-date";
+        if (!sessionToken_.empty()) {
+            headers += "x-amz-security-token:" + sessionToken_ + "\n";
+            signedHeaders += ";x-amz-security-token";
+        }
+        std::string canonical = req.method + "\n" + path + "\n" + query + "\n" + headers + "\n" +
+                                signedHeaders + "\nUNSIGNED-PAYLOAD";
+        std::string toSign = "AWS4-HMAC-SHA256\n" + std::string(amzDate) + "\n" + scope + "\n" +
+                             sha256_hex(canonical);
+        std::string key = hmac("AWS4" + secretKey_, date);
+        key = hmac(key, region_);
+        key = hmac(key, "s3");
+        key = hmac(key, "aws4_request");
+        std::string mac = hmac(key, toSign);
+        std::string signature;
+        hex_encode(reinterpret_cast<const unsigned char*>(mac.data()), mac.size(), signature);
+
+        req.headers.push_back("x-amz-content-sha256: UNSIGNED-PAYLOAD");
+        req.headers.push_back(std::string("x-amz-date: ") + amzDate);
+        if (!sessionToken_.empty()) {
+            req.headers.push_back("x-amz-security-token: " + sessionToken_);
+        }
+        req.headers.push_back("Authorization: AWS4-HMAC-SHA256 Credential=" + accessKey_ + "/" +
+                              scope + ", SignedHeaders=" + signedHeaders +
+                              ", Signature=" + signature);
+    }
+
+    // uri_encode - RFC 3986 percent-encoding as SigV4 wants it; `path` keeps '/'
+    static std::string uri_encode(const std::string& text, bool path) {
+        static const char* digits = "0123456789ABCDEF";
+        std::string out;
+        for (unsigned char c : text) {
+            if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+                (path && c == '/')) {
+                out += static_cast<char>(c);
+            } else {
+                out += '%';
+                out += digits[c >> 4];
+                out += digits[c & 0x0F];
+            }
+        }
+        return out;
+    }
+
+private:
+    std::string accessKey_;
+    std::string secretKey_;
+    std::string sessionToken_;
+    std::string region_;
+
+    static std::string hmac(const std::string& key, const std::string& data) {
+        unsigned char out[EVP_MAX_MD_SIZE];
+        unsigned int outLen = 0;
+        HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+             reinterpret_cast<const unsigned char*>(data.data()), data.size(), out, &outLen);
+        return std::string(reinterpret_cast<const char*>(out), outLen);
+    }
+
+    static std::string sha256_hex(const std::string& data) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digestLen = 0;
+        evp_digest(EVP_sha256(), data.data(), data.size(), digest, digestLen);
+        std::string hex;
+        hex_encode(digest, digestLen, hex);
+        return hex;
+    }
+};
+
+// S3Sink (--output s3) - chunks are appended to pack objects
+// <prefix>/<run>/pack-NNNNNN.bin in an S3-compatible bucket (path-style URL
+// https://host/bucket/prefix). Each pack is a multipart upload: the chunks
+// collect into an --upload-batch part, parts upload concurrently, and the
+// upload is completed once --segment-size bytes are packed, or when the flush
+// stage drains at the end of the run.
+// A chunk counts as written when its pack is complete; its location is
+// s3://bucket/key@offset. CreateMultipartUpload runs on the uploader like the
+// parts; parts sealed before it answers wait in the pack. A pack that cannot
+// be started fails its own chunks only, the next chunk starts another one.
+class S3Sink : public UploadSink {
+public:
+    S3Sink(const std::string& dir, BufferPool& pool, const HttpUrl& url, S3Signer signer,
+           uint64_t packSize, size_t partSize, size_t concurrency)
+    : UploadSink(dir), pool_(pool), url_(url), signer_(std::move(signer)), packSize_(packSize),
+      partSize_(partSize), uploader_(pool, concurrency)
+    {
+        std::string path = url.path;
+        path.erase(0, path.find_first_not_of('/'));
+        while (!path.empty() && path.back() == '/') {
+            path.pop_back();
+        }
+        size_t slash = path.find('/');
+        bucket_ = path.substr(0, slash);
+        if (bucket_.empty()) {
+            throw std::runtime_error("--s3-url names no bucket: " + url.origin() + url.path);
+        }
+        // a key prefix per run, named like its local directory
+        prefix_ = slash == std::string::npos ? "" : path.substr(slash + 1) + "/";
+        prefix_ += dir.substr(dir.rfind('/') + 1) + "/";
+    }
+
+    ~S3Sink() override {
+        close();
+    }
+
+    void submit(const std::string& /*hexDigest*/, std::unique_ptr<ChunkBuffer>& buf,
+                const WriteDone& done) override {
+        std::vector<std::unique_ptr<HttpUploader::Request>> requests;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!pack_) {
+                requests.push_back(openPackLocked());
+            }
+            pack_->chunks.push_back({ done, "s3://" + bucket_ + "/" + pack_->key + "@" +
+                                                std::to_string(packUsed_) });
+            packUsed_ += buf->used;
+            partBytes_ += buf->used;
+            part_->add(buf->bytes(), buf->used);
+            part_->buffers.push_back(std::move(buf));
+            if (partBytes_ >= partSize_ || packUsed_ >= packSize_) {
+                for (auto& req : sealLocked(packUsed_ >= packSize_)) {
+                    requests.push_back(std::move(req));
+                }
+            }
+        }
+        for (auto& req : requests) {
+            uploader_.start(std::move(req));
+        }
+    }
+
+    // drain - a chunk only completes with its pack, so the pack being filled
+    // is finished early; the next chunk starts another
+    void drain() override {
+        std::vector<std::unique_ptr<HttpUploader::Request>> requests;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pack_) {
+                requests = sealLocked(true);
+            }
+        }
+        for (auto& req : requests) {
+            uploader_.start(std::move(req));
+        }
+        uploader_.wait();
+    }
+
+    void close() override {
+        drain();
+    }
+
+private:
+    struct Pack {
+        std::string key;
+        std::string uploadId; // empty until CreateMultipartUpload answers
+        std::vector<std::string> etags; // per part, in part order
+        std::vector<std::unique_ptr<HttpUploader::Request>> held; // parts sealed before that
+        size_t partsDone = 0;
+        bool sealed = false; // no more parts
+        bool failed = false;
+        std::vector<std::pair<WriteDone, std::string>> chunks; // reported on completion
+    };
+
+    BufferPool& pool_;
+    HttpUrl url_;
+    S3Signer signer_;
+    std::string bucket_;
+    std::string prefix_;
+    uint64_t packSize_;
+    size_t partSize_;
+    std::mutex mutex_;
+    std::shared_ptr<Pack> pack_; // being filled; parts in flight share it
+    std::unique_ptr<HttpUploader::Request> part_;
+    uint64_t packUsed_  = 0;
+    uint64_t partBytes_ = 0;
+    uint32_t nextPack_  = 0;
+    HttpUploader uploader_; // last: stops before the state its callbacks use
+
+    std::string packKey(uint32_t number) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "pack-%06u.bin", number);
+        return prefix_ + name;
+    }
+
+    // request - a signed request for `key` with a canonical query string
+    std::unique_ptr<HttpUploader::Request> request(const std::string& method,
+                                                   const std::string& key,
+                                                   const std::string& query) const {
+        auto req = std::make_unique<HttpUploader::Request>();
+        req->method = method;
+        std::string path = "/" + S3Signer::uri_encode(bucket_ + "/" + key, true);
+        req->url = url_.origin() + path + "?" + query;
+        signer_.sign(*req, url_.authority, path, query);
+        return req;
+    }
+
+    // openPackLocked - start filling the next pack; returns its
+    // CreateMultipartUpload for the caller to start outside the lock
+    std::unique_ptr<HttpUploader::Request> openPackLocked() {
+        auto pack = std::make_shared<Pack>();
+        pack->key = packKey(nextPack_++);
+        auto req = request("POST", pack->key, "uploads=");
+        req->finished = [this, pack](long status, const std::string& response,
+                                     const std::string&) {
+            packOpened(pack, status, response);
+        };
+        pack_ = pack;
+        part_ = std::make_unique<HttpUploader::Request>();
+        packUsed_ = partBytes_ = 0;
+        return req;
+    }
+
+    // packOpened - CreateMultipartUpload answered: the held parts go out, or
+    // on failure the pack's chunks fail and a pack still being filled is
+    // dropped, so the next chunk opens a new one
+    void packOpened(const std::shared_ptr<Pack>& pack, long status, const std::string& response) {
+        std::vector<std::unique_ptr<HttpUploader::Request>> requests;
+        std::vector<std::pair<WriteDone, std::string>> failed;
+        ChunkBatch buffers;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t start = response.find("<UploadId>");
+            size_t end = response.find("</UploadId>");
+            if (status == 200 && start != std::string::npos && end != std::string::npos) {
+                start += std::strlen("<UploadId>");
+                pack->uploadId = response.substr(start, end - start);
+                for (size_t i = 0; i < pack->held.size(); i++) {
+                    requests.push_back(partRequest(pack, i + 1, std::move(pack->held[i])));
+                }
+                pack->held.clear();
+                if (pack->sealed && pack->partsDone == pack->etags.size()) {
+                    requests.push_back(completion(pack));
+                }
+            } else {
+                {
+                    std::lock_guard<std::mutex> logLock(g_logMutex);
+                    std::cerr << "Error: could not start the upload of s3://" << bucket_ << "/"
+                    << pack->key << " (HTTP " << status << ") " << response.substr(0, 300)
+                    << "\n";
+                }
+                pack->failed = true;
+                if (pack_ == pack) {
+                    pack->held.push_back(std::move(part_));
+                    pack_.reset();
+                }
+                for (auto& part : pack->held) {
+                    for (auto& buf : part->buffers) {
+                        buffers.push_back(std::move(buf));
+                    }
+                }
+                pack->held.clear();
+                failed.swap(pack->chunks);
+            }
+        }
+        pool_.releaseBuffers(buffers);
+        for (const auto& [done, where] : failed) {
+            done(false, where, EIO);
+        }
+        for (auto& req : requests) {
+            uploader_.startNow(std::move(req));
+        }
+    }
+
+    // partRequest - UploadPart `number` of `pack` with the body collected in `part`
+    std::unique_ptr<HttpUploader::Request> partRequest(const std::shared_ptr<Pack>& pack,
+                                                       size_t number,
+                                                       std::unique_ptr<HttpUploader::Request> part) {
+        auto req = request("PUT", pack->key, "partNumber=" + std::to_string(number) +
+                           "&uploadId=" + S3Signer::uri_encode(pack->uploadId, false));
+        req->body = std::move(part->body);
+        req->buffers = std::move(part->buffers);
+        req->finished = [this, pack, number](long status, const std::string& response,
+                                             const std::string& etag) {
+            partFinished(pack, number, status, response, etag);
+        };
+        return req;
+    }
+
+    // sealLocked - turn the part being filled into an UploadPart request; with
+    // `last` the pack takes no more parts and is completed once they are in
+    std::vector<std::unique_ptr<HttpUploader::Request>> sealLocked(bool last) {
+        std::vector<std::unique_ptr<HttpUploader::Request>> requests;
+        std::shared_ptr<Pack> pack = pack_;
+        if (partBytes_ > 0) {
+            size_t number = pack->etags.size() + 1;
+            pack->etags.emplace_back();
+            if (pack->uploadId.empty()) {
+                pack->held.push_back(std::move(part_)); // signed once the upload id is known
+            } else {
+                requests.push_back(partRequest(pack, number, std::move(part_)));
+            }
+            part_ = std::make_unique<HttpUploader::Request>();
+            partBytes_ = 0;
+        }
+        if (last) {
+            pack->sealed = true;
+            pack_.reset();
+            if (!pack->uploadId.empty() && pack->partsDone == pack->etags.size()) {
+                requests.push_back(completion(pack));
+            }
+        }
+        return requests;
+    }
+
+    void partFinished(const std::shared_ptr<Pack>& pack, size_t number, long status,
+                      const std::string& response, const std::string& etag) {
+        std::unique_ptr<HttpUploader::Request> complete;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (status == 200 && !etag.empty()) {
+                pack->etags[number - 1] = etag;
+            } else if (!pack->failed) {
+                pack->failed = true;
+                std::lock_guard<std::mutex> logLock(g_logMutex);
+                std::cerr << "Error: part " << number << " of s3://" << bucket_ << "/"
+                << pack->key << " failed (HTTP " << status << ") " << response.substr(0, 300)
+                << "\n";
+            }
+            pack->partsDone++;
+            if (pack->sealed && pack->partsDone == pack->etags.size()) {
+                complete = completion(pack);
+            }
+        }
+        if (complete) {
+            uploader_.startNow(std::move(complete));
+        }
+    }
+
+    // completion - CompleteMultipartUpload, or AbortMultipartUpload when a
+    // part failed; either way the pack's chunks are reported afterwards
+    std::unique_ptr<HttpUploader::Request> completion(const std::shared_ptr<Pack>& pack) {
+        std::string query = "uploadId=" + S3Signer::uri_encode(pack->uploadId, false);
+        std::unique_ptr<HttpUploader::Request> req;
+        if (pack->failed) {
+            req = request("DELETE", pack->key, query);
+        } else {
+            std::string xml = "<CompleteMultipartUpload>";
+            for (size_t i = 0; i < pack->etags.size(); i++) {
+                xml += "<Part><PartNumber>" + std::to_string(i + 1) + "</PartNumber><ETag>" +
+                       pack->etags[i] + "</ETag></Part>";
+            }
+            xml += "</CompleteMultipartUpload>";
+            req = request("POST", pack->key, query);
+            req->addOwned(std::move(xml));
+        }
+        req->finished = [this, pack](long status, const std::string& response,
+                                     const std::string&) {
+            // S3 may answer 200 and still report an error in the body
+            bool ok = !pack->failed && status == 200 &&
+                      response.find("<Error>") == std::string::npos;
+            if (!ok && !pack->failed) {
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cerr << "Error: could not complete s3://" << bucket_ << "/" << pack->key
+                << " (HTTP " << status << ") " << response.substr(0, 300) << "\n";
+            }
+            for (const auto& [done, where] : pack->chunks) {
+                done(ok, where, ok ? 0 : EIO);
+            }
+        };
+        return req;
+    }
+};
+
+// HttpSink (--output http) - batches of chunks POSTed to an ingest endpoint,
+// each up to --upload-batch bytes. The body is one record per chunk: a JSON
+// header line {"hash","source","seq","offset","size"} followed by the chunk's
+// `size` bytes and a newline. A batch also goes out when the flush queue runs
+// empty and no other request is in flight.
+class HttpSink : public UploadSink {
+public:
+    HttpSink(const std::string& dir, BufferPool& pool, const std::string& url,
+             const std::vector<std::string>& headers, size_t batchBytes, size_t concurrency)
+    : UploadSink(dir), url_(url), headers_(headers), batchBytes_(batchBytes),
+      uploader_(pool, concurrency) {}
+
+    ~HttpSink() override {
+        close();
+    }
+
+    void addSource(uint32_t id, const std::string& path) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (sources_.size() <= id) {
+            sources_.resize(id + 1);
+        }
+        sources_[id] = path;
+    }
+
+    void submit(const std::string& hexDigest, std::unique_ptr<ChunkBuffer>& buf,
+                const WriteDone& done) override {
+        std::unique_ptr<HttpUploader::Request> req;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!batch_) {
+                batch_ = std::make_unique<HttpUploader::Request>();
+                dones_ = std::make_shared<std::vector<WriteDone>>();
+            }
+            std::string header = "{\"hash\":\"" + hexDigest + "\",\"source\":\"";
+            json_escape(header, buf->source < sources_.size() ? sources_[buf->source] : "");
+            header += "\",\"seq\":" + std::to_string(buf->seq) +
+                      ",\"offset\":" + std::to_string(buf->offset) +
+                      ",\"size\":" + std::to_string(buf->used) + "}\n";
+            batch_->addOwned(std::move(header));
+            batch_->add(buf->bytes(), buf->used);
+            batch_->add("\n", 1);
+            batchUsed_ += buf->used;
+            batch_->buffers.push_back(std::move(buf));
+            dones_->push_back(done);
+            if (batchUsed_ >= batchBytes_) {
+                req = sealLocked();
+            }
+        }
+        if (req) {
+            uploader_.start(std::move(req));
+        }
+    }
+
+    void kick() override {
+        if (!uploader_.busy()) {
+            send();
+        }
+    }
+
+    void drain() override {
+        send();
+        uploader_.wait();
+    }
+
+    void close() override {
+        drain();
+    }
+
+private:
+    std::string url_;
+    std::vector<std::string> headers_;
+    size_t batchBytes_;
+    std::mutex mutex_;
+    std::vector<std::string> sources_;
+    std::unique_ptr<HttpUploader::Request> batch_; // being filled
+    std::shared_ptr<std::vector<WriteDone>> dones_;
+    uint64_t batchUsed_ = 0;
+    HttpUploader uploader_; // last: stops before the state its callbacks use
+
+    void send() {
+        std::unique_ptr<HttpUploader::Request> req;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (batch_) {
+                req = sealLocked();
+            }
+        }
+        if (req) {
+            uploader_.start(std::move(req));
+        }
+    }
+
+    std::unique_ptr<HttpUploader::Request> sealLocked() {
+        std::unique_ptr<HttpUploader::Request> req = std::move(batch_);
+        std::shared_ptr<std::vector<WriteDone>> dones = std::move(dones_);
+        req->method = "POST";
+        req->url = url_;
+        req->headers = headers_;
+        req->headers.push_back("Content-Type: application/x-chunk-batch");
+        req->headers.push_back("X-Chunk-Count: " + std::to_string(dones->size()));
+        req->finished = [this, dones](long status, const std::string& response,
+                                      const std::string&) {
+            bool ok = status / 100 == 2;
+            if (!ok && status != 0) {
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cerr << "Error: POST " << url_ << " answered HTTP " << status << " "
+                << response.substr(0, 300) << "\n";
+            }
+            for (const WriteDone& done : *dones) {
+                done(ok, url_, ok ? 0 : EIO);
+            }
+        };
+        batchUsed_ = 0;
+        return req;
+    }
+};
+#endif
+
+// -----------------------------------------------------------------------------
+// 11) Input state (--state FILE) - fingerprints of the inputs of earlier runs
+//    with the chunks each one produced. An input whose size and mtime (and,
+//    with --state-hash, a sampled content hash) still match is not read again;
+//    its chunk rows are carried over into this run's manifest instead. The
+//    file is rewritten through a temporary and rename() at the end of a run.
+//      chunk-state 1 <settings>
+//      F <size> <mtime-ns> <quick-hash|-> <format> <path>
+//      C <seq> <offset> <size> <status> <hash> <location> [<near-of> <similarity>]
+//                                                            (per chunk of F)
+//    Fields are tab-separated; the last one may contain spaces. The --near-dup
+//    fields are only present for chunks that resemble an earlier one.
+// -----------------------------------------------------------------------------
+class InputState {
+public:
+    struct Input {
+        uint64_t size    = 0;
+        int64_t mtimeNs  = 0;
+        std::string quickHash; // empty unless --state-hash
+        std::string format;
+        std::vector<Manifest::Row> chunks;
+        bool failed      = false;
+    };
+
+    // `settings` describes everything that changes chunk boundaries or
+    // digests; a state file written under other settings is not reused
+    InputState(const std::string& path, const std::string& settings, bool quickHash)
+    : path_(path), settings_(settings), quickHash_(quickHash) {}
+
+    // load - read the state of the previous run; a missing file is an empty state
+    bool load() {
+        std::ifstream ifs(path_);
+        if (!ifs.is_open()) {
+            return errno == ENOENT;
+        }
+        std::string line;
+        if (!std::getline(ifs, line) || line.compare(0, 14, "chunk-state 1 ") != 0) {
+            return false;
+        }
+        if (line.substr(14) != settings_) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cout << "State file " << path_
+            << " was written with other split/hash settings; every input is processed again\n";
+            return true;
+        }
+        Input* current = nullptr;
+        while (std::getline(ifs, line)) {
+            std::vector<std::string> f = split_fields(line, line[0] == 'F' ? 6 : 9);
+            if (f[0] == "F" && f.size() == 6) {
+                current = &previous_[f[5]];
+                current->size      = std::strtoull(f[1].c_str(), nullptr, 10);
+                current->mtimeNs   = std::strtoll(f[2].c_str(), nullptr, 10);
+                current->quickHash = f[3] == "-" ? "" : f[3];
+                current->format    = f[4];
+            } else if (f[0] == "C" && (f.size() == 7 || f.size() == 9) && current) {
+                Manifest::Row row;
+                row.seq      = std::strtoull(f[1].c_str(), nullptr, 10);
+                row.offset   = std::strtoull(f[2].c_str(), nullptr, 10);
+                row.size     = std::strtoull(f[3].c_str(), nullptr, 10);
+                row.status   = f[4];
+                row.hash     = f[5];
+                row.location = f[6];
+                if (f.size() == 9) {
+                    row.nearOf     = f[7];
+                    row.similarity = std::strtod(f[8].c_str(), nullptr);
+                }
+                current->chunks.push_back(std::move(row));
+            } else {
+                previous_.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // unchanged - the previous run's record of `path` if the file still
+    // matches it (the caller re-emits its chunks); nullptr otherwise
+    const Input* unchanged(const std::string& path) {
+        auto it = previous_.find(path);
+        Input now;
+        if (it == previous_.end() || !fingerprint(path, now, !it->second.quickHash.empty()) ||
+            now.size != it->second.size || now.mtimeNs != it->second.mtimeNs ||
+            now.quickHash != it->second.quickHash) {
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    // begin - `path` is about to be read; its chunks are collected through
+    // addChunk. Only regular files with a printable path are tracked.
+    void begin(const std::string& path, const std::string& format) {
+        Input input;
+        if (path.find_first_of("\t\n") != std::string::npos ||
+            !fingerprint(path, input, quickHash_)) {
+            return;
+        }
+        input.format = format;
+        std::lock_guard<std::mutex> lock(mutex_);
+        current_[path] = std::move(input);
+    }
+
+    void addChunk(const Manifest::Row& row) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = current_.find(row.source);
+        if (it == current_.end()) {
+            return;
+        }
+        if (row.status == "failed") {
+            it->second.failed = true;
+        }
+        it->second.chunks.push_back(row);
+    }
+
+    // fail - `path` was not read completely; it is not recorded
+    void fail(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = current_.find(path);
+        if (it != current_.end()) {
+            it->second.failed = true;
+        }
+    }
+
+    // save - inputs read this run replace their old records; inputs skipped
+    // as unchanged and inputs not named this time keep theirs
+    bool save() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::map<std::string, const Input*> inputs;
+        for (const auto& [path, input] : previous_) {
+            inputs[path] = &input;
+        }
+        for (const auto& [path, input] : current_) {
+            if (input.failed) {
+                inputs.erase(path);
+            } else {
+                inputs[path] = &input;
+            }
+        }
+
+        std::string tmp = path_ + ".tmp";
+        std::ofstream ofs(tmp, std::ios::trunc);
+        ofs << "chunk-state 1 " << settings_ << "\n";
+        for (const auto& [path, input] : inputs) {
+            ofs << "F\t" << input->size << "\t" << input->mtimeNs << "\t"
+            << (input->quickHash.empty() ? "-" : input->quickHash) << "\t"
+            << input->format << "\t" << path << "\n";
+            for (const Manifest::Row& c : sorted_chunks(*input)) {
+                ofs << "C\t" << c.seq << "\t" << c.offset << "\t" << c.size << "\t"
+                << c.status << "\t" << c.hash << "\t" << c.location << near_fields(c) << "\n";
+            }
+        }
+        ofs.close();
+        if (!ofs || std::rename(tmp.c_str(), path_.c_str()) != 0) {
+            ::unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // fingerprint - size and mtime of a regular file, plus with `withHash` a
+    // SHA-256 over its size and three 64KB samples (start, middle, end)
+    static bool fingerprint(const std::string& path, Input& out, bool withHash) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (ok) {
+            out.size    = static_cast<uint64_t>(st.st_size);
+            out.mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                          st.st_mtim.tv_nsec;
+        }
+        if (ok && withHash) {
+            const size_t SAMPLE = 64 * 1024;
+            std::string sample(std::to_string(out.size));
+            off_t starts[3] = { 0, static_cast<off_t>(out.size / 2),
+                                static_cast<off_t>(out.size > SAMPLE ? out.size - SAMPLE : 0) };
+            std::vector<char> block(SAMPLE);
+            for (off_t start : starts) {
+                ssize_t n = pread(fd, block.data(), SAMPLE, start);
+                if (n < 0) {
+                    ok = false;
+                    break;
+                }
+                sample.append(block.data(), static_cast<size_t>(n));
+            }
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int digestLen = 0;
+            if (ok) {
+                evp_digest(EVP_sha256(), sample.data(), sample.size(), digest, digestLen);
+                hex_encode(digest, digestLen, out.quickHash);
+            }
+        }
+        ::close(fd);
+        return ok;
+    }
+
+    // near_fields - "\t<near-of>\t<similarity>" for a --near-dup match, else
+    // empty; state and journal records carry them after the location
+    static std::string near_fields(const Manifest::Row& row) {
+        if (row.nearOf.empty()) {
+            return "";
+        }
+        char similarity[32];
+        std::snprintf(similarity, sizeof(similarity), "%.17g", row.similarity);
+        return "\t" + row.nearOf + "\t" + similarity;
+    }
+
+    // split_fields - the tab-separated fields of a record; the last of at
+    // most `maxFields` keeps any further tabs
+    static std::vector<std::string> split_fields(const std::string& line, size_t maxFields) {
+        std::vector<std::string> fields;
+        size_t start = 0;
+        while (fields.size() + 1 < maxFields) {
+            size_t tab = line.find('\t', start);
+            if (tab == std::string::npos) {
+                break;
+            }
+            fields.push_back(line.substr(start, tab - start));
+            start = tab + 1;
+        }
+        fields.push_back(line.substr(start));
+        return fields;
+    }
+
+private:
+    std::string path_;
+    std::string settings_;
+    bool quickHash_;
+    std::map<std::string, Input> previous_; // read-only after load()
+    std::mutex mutex_;
+    std::map<std::string, Input> current_;  // inputs read this run
+
+    // chunks complete out of order; the state keeps them in source order
+    static std::vector<Manifest::Row> sorted_chunks(const Input& input) {
+        std::vector<Manifest::Row> rows = input.chunks;
+        std::sort(rows.begin(), rows.end(), [](const Manifest::Row& a, const Manifest::Row& b) {
+            return a.seq < b.seq;
+        });
+        return rows;
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 12) Run journal - the checkpoint of a run, the file "journal" in its output
+//    directory, from which --resume DIR continues the run after a crash. The
+//    flush workers append a record per committed chunk without waiting; the
+//    sink has already fdatasync'ed the chunk file before renaming it. A
+//    committer thread makes the records durable in groups: one fsync() of the
+//    directory for the renames since the last group, then one write() and
+//    fdatasync() of the records.
+//      chunk-journal 1 <settings>
+//      A <unix-time>                                              run started
+//      B <size> <mtime-ns> <format> <path>                        input started
+//      C <seq> <offset> <size> <status> <hash> <location> [<near-of> <similarity>]
+//        <path>                                                   chunk committed
+//      D <chunks> <path>                                          input finished
+// -----------------------------------------------------------------------------
+class Journal {
+public:
+    // what earlier attempts of the run committed of one input
+    struct Input {
+        uint64_t size   = 0;
+        int64_t mtimeNs = 0;
+        std::string format;
+        std::map<uint64_t, Manifest::Row> chunks; // by seq, without gaps
+        uint64_t total  = UINT64_MAX;             // chunk count once finished
+    };
+
+    Journal(const std::string& dir, const std::string& settings)
+    : dir_(dir), path_(dir + "/journal"), settings_(settings) {}
+
+    ~Journal() {
+        close();
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // recover - read the journal of the interrupted run in the directory. Of
+    // every input that is unchanged on disk the chunks up to the first one
+    // missing are kept; chunk files and `index` digests nothing kept refers
+    // to are removed, and the journal is rewritten with what is kept.
+    bool recover(HashIndex* index) {
+        std::ifstream ifs(path_);
+        std::string text((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        text.resize(text.rfind('\n') + 1); // a torn last record is dropped
+        std::istringstream records(text);
+        std::string line;
+        if (!std::getline(records, line) || line.compare(0, 16, "chunk-journal 1 ") != 0) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: no run journal in " << dir_ << "\n";
+            return false;
+        }
+        if (line.substr(16) != settings_) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: the run in " << dir_ << " was made with other settings ("
+            << line.substr(16) << ")\n";
+            return false;
+        }
+        while (std::getline(records, line)) {
+            char kind = line.empty() ? 0 : line[0];
+            std::vector<std::string> f =
+                InputState::split_fields(line, kind == 'B' ? 5 : kind == 'C' ? 10 : 3);
+            if (kind == 'A' && f.size() == 2 && started_ == 0) {
+                started_ = std::strtoull(f[1].c_str(), nullptr, 10);
+            } else if (kind == 'B' && f.size() == 5) {
+                Input& input = recovered_[f[4]];
+                uint64_t size   = std::strtoull(f[1].c_str(), nullptr, 10);
+                int64_t mtimeNs = std::strtoll(f[2].c_str(), nullptr, 10);
+                if (size != input.size || mtimeNs != input.mtimeNs) {
+                    input = Input(); // changed between attempts: start over
+                }
+                input.size    = size;
+                input.mtimeNs = mtimeNs;
+                input.format  = f[3];
+            } else if (kind == 'C' && (f.size() == 8 || f.size() == 10) &&
+                       recovered_.count(f.back())) {
+                Input& input = recovered_[f.back()];
+                Manifest::Row row;
+                row.source   = f.back();
+                row.format   = input.format;
+                row.seq      = std::strtoull(f[1].c_str(), nullptr, 10);
+                row.offset   = std::strtoull(f[2].c_str(), nullptr, 10);
+                row.size     = std::strtoull(f[3].c_str(), nullptr, 10);
+                row.status   = f[4];
+                row.hash     = f[5];
+                row.location = f[6];
+                if (f.size() == 10) {
+                    row.nearOf     = f[7];
+                    row.similarity = std::strtod(f[8].c_str(), nullptr);
+                }
+                input.chunks[row.seq] = std::move(row);
+            } else if (kind == 'D' && f.size() == 3 && recovered_.count(f[2])) {
+                recovered_[f[2]].total = std::strtoull(f[1].c_str(), nullptr, 10);
+            }
+        }
+
+        // keep what still matches the input, up to the first missing chunk
+        std::unordered_set<std::string> keptFiles;
+        std::unordered_set<std::string> keptHashes;
+        size_t finished = 0;
+        size_t chunks = 0;
+        for (auto it = recovered_.begin(); it != recovered_.end();) {
+            Input& input = it->second;
+            InputState::Input now;
+            if (!InputState::fingerprint(it->first, now, false) || now.size != input.size ||
+                now.mtimeNs != input.mtimeNs) {
+                it = recovered_.erase(it);
+                continue;
+            }
+            uint64_t next = 0;
+            auto gap = input.chunks.begin();
+            while (gap != input.chunks.end() && gap->first == next) {
+                ++gap;
+                ++next;
+            }
+            input.chunks.erase(gap, input.chunks.end());
+            if (input.total != next) {
+                input.total = UINT64_MAX;
+            }
+            for (const auto& [seq, row] : input.chunks) {
+                keptHashes.insert(row.hash);
+                if (!row.location.empty()) {
+                    keptFiles.insert(row.location.substr(row.location.rfind('/') + 1));
+                }
+            }
+            finished += input.total != UINT64_MAX;
+            chunks += input.chunks.size();
+            ++it;
+        }
+
+        // chunk files written after the last commit, and temporary files
+        size_t removed = 0;
+        if (DIR* d = opendir(dir_.c_str())) {
+            while (dirent* e = readdir(d)) {
+                std::string name = e->d_name;
+                size_t sep = name.find('_');
+                bool temporary = name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0;
+                bool chunkFile = !temporary && sep != std::string::npos && name.size() > 4 &&
+                                 name.compare(name.size() - 4, 4, ".txt") == 0 &&
+                                 name.find_first_not_of("0123456789abcdef") == sep;
+                if (temporary || (chunkFile && !keptFiles.count(name) &&
+                                  !keptHashes.count(name.substr(0, sep)))) {
+                    removed += ::unlink((dir_ + "/" + name).c_str()) == 0;
+                }
+            }
+            closedir(d);
+        }
+        size_t forgotten = index && started_ ? index->forgetSince(started_, keptHashes) : 0;
+
+        std::string out = header();
+        for (const auto& [path, input] : recovered_) {
+            out += begin_record(path, input.size, input.mtimeNs, input.format);
+            for (const auto& [seq, row] : input.chunks) {
+                out += chunk_record(row);
+            }
+            if (input.total != UINT64_MAX) {
+                out += done_record(path, input.total);
+            }
+        }
+        std::string tmp = path_ + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && pwrite_all(fd, out.data(), out.size(), 0) && ::fsync(fd) == 0;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (!ok || std::rename(tmp.c_str(), path_.c_str()) != 0) {
+            ::unlink(tmp.c_str());
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: could not rewrite the run journal " << path_ << "\n";
+            return false;
+        }
+        resumed_ = true;
+
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cout << "Recovered " << recovered_.size() << " inputs (" << finished
+        << " finished, " << chunks << " chunks committed); removed " << removed
+        << " uncommitted files";
+        if (forgotten > 0) {
+            std::cout << " and " << forgotten << " index entries";
+        }
+        std::cout << "\n";
+        return true;
+    }
+
+    // lock - claim the journal for this process until close(). The lock is on
+    // the directory, since recover() replaces the journal file.
+    bool lock() {
+        dirFd_ = ::open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd_ < 0) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: could not open " << dir_ << ": " << std::strerror(errno) << "\n";
+            return false;
+        }
+        if (flock(dirFd_, LOCK_EX | LOCK_NB) != 0) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: another run is using the journal in " << dir_ << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // open - start appending (to a new journal unless recover() ran) and the
+    // committer thread; lock() must have succeeded
+    bool open() {
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (resumed_ ? 0 : O_TRUNC),
+                     0644);
+        struct stat st;
+        if (fd_ < 0 || dirFd_ < 0 || fstat(fd_, &st) != 0) {
+            return false;
+        }
+        size_ = static_cast<uint64_t>(st.st_size);
+        if (size_ == 0) {
+            // right away, so even a run that dies at once can be resumed
+            std::string h = header();
+            if (!pwrite_all(fd_, h.data(), h.size(), 0) || ::fdatasync(fd_) != 0) {
+                return false;
+            }
+            size_ = h.size();
+        }
+        committer_ = std::thread(&Journal::commitLoop, this);
+        return true;
+    }
+
+    // previous - what earlier attempts committed of `path`; nullptr when
+    // nothing (read-only after recover())
+    const Input* previous(const std::string& path) const {
+        auto it = recovered_.find(path);
+        return it == recovered_.end() ? nullptr : &it->second;
+    }
+
+    const std::map<std::string, Input>& recovered() const { return recovered_; }
+
+    // begin - `path` is about to be read; only regular files with a printable
+    // path are journaled
+    void begin(const std::string& path, const std::string& format) {
+        InputState::Input now;
+        if (path.find_first_of("\t\n") != std::string::npos ||
+            !InputState::fingerprint(path, now, false)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        tracked_.insert(path);
+        pending_ += begin_record(path, now.size, now.mtimeNs, format);
+    }
+
+    // chunk - a chunk of a journaled input is written (or accounted for)
+    void chunk(const Manifest::Row& row) {
+        if (row.status == "failed") {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tracked_.count(row.source)) {
+            pending_ += chunk_record(row);
+        }
+    }
+
+    // done - `path` was read completely into `chunks` chunks
+    void done(const std::string& path, uint64_t chunks) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (tracked_.count(path)) {
+            pending_ += done_record(path, chunks);
+        }
+    }
+
+    // close - commit what is left and stop the committer
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_ = true;
+        }
+        wake_.notify_one();
+        if (committer_.joinable()) {
+            committer_.join();
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        if (dirFd_ >= 0) {
+            ::close(dirFd_);
+            dirFd_ = -1;
+        }
+    }
+
+private:
+    std::string dir_;
+    std::string path_;
+    std::string settings_;
+    uint64_t started_ = 0;
+    bool resumed_     = false;
+    std::map<std::string, Input> recovered_;
+    int fd_    = -1;
+    int dirFd_ = -1;
+    uint64_t size_ = 0; // committed bytes
+    bool failed_   = false;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::string pending_; // records of the next group
+    std::unordered_set<std::string> tracked_;
+    bool closing_ = false;
+    std::thread committer_;
+
+    std::string header() const {
+        return "chunk-journal 1 " + settings_ + "\nA\t" +
+               std::to_string(started_ ? started_ : static_cast<uint64_t>(std::time(nullptr))) +
+               "\n";
+    }
+
+    static std::string begin_record(const std::string& path, uint64_t size, int64_t mtimeNs,
+                                    const std::string& format) {
+        return "B\t" + std::to_string(size) + "\t" + std::to_string(mtimeNs) + "\t" + format +
+               "\t" + path + "\n";
+    }
+
+    static std::string chunk_record(const Manifest::Row& r) {
+        return "C\t" + std::to_string(r.seq) + "\t" + std::to_string(r.offset) + "\t" +
+               std::to_string(r.size) + "\t" + r.status + "\t" + r.hash + "\t" + r.location +
+               InputState::near_fields(r) + "\t" + r.source + "\n";
+    }
+
+    static std::string done_record(const std::string& path, uint64_t chunks) {
+        return "D\t" + std::to_string(chunks) + "\t" + path + "\n";
+    }
+
+    void commitLoop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!closing_ || !pending_.empty()) {
+            wake_.wait_for(lock, std::chrono::milliseconds(JOURNAL_COMMIT_MS),
+                           [this] { return closing_; });
+            if (pending_.empty()) {
+                continue;
+            }
+            std::string group;
+            group.swap(pending_);
+            lock.unlock();
+            commit(group);
+            lock.lock();
+        }
+    }
+
+    // commit - the renames first, so no record names a file that is not durable
+    void commit(const std::string& group) {
+        bool ok = ::fsync(dirFd_) == 0;
+        if (ok && !pwrite_all(fd_, group.data(), group.size(), static_cast<off_t>(size_))) {
+            ok = false;
+        } else if (ok) {
+            size_ += group.size();
+            ok = ::fdatasync(fd_) == 0;
+        }
+        if (!ok && !failed_) {
+            failed_ = true;
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Warning: could not commit the run journal " << path_ << " ("
+            << std::strerror(errno) << "); --resume would redo more of the run\n";
+        }
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 13) FlushStage - bounded queue of filled buffers, drained by worker threads
+//    that hash each chunk, write it to disk and hand the buffer back to the pool
+// -----------------------------------------------------------------------------
+class FlushStage {
+public:
+    FlushStage(BufferPool& pool, ChunkSink& sink, size_t numWorkers, size_t queueCapacity,
+               HashIndex* index = nullptr, Manifest* manifest = nullptr,
+               InputState* state = nullptr, NearDupIndex* nearDup = nullptr,
+               Journal* journal = nullptr)
+    : pool_(pool), sink_(sink), capacity_(std::max<size_t>(1, queueCapacity)),
+      index_(index), manifest_(manifest), state_(state), nearDup_(nearDup), journal_(journal)
+    {
+        for (size_t i = 0; i < numWorkers; i++) {
+            workers_.emplace_back(&FlushStage::workerLoop, this);
+        }
+    }
+
+    ~FlushStage() {
+        finish();
+    }
+
+    // queue a batch of filled buffers; blocks while the queue is full so
+    // ingest cannot run further ahead of the disk than the queue allows
+    void submit(ChunkBatch batch) {
+        countChunks(batch);
+        StageTimer timer(STAGE_WAIT);
+        std::unique_lock<std::mutex> lock(mutex_);
+        notFull_.wait(lock, [this] { return queue_.size() < capacity_; });
+        queue_.push_back(std::move(batch));
+        notEmpty_.notify_one();
+    }
+
+    // write - hash and store a batch on the calling thread instead of queueing
+    // it (ranged file reads); a thread that wrote calls detachWriter() before
+    // it exits
+    void write(ChunkBatch batch) {
+        countChunks(batch);
+        process(batch);
+        sink_.kick();
+    }
+
+    void detachWriter() {
+        sink_.detach();
+    }
+
+    // drain everything still queued and join the workers
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (closed_) {
+                return;
+            }
+            closed_ = true;
+        }
+        notEmpty_.notify_all();
+        for (auto& t : workers_) {
+            t.join();
+        }
+        workers_.clear();
+        sink_.drain();
+        size_t count;
+        {
+            std::lock_guard<std::mutex> lock(sourcesMutex_);
+            count = sources_.size();
+        }
+        for (uint32_t id = 0; id < count; id++) {
+            releaseRows(id);
+        }
+    }
+
+    // addSource - register an input; its chunks carry the returned id
+    uint32_t addSource(const std::string& path, const std::string& format) {
+        if (state_ && format != "stdin" && format != "stream") {
+            state_->begin(path, format);
+        }
+        if (journal_ && format != "stdin" && format != "stream") {
+            journal_->begin(path, format);
+        }
+        std::lock_guard<std::mutex> lock(sourcesMutex_);
+        uint32_t id = static_cast<uint32_t>(sources_.size());
+        sources_.emplace_back();
+        sources_.back().path   = path;
+        sources_.back().format = format;
+        sink_.addSource(id, path);
+        return id;
+    }
+
+    // reuseUnchanged - with --state, an input that has not changed since the
+    // run that recorded it is not read again; its recorded chunks go to the
+    // manifest as "unchanged" rows
+    bool reuseUnchanged(const std::string& path) {
+        const InputState::Input* input = state_ ? state_->unchanged(path) : nullptr;
+        if (!input) {
+            return false;
+        }
+        if (manifest_) {
+            for (Manifest::Row row : input->chunks) {
+                row.source = path;
+                row.format = input->format;
+                row.status = "unchanged";
+                manifest_->add(std::move(row));
+            }
+        }
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cout << "\nUnchanged since last run: " << path << " ("
+        << input->chunks.size() << " chunks), skipped\n";
+        return true;
+    }
+
+    // sourceFailed - the input was not read completely; --state forgets it
+    void sourceFailed(const std::string& path) {
+        if (state_) {
+            state_->fail(path);
+        }
+    }
+
+    // orderRows - the chunks of input `id` from `firstSeq` on finish out of
+    // order (stream_ranged); hold their manifest rows back and write them by
+    // seq; they keep coming as the sink completes the chunks, after the
+    // reading is over. releaseRows writes whatever is still held, past any gap
+    // a failed read left; finish() does so for every input.
+    void orderRows(uint32_t id, uint64_t firstSeq) {
+        if (!manifest_) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(sourcesMutex_);
+        sources_[id].ordered = true;
+        sources_[id].nextRow = firstSeq;
+    }
+
+    void releaseRows(uint32_t id) {
+        if (!manifest_) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(sourcesMutex_);
+        Source& src = sources_[id];
+        src.ordered = false;
+        for (auto& held : src.held) {
+            manifest_->add(std::move(held.second));
+        }
+        src.held.clear();
+    }
+
+    // endSource - input `id` is chunked; called by its Chunker
+    void endSource(uint32_t id, uint64_t chunks) {
+        std::lock_guard<std::mutex> lock(sourcesMutex_);
+        sources_[id].chunks = chunks;
+    }
+
+    // sourceDone - the input was read completely; the journal marks it finished
+    void sourceDone(const std::string& path) {
+        if (!journal_) {
+            return;
+        }
+        uint64_t chunks = 0;
+        {
+            std::lock_guard<std::mutex> lock(sourcesMutex_);
+            auto it = std::find_if(sources_.rbegin(), sources_.rend(),
+                                   [&path](const Source& src) { return src.path == path; });
+            if (it != sources_.rend()) {
+                chunks = it->chunks;
+            }
+        }
+        journal_->done(path, chunks);
+    }
+
+    // replayJournal - with --resume, the chunks earlier attempts of the run
+    // committed are the first rows of the manifest
+    void replayJournal() {
+        if (!journal_ || !manifest_) {
+            return;
+        }
+        for (const auto& [path, input] : journal_->recovered()) {
+            for (const auto& [seq, row] : input.chunks) {
+                manifest_->add(row);
+            }
+        }
+    }
+
+    // reuseCommitted - with --resume, an input an earlier attempt finished is
+    // not read again
+    bool reuseCommitted(const std::string& path) {
+        const Journal::Input* input = journal_ ? journal_->previous(path) : nullptr;
+        if (!input || input->total == UINT64_MAX) {
+            return false;
+        }
+        if (state_) {
+            state_->begin(path, input->format);
+            for (const auto& [seq, row] : input->chunks) {
+                state_->addChunk(row);
+            }
+        }
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cout << "\nFinished before the interruption: " << path << " ("
+        << input->chunks.size() << " chunks), skipped\n";
+        return true;
+    }
+
+    // resumePoint - with --resume, how many chunks of input `id` earlier
+    // attempts committed and the input offset where they end
+    void resumePoint(uint32_t id, uint64_t& seq, uint64_t& offset) {
+        seq = offset = 0;
+        if (!journal_) {
+            return;
+        }
+        const Journal::Input* input;
+        {
+            std::lock_guard<std::mutex> lock(sourcesMutex_);
+            input = journal_->previous(sources_[id].path);
+        }
+        if (!input || input->chunks.empty()) {
+            return;
+        }
+        const Manifest::Row& last = input->chunks.rbegin()->second;
+        seq    = last.seq + 1;
+        offset = last.offset + last.size;
+        if (state_) {
+            for (const auto& [n, row] : input->chunks) {
+                state_->addChunk(row);
+            }
+        }
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cout << "Resuming " << last.source << " after chunk " << last.seq << "\n";
+    }
+
+private:
+    struct Source {
+        std::string path;
+        std::string format;
+        uint64_t chunks = 0;
+        // orderRows: manifest rows wait in `held` until row `nextRow` is in
+        bool ordered = false;
+        uint64_t nextRow = 0;
+        std::map<uint64_t, Manifest::Row> held;
+    };
+
+    // where a chunk came from, kept for the manifest once the buffer is gone
+    struct Origin {
+        uint32_t source;
+        uint64_t seq;
+        uint64_t offset;
+    };
+
+    BufferPool& pool_;
+    ChunkSink& sink_;
+    size_t capacity_;
+    HashIndex* index_;
+    Manifest* manifest_;
+    InputState* state_;
+    NearDupIndex* nearDup_;
+    Journal* journal_;
+    std::mutex sourcesMutex_;
+    std::deque<Source> sources_;
+    std::mutex referencesMutex_;
+    std::ofstream references_; // <hash> <size> <firstSeen> per skipped chunk
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    std::deque<ChunkBatch> queue_;
+    std::vector<std::thread> workers_;
+    bool closed_ = false;
+
+    void workerLoop() {
+        for (;;) {
+            ChunkBatch batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                notEmpty_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+                if (queue_.empty()) {
+                    // closed and drained; finish() drains the sink once all
+                    // workers are gone
+                    lock.unlock();
+                    sink_.detach();
+                    return;
+                }
+                batch = std::move(queue_.front());
+                queue_.pop_front();
+                notFull_.notify_one();
+            }
+            process(batch);
+            bool idle;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                idle = queue_.empty();
+            }
+            if (idle) {
+                sink_.kick();
+            }
+        }
+    }
+
+    void countChunks(const ChunkBatch& batch) {
+        if (g_timeStages) {
+            for (const auto& buf : batch) {
+                g_stageStats.count(COUNTER_CHUNKS, 1);
+                g_stageStats.count(COUNTER_CHUNK_BYTES, buf->used);
+            }
+        }
+    }
+
+    // process - write one batch and return its buffers to the pool
+    void process(ChunkBatch& batch) {
+        std::vector<ChunkSink::PendingChunk> pending;
+        try {
+            writeBatch(batch, pending);
+        } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error flushing chunk: " << e.what() << "\n";
+        }
+        // buffers not taken by an asynchronous sink go back to the pool
+        for (auto& p : pending) {
+            if (p.buf) {
+                batch.push_back(std::move(p.buf));
+            }
+        }
+        pool_.releaseBuffers(batch);
+    }
+
+    // writeBatch - compute the digests of the batch together and hand the
+    // chunks the hash index does not already know to the sink in one
+    // submitBatch() call. Buffers move from `batch` into `pending` as they
+    // are queued for the sink.
+    void writeBatch(ChunkBatch& batch, std::vector<ChunkSink::PendingChunk>& pending) {
+        thread_local std::vector<HashInput> inputs;
+        thread_local std::vector<std::string> digests;
+        inputs.clear();
+        for (const auto& buf : batch) {
+            inputs.push_back({ buf->bytes(), buf->used });
+        }
+        {
+            StageTimer timer(STAGE_HASH); // one event per batch
+            compute_chunk_hashes(inputs, digests);
+        }
+
+        pending.reserve(batch.size());
+        std::time_t now = std::time(nullptr);
+        for (size_t i = 0; i < batch.size(); i++) {
+            auto& buf = batch[i];
+            size_t dataLen = buf->used;
+            Origin origin{buf->source, buf->seq, buf->offset};
+            const std::string& hashVal = digests[i];
+            if (index_) {
+                HashIndex::Entry known;
+                if (!index_->insertIfAbsent(hashVal, dataLen, static_cast<uint64_t>(now), &known)) {
+                    recordReference(hashVal, known, origin);
+                    continue;
+                }
+            }
+            NearDupIndex::Match near;
+            uint32_t sketch = NearDupIndex::NONE;
+            if (nearDup_) {
+                bool isNear;
+                {
+                    StageTimer timer(STAGE_SKETCH);
+                    isNear = nearDup_->check(buf->bytes(), dataLen, hashVal, near, sketch);
+                }
+                if (isNear && g_timeStages) {
+                    g_stageStats.count(COUNTER_NEAR_DUPLICATES, 1);
+                }
+                if (isNear && nearDup_->mode() == NearDupMode::Drop) {
+                    if (index_) {
+                        index_->forget(hashVal); // not written after all
+                    }
+                    recordNearDuplicate(hashVal, dataLen, origin, near);
+                    continue;
+                }
+            }
+            ChunkSink::PendingChunk p;
+            p.hexDigest = hashVal;
+            p.buf       = std::move(buf);
+            p.done = [this, hashVal, dataLen, origin, near, sketch](bool ok,
+                                                                    const std::string& where,
+                                                                    int err) {
+                chunkWritten(hashVal, dataLen, origin, ok, where, err, near, sketch);
+            };
+            pending.push_back(std::move(p));
+        }
+        if (!pending.empty()) {
+            StageTimer timer(STAGE_WRITE);
+            sink_.submitBatch(pending);
+        }
+    }
+
+    // chunkWritten - outcome of one sink write; may run on a sink thread
+    void chunkWritten(const std::string& hashVal, size_t dataLen, const Origin& origin, bool ok,
+                      const std::string& where, int err, const NearDupIndex::Match& near,
+                      uint32_t sketch) {
+        if (sketch != NearDupIndex::NONE) {
+            if (ok) {
+                nearDup_->written(sketch);
+            } else {
+                nearDup_->failed(sketch);
+            }
+        }
+        addManifestRow(origin, hashVal, dataLen, ok ? "written" : "failed", where, &near);
+        if (!ok) {
+            if (index_) {
+                index_->forget(hashVal);
+            }
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error writing chunk: " << where << " (" << std::strerror(err) << ")\n";
+        } else if (g_logChunks) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cout << "Flushed chunk -> " << where
+            << " (size: " << dataLen << " bytes)\n";
+        }
+    }
+
+    // recordReference - a duplicate is not written again; it is listed in
+    // references.txt so the run still accounts for every chunk it produced
+    void recordReference(const std::string& hashVal, const HashIndex::Entry& known,
+                         const Origin& origin) {
+        addManifestRow(origin, hashVal, known.size, "known", "");
+        {
+            std::lock_guard<std::mutex> lock(referencesMutex_);
+            if (!references_.is_open()) {
+                references_.open(sink_.directory() + "/references.txt", std::ios::app);
+            }
+            references_ << hashVal << " " << known.size << " " << known.firstSeen << "\n";
+        }
+        if (!g_logChunks) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cout << "Known chunk -> " << hashVal << " (first written " << known.firstSeen
+        << ", size: " << known.size << " bytes), skipped\n";
+    }
+
+    // recordNearDuplicate - --near-dup drop: the chunk is not written, its
+    // manifest row names the chunk it resembles
+    void recordNearDuplicate(const std::string& hashVal, size_t dataLen, const Origin& origin,
+                             const NearDupIndex::Match& near) {
+        addManifestRow(origin, hashVal, dataLen, "near-duplicate", "", &near);
+        if (!g_logChunks) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cout << "Near-duplicate chunk -> " << hashVal << " (" << std::fixed
+        << std::setprecision(2) << near.similarity << std::defaultfloat << " like "
+        << near.of << ", size: " << dataLen << " bytes), skipped\n";
+    }
+
+    void addManifestRow(const Origin& origin, const std::string& hashVal, uint64_t size,
+                        const char* status, const std::string& location,
+                        const NearDupIndex::Match* near = nullptr) {
+        if (!manifest_ && !state_ && !journal_) {
+            return;
+        }
+        Manifest::Row row;
+        {
+            std::lock_guard<std::mutex> lock(sourcesMutex_);
+            const Source& src = sources_[origin.source];
+            row.source = src.path;
+            row.format = src.format;
+        }
+        row.seq      = origin.seq;
+        row.offset   = origin.offset;
+        row.size     = size;
+        row.hash     = hashVal;
+        row.status   = status;
+        row.location = location;
+        if (near) {
+            row.nearOf     = near->of;
+            row.similarity = near->similarity;
+        }
+        if (state_) {
+            state_->addChunk(row);
+        }
+        if (journal_) {
+            journal_->chunk(row);
+        }
+        if (manifest_) {
+            std::unique_lock<std::mutex> lock(sourcesMutex_);
+            Source& src = sources_[origin.source];
+            if (!src.ordered) {
+                lock.unlock();
+                manifest_->add(std::move(row));
+                return;
+            }
+            // added under the lock, so rows released by two threads keep their order
+            src.held.emplace(row.seq, std::move(row));
+            for (auto it = src.held.begin(); it != src.held.end() && it->first == src.nextRow;
+                 it = src.held.erase(it)) {
+                manifest_->add(std::move(it->second));
+                src.nextRow++;
+            }
+        }
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 14) Content-defined chunking - FastCDC-style Gear rolling hash. A cut is taken
+//    where the hash matches a mask, so boundaries move with the content and an
+//    insertion only changes the chunks around it. Normalized chunking: a
+//    stricter mask before the target size and a looser one after it.
+// -----------------------------------------------------------------------------
+class GearCdc {
+public:
+    GearCdc()
+    : maskStrict_(highMask(g_chunk.cdcMaskBits + 2)),
+      maskLoose_(highMask(g_chunk.cdcMaskBits - 2)) {}
+
+    void reset() { hash_ = 0; }
+
+    // scan - examine up to n new bytes of a chunk that already holds `used`
+    // bytes; returns how many of them belong to it and sets cut when the
+    // chunk ends after those bytes
+    size_t scan(const unsigned char* p, size_t n, size_t used, bool& cut) {
+        const uint64_t* gear = gearTable();
+        size_t i = 0;
+        cut = false;
+
+        // nothing below the minimum size can be a cut point, so skip hashing it
+        if (used < g_chunk.cdcMin) {
+            i = std::min(n, g_chunk.cdcMin - used);
+        }
+
+        uint64_t h = hash_;
+        size_t pos = used + i;
+        size_t end = std::min(n, i + (pos < g_chunk.cdcTarget ? g_chunk.cdcTarget - pos : 0));
+        for (; i < end; ++i) {
+            h = (h << 1) + gear[p[i]];
+            if ((h & maskStrict_) == 0) {
+                cut = true;
+                hash_ = 0;
+                return i + 1;
+            }
+        }
+        end = std::min(n, i + (g_chunk.cdcMax - (used + i)));
+        for (; i < end; ++i) {
+            h = (h << 1) + gear[p[i]];
+            if ((h & maskLoose_) == 0) {
+                cut = true;
+                hash_ = 0;
+                return i + 1;
+            }
+        }
+        hash_ = h;
+        if (used + i >= g_chunk.cdcMax) {
+            cut = true;
+            hash_ = 0;
+        }
+        return i;
+    }
+
+private:
+    uint64_t hash_ = 0;
+    uint64_t maskStrict_;
+    uint64_t maskLoose_;
+
+    // the top bits of a Gear hash depend on the most bytes, so test those
+    static uint64_t highMask(unsigned bits) {
+        return ~uint64_t(0) << (64 - bits);
+    }
+
+    // fixed-seed splitmix64 table: boundaries must be identical across runs
+    static const uint64_t* gearTable() {
+        static const std::vector<uint64_t> table = [] {
+            std::vector<uint64_t> t(256);
+            uint64_t x = 0x6368756e6b434443ULL;
+            for (auto& v : t) {
+                uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                v = z ^ (z >> 31);
+            }
+            return t;
+        }();
+        return table.data();
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 15) Boundary-aware cuts (--split boundary). A full chunk is ended at the
+//    best boundary within its last --chunk-variance bytes: a blank line, else a
+//    sentence or line end, else a UTF-8 code point boundary. Candidate bytes
+//    are located with a vector compare, one block at a time from the end.
+// -----------------------------------------------------------------------------
+#if defined(__AVX2__)
+static const size_t MARK_BLOCK = 32;
+
+// boundary_marks - bit i set when p[i] is '\n', '.', '!' or '?'
+static uint32_t boundary_marks(const unsigned char* p) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('!')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?'))));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(m));
+}
+#elif defined(__SSE2__)
+static const size_t MARK_BLOCK = 16;
+
+static uint32_t boundary_marks(const unsigned char* p) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('.'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('!')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('?'))));
+    return static_cast<uint32_t>(_mm_movemask_epi8(m));
+}
+#endif
+
+static bool is_boundary_mark(unsigned char c) {
+    return c == '\n' || c == '.' || c == '!' || c == '?';
+}
+
+// boundary_marks_scalar - same bit layout as boundary_marks, for n <= 32 bytes
+static uint32_t boundary_marks_scalar(const unsigned char* p, size_t n) {
+    uint32_t marks = 0;
+    for (size_t i = 0; i < n; i++) {
+        marks |= static_cast<uint32_t>(is_boundary_mark(p[i])) << i;
+    }
+    return marks;
+}
+
+#if defined(__ARM_NEON) && !defined(__SSE2__)
+static const size_t MARK_BLOCK = 16;
+
+// NEON has no movemask: reject mark-free blocks with a vector compare and
+// only build the bit mask for the few blocks that contain a mark
+static uint32_t boundary_marks(const unsigned char* p) {
+    uint8x16_t v = vld1q_u8(p);
+    uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')), vceqq_u8(v, vdupq_n_u8('.'))),
+                            vorrq_u8(vceqq_u8(v, vdupq_n_u8('!')), vceqq_u8(v, vdupq_n_u8('?'))));
+    if (vmaxvq_u8(m) == 0) {
+        return 0;
+    }
+    return boundary_marks_scalar(p, 16);
+}
+#elif !defined(__SSE2__) && !defined(__AVX2__)
+static const size_t MARK_BLOCK = 16;
+
+static uint32_t boundary_marks(const unsigned char* p) {
+    return boundary_marks_scalar(p, 16);
+}
+#endif
+
+// utf8_cut - n, or the start of a code point cut off by the end of the buffer
+static size_t utf8_cut(const unsigned char* p, size_t n) {
+    for (size_t k = n; k > 0 && n - k < 4; k--) {
+        unsigned char lead = p[k - 1];
+        if ((lead & 0xC0) == 0x80) {
+            continue; // continuation byte
+        }
+        size_t len = lead < 0x80 ? 1 : lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : 2;
+        return (k - 1 + len <= n || k == 1) ? n : k - 1;
+    }
+    return n; // not UTF-8; nothing to protect
+}
+
+// boundary_cut - how many of the n bytes of a full chunk to keep in it
+size_t boundary_cut(const char* data, size_t n) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    size_t lo = n > g_chunk.variance ? n - g_chunk.variance : 0;
+    size_t sentence = 0;
+
+    for (size_t end = n; end > lo;) {
+        size_t start = end - lo >= MARK_BLOCK ? end - MARK_BLOCK : lo;
+        uint32_t marks = end - start == MARK_BLOCK ? boundary_marks(p + start)
+                                                   : boundary_marks_scalar(p + start, end - start);
+        while (marks) {
+            unsigned bit = 31 - static_cast<unsigned>(__builtin_clz(marks));
+            marks &= ~(uint32_t(1) << bit);
+            size_t i = start + bit;
+            if (p[i] == '\n') {
+                if (i > lo && p[i - 1] == '\n') {
+                    return i + 1; // paragraph
+                }
+                if (!sentence) {
+                    sentence = i + 1;
+                }
+            } else if (!sentence && i + 1 < n &&
+                       (p[i + 1] == ' ' || p[i + 1] == '\n' || p[i + 1] == '\t')) {
+                sentence = i + 2;
+            }
+        }
+        end = start;
+    }
+    return sentence ? sentence : utf8_cut(p, n);
+}
+
+// -----------------------------------------------------------------------------
+// 16) Token budget (--max-tokens). Text is pre-tokenized on whitespace and
+//     ASCII punctuation and every word is counted with greedy longest-match
+//     WordPiece against a BERT-style vocab file, in the same pass that copies
+//     it into the chunk. Chunks end between words once the budget is reached.
+// -----------------------------------------------------------------------------
+class WordPieceVocab {
+public:
+    // load - one token per line, "##" marks a word-continuation piece
+    bool load(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        storage_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        std::string_view all(storage_);
+        bool upper = false;
+        for (size_t pos = 0; pos < all.size();) {
+            size_t eol = all.find('\n', pos);
+            std::string_view line = all.substr(pos, eol == std::string_view::npos ? eol : eol - pos);
+            pos = eol == std::string_view::npos ? all.size() : eol + 1;
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            if (line.empty()) {
+                continue;
+            }
+            bool special = line.front() == '[' && line.back() == ']'; // [UNK], [CLS], ...
+            if (!special) {
+                upper = upper || std::any_of(line.begin(), line.end(),
+                                             [](char c) { return c >= 'A' && c <= 'Z'; });
+            }
+            if (line.size() > 2 && line.compare(0, 2, "##") == 0) {
+                line.remove_prefix(2);
+                pieces_.insert(line);
+                maxPiece_ = std::max(maxPiece_, line.size());
+            } else {
+                words_.insert(line);
+                maxWord_ = std::max(maxWord_, line.size());
+            }
+        }
+        lowercase_ = !upper; // an uncased vocab expects lowercased input
+        return !words_.empty();
+    }
+
+    bool lowercase() const { return lowercase_; }
+
+    // count - WordPiece tokens for one word; a word that cannot be covered by
+    // vocab pieces is a single [UNK], as is anything over MAX_WORD_BYTES
+    size_t count(const std::string& word) const {
+        if (word.size() > MAX_WORD_BYTES) {
+            return 1;
+        }
+        size_t tokens = 0;
+        for (size_t start = 0; start < word.size(); tokens++) {
+            const auto& set = start == 0 ? words_ : pieces_;
+            size_t end = std::min(word.size(), start + (start == 0 ? maxWord_ : maxPiece_));
+            for (; end > start; --end) {
+                if (set.count(std::string_view(word.data() + start, end - start))) {
+                    break;
+                }
+            }
+            if (end == start) {
+                return 1;
+            }
+            start = end;
+        }
+        return tokens;
+    }
+
+    static const size_t MAX_WORD_BYTES = 200; // BERT: 100 characters
+
+private:
+    std::string storage_; // file contents; the sets point into it
+    std::unordered_set<std::string_view> words_;
+    std::unordered_set<std::string_view> pieces_;
+    size_t maxWord_  = 0;
+    size_t maxPiece_ = 0;
+    bool lowercase_  = false;
+};
+
+static std::unique_ptr<WordPieceVocab> g_vocab; // loaded from --vocab
+
+// TokenBudget - per-Chunker token state. Offsets are positions in the current
+// chunk buffer; startNext() rebases them once the next chunk begins.
+class TokenBudget {
+public:
+    // scan - take up to n bytes appended at buffer offset `used`; sets cut
+    // when the chunk is complete, see keep() / overlapFrom()
+    size_t scan(const unsigned char* p, size_t n, size_t used, bool& cut) {
+        const bool lower = g_vocab->lowercase();
+        size_t limit = std::min(n, g_chunk.limit - used);
+        cut = false;
+        for (size_t i = 0; i < limit; i++) {
+            unsigned char c = p[i];
+            bool space = c == ' ' || (c >= '\t' && c <= '\r');
+            bool punct = c < 0x80 && std::ispunct(c);
+            if (!space && !punct) {
+                if (!inWord_) {
+                    inWord_ = true;
+                    wordStart_ = used + i;
+                    word_.clear();
+                }
+                if (word_.size() <= WordPieceVocab::MAX_WORD_BYTES) {
+                    word_ += static_cast<char>(lower && c >= 'A' && c <= 'Z' ? c + 32 : c);
+                }
+                continue;
+            }
+            if (inWord_) {
+                inWord_ = false;
+                size_t tokens = g_vocab->count(word_);
+                if (!accept(wordStart_, tokens)) {
+                    // the word opens the next chunk
+                    keep_ = wordStart_;
+                    pending_ = tokens;
+                    cut = true;
+                    return i;
+                }
+            }
+            if (punct && !accept(used + i, 1)) {
+                keep_ = used + i;
+                cut = true;
+                return i;
+            }
+        }
+        if (used + limit >= g_chunk.limit) {
+            // byte cap: end before the word in progress if there is room
+            byteCap_ = true;
+            keep_ = inWord_ && wordStart_ > 0 ? wordStart_ : g_chunk.limit;
+            cut = true;
+        }
+        return limit;
+    }
+
+    size_t keep() const { return keep_; }
+
+    // overlapFrom - where the next chunk starts: the last --token-overlap
+    // tokens of this one are repeated (never after a byte-cap cut, which
+    // may not have consumed a single token)
+    size_t overlapFrom() const {
+        return byteCap_ || recent_.empty() ? keep_ : recent_.front().offset;
+    }
+
+    // startNext - the bytes from `from` on are now the start of a new chunk
+    void startNext(size_t from) {
+        if (byteCap_) {
+            recent_.clear();
+            recentTokens_ = 0;
+        }
+        for (auto& unit : recent_) {
+            unit.offset -= from;
+        }
+        tokens_ = recentTokens_;
+        newUnits_ = 0;
+        if (pending_) {
+            accept(keep_ - from, pending_);
+            pending_ = 0;
+        }
+        if (inWord_) {
+            wordStart_ = wordStart_ >= from ? wordStart_ - from : 0;
+        }
+        byteCap_ = false;
+    }
+
+private:
+    struct Unit {
+        size_t offset;
+        size_t tokens;
+    };
+
+    std::string word_;
+    bool inWord_      = false;
+    size_t wordStart_ = 0;
+    size_t tokens_    = 0; // in the current chunk
+    size_t newUnits_  = 0; // words / punctuation added after the overlap
+    size_t keep_      = 0;
+    size_t pending_   = 0; // tokens of the word carried into the next chunk
+    bool byteCap_     = false;
+    std::deque<Unit> recent_; // trailing units within the overlap budget
+    size_t recentTokens_ = 0;
+
+    // accept - add a unit unless it would exceed the budget; a chunk always
+    // takes at least one new unit so that it makes progress
+    bool accept(size_t offset, size_t tokens) {
+        if (tokens_ + tokens > g_maxTokens && newUnits_ > 0) {
+            return false;
+        }
+        tokens_ += tokens;
+        newUnits_++;
+        if (g_tokenOverlap > 0) {
+            recent_.push_back({ offset, tokens });
+            recentTokens_ += tokens;
+            while (recentTokens_ > g_tokenOverlap) {
+                recentTokens_ -= recent_.front().tokens;
+                recent_.pop_front();
+            }
+        }
+        return true;
+    }
+};
+
+// largest chunk the current split mode can produce
+size_t chunk_buffer_size() {
+    return g_splitMode == SplitMode::ContentDefined ? g_chunk.cdcMax : g_chunk.limit;
+}
+
+// -----------------------------------------------------------------------------
+// 17) Chunker - streams data into chunks of the configured geometry and hands
+//     full ones to the FlushStage. Small chunks are handed over in batches
+//     (g_chunk.batch per submit) and their buffers taken from the pool in
+//     batches, so the pool and queue locks are not paid per chunk.
+// -----------------------------------------------------------------------------
+
+class Chunker;
+
+// InputFilter - turns raw input into the text that gets chunked (JSONL field
+// extraction, CSV rows) and pushes it into `out`; filter() may keep a partial
+// record until more input arrives
+class InputFilter {
+public:
+    virtual ~InputFilter() = default;
+    virtual void filter(const char* data, size_t len, Chunker& out) = 0;
+    virtual void finish(Chunker& out) = 0; // end of input
+};
+
+class Chunker {
+public:
+    static constexpr size_t FILTER_SLICE = 1024 * 1024;
+
+    Chunker(BufferPool& pool, FlushStage& flush, const std::string& source = "",
+            const std::string& format = "")
+    : pool_(pool), flush_(flush), source_(flush.addSource(source, format))
+    {
+        flush_.resumePoint(source_, resumeSeq_, resumeOffset_);
+        acquireNext();
+    }
+
+    ~Chunker() {
+        if (filter_) {
+            try {
+                filter_->finish(*this);
+            } catch (const std::exception& e) {
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cerr << "Error: " << e.what() << "\n";
+            }
+        }
+        // flush leftover data on destruction
+        flushCurrentBuffer();
+        submitPending();
+        pool_.releaseBuffers(spare_);
+        flush_.endSource(source_, seq_);
+    }
+
+    // For input chunked outside the chunker (stream_ranged): true while
+    // nothing has been pushed (past what skipCommitted() skipped), the next
+    // chunk's number and offset, and where the chunks go
+    bool untouched() const {
+        return !filter_ && seq_ == resumeSeq_ && position_ == resumeOffset_ &&
+               currentBuffer_->used == 0;
+    }
+    uint64_t nextSeq() const { return seq_; }
+    bool chunkedAny() const { return seq_ > 0 || position_ > 0 || currentBuffer_->used > 0; }
+    uint64_t position() const { return position_; }
+    uint32_t source() const { return source_; }
+    BufferPool& pool() { return pool_; }
+    FlushStage& flush() { return flush_; }
+
+    // skipTo - the input up to `offset` was chunked elsewhere into the chunks
+    // before `seq`; chunking carries on from there
+    void skipTo(uint64_t seq, uint64_t offset) {
+        seq_      = seq;
+        position_ = offset;
+        currentBuffer_->offset = offset;
+    }
+
+    // skipCommitted - with --resume, input read as it is (no filter, no token
+    // budget carried between chunks) continues at the end of the chunks
+    // already committed; returns that offset, where reading starts. Other
+    // input is chunked from the start and the committed chunks are dropped.
+    uint64_t skipCommitted() {
+        if (resumeSeq_ == 0 || filter_ || seq_ != 0 || currentBuffer_->used != 0 ||
+            g_splitMode == SplitMode::Tokens) {
+            return 0;
+        }
+        skipTo(resumeSeq_, resumeOffset_);
+        return resumeOffset_;
+    }
+
+    // releaseSpare - the input paused (a converter's pipe ran dry): hand the
+    // full chunks on and give the spare buffers back, so a chunker that waits
+    // for input holds only the chunk it is filling
+    void releaseSpare() {
+        submitPending();
+        pool_.releaseBuffers(spare_);
+    }
+
+    // setFilter - run all further input through `filter` before chunking it
+    void setFilter(std::unique_ptr<InputFilter> filter) {
+        filter_ = std::move(filter);
+    }
+
+    // push data into the chunker, splitting across as many chunks as needed
+    void pushData(const char* data, size_t len) {
+        if (g_timeStages) {
+            g_stageStats.count(COUNTER_BYTES_IN, len);
+        }
+        if (!filter_) {
+            pushText(data, len);
+            return;
+        }
+        // a slice at a time, so a whole mapped file is never filtered at once
+        for (size_t offset = 0; offset < len; offset += FILTER_SLICE) {
+            filter_->filter(data + offset, std::min(FILTER_SLICE, len - offset), *this);
+        }
+    }
+
+    // pushText - chunk text that needs no more filtering; one switch per
+    // call, the copy loop is compiled once per split mode
+    void pushText(const char* data, size_t len) {
+        switch (g_splitMode) {
+            case SplitMode::Fixed:          copyIn<SplitMode::Fixed>(data, len); break;
+            case SplitMode::ContentDefined: copyIn<SplitMode::ContentDefined>(data, len); break;
+            case SplitMode::Boundary:       copyIn<SplitMode::Boundary>(data, len); break;
+            case SplitMode::Tokens:         copyIn<SplitMode::Tokens>(data, len); break;
+        }
+    }
+
+    // setRecordHeader - text that record input (pushRecord) repeats at the
+    // start of every chunk: the CSV header row
+    void setRecordHeader(std::string header) {
+        recordHeader_ = std::move(header);
+    }
+
+    // pushRecord - push one whole record. With fixed-size and boundary splits
+    // a chunk is ended before a record that does not fit, so only a record
+    // larger than a chunk is ever split; content-defined and token splits cut
+    // where they would in plain text and carry the header once.
+    void pushRecord(const char* data, size_t len) {
+        bool aligned = g_splitMode == SplitMode::Fixed || g_splitMode == SplitMode::Boundary;
+        size_t used = currentBuffer_->used;
+        size_t header = headerChunk_ == seq_ ? recordHeader_.size() : 0;
+        if (aligned && used > header && used + len >= g_chunk.limit) {
+            position_ = currentBuffer_->offset + used;
+            flushCurrentBuffer();
+            acquireNext();
+            used = 0;
+        }
+        if (used == 0 && !recordHeader_.empty() && (aligned || seq_ == 0) &&
+            recordHeader_.size() < g_chunk.limit / 2) {
+            pushText(recordHeader_.data(), recordHeader_.size());
+            headerChunk_ = seq_;
+        }
+        pushText(data, len);
+    }
+
+    // pushMapped - like pushData, for input that stays valid as long as `owner`
+    // is alive (a mapped file). Chunks lying wholly inside it are handed to the
+    // flush workers as views instead of being copied into a pool buffer.
+    void pushMapped(const char* data, size_t len, const std::shared_ptr<const void>& owner) {
+        if (g_splitMode == SplitMode::Tokens || filter_) {
+            pushData(data, len); // small chunks with overlap, or rewritten text: no views
+            return;
+        }
+        if (g_timeStages) {
+            g_stageStats.count(COUNTER_BYTES_IN, len);
+        }
+        size_t offset = 0;
+        while (offset < len) {
+            bool cut = false;
+            size_t take = nextCutAny(data + offset, len - offset, cut);
+            if (cut && currentBuffer_->used == 0) {
+                if (g_splitMode == SplitMode::Boundary) {
+                    take = boundary_cut(data + offset, take); // the rest starts the next chunk
+                }
+                auto view = ChunkBuffer::view(data + offset, take, owner);
+                view->source = source_;
+                view->seq    = seq_++;
+                view->offset = position_;
+                queueChunk(std::move(view));
+                position_ += take;
+                currentBuffer_->offset = position_;
+                offset += take;
+                continue;
+            }
+            // partial chunk at either end of the mapping: copy as usual
+            {
+                StageTimer timer(STAGE_COPY);
+                std::memcpy(currentBuffer_->data.get() + currentBuffer_->used,
+                            data + offset, take);
+            }
+            currentBuffer_->used += take;
+            offset += take;
+
+            if (cut) {
+                completeChunk();
+            }
+        }
+    }
+
+private:
+    BufferPool& pool_;
+    FlushStage& flush_;
+    uint32_t source_;
+    std::unique_ptr<ChunkBuffer> currentBuffer_;
+    GearCdc cdc_;
+    TokenBudget tokens_;
+    std::vector<char> carry_; // bytes that move on to the next chunk
+    uint64_t seq_      = 0;   // chunks submitted so far
+    uint64_t position_ = 0;   // source offset of currentBuffer_'s first byte
+    uint64_t resumeSeq_    = 0; // --resume: chunks before this one are committed
+    uint64_t resumeOffset_ = 0; // and end here
+
+    ChunkBatch pending_;      // full, not yet submitted
+    ChunkBatch spare_;        // acquired ahead of use
+    std::unique_ptr<InputFilter> filter_;
+    std::string recordHeader_;
+    uint64_t headerChunk_ = UINT64_MAX; // seq_ of the chunk the header last started
+
+    template <SplitMode M>
+    void copyIn(const char* data, size_t len) {
+        size_t offset = 0;
+        while (offset < len) {
+            bool cut = false;
+            size_t toWrite;
+            {
+                StageTimer timer(STAGE_COPY);
+                toWrite = nextCut<M>(data + offset, len - offset, cut);
+                std::memcpy(currentBuffer_->data.get() + currentBuffer_->used,
+                            data + offset, toWrite);
+            }
+            currentBuffer_->used += toWrite;
+            offset += toWrite;
+
+            if (cut) {
+                completeChunk();
+            }
+        }
+    }
+
+    // nextCut - how many of the next n bytes belong to the current chunk, and
+    // whether the chunk is complete after them
+    template <SplitMode M>
+    size_t nextCut(const char* data, size_t n, bool& cut) {
+        size_t used = currentBuffer_->used;
+        if constexpr (M == SplitMode::ContentDefined) {
+            return cdc_.scan(reinterpret_cast<const unsigned char*>(data), n, used, cut);
+        } else if constexpr (M == SplitMode::Tokens) {
+            return tokens_.scan(reinterpret_cast<const unsigned char*>(data), n, used, cut);
+        } else {
+            size_t take = std::min(g_chunk.limit - used, n);
+            cut = used + take >= g_chunk.limit;
+            return take;
+        }
+    }
+
+    size_t nextCutAny(const char* data, size_t n, bool& cut) {
+        switch (g_splitMode) {
+            case SplitMode::ContentDefined: return nextCut<SplitMode::ContentDefined>(data, n, cut);
+            case SplitMode::Tokens:         return nextCut<SplitMode::Tokens>(data, n, cut);
+            default:                        return nextCut<SplitMode::Fixed>(data, n, cut);
+        }
+    }
+
+    // completeChunk - submit the full buffer and start the next one. With
+    // --split boundary the bytes after the chosen boundary (at most
+    // the variance) are carried over into the new buffer; with --max-tokens
+    // the word that overflowed the budget is, plus any --token-overlap.
+    void completeChunk() {
+        size_t keep = currentBuffer_->used;
+        size_t from = keep; // the next chunk starts with [from, used)
+        if (g_splitMode == SplitMode::Boundary) {
+            keep = from = boundary_cut(currentBuffer_->data.get(), currentBuffer_->used);
+        } else if (g_splitMode == SplitMode::Tokens) {
+            keep = tokens_.keep();
+            from = tokens_.overlapFrom();
+            tokens_.startNext(from);
+        }
+        carry_.assign(currentBuffer_->data.get() + from,
+                      currentBuffer_->data.get() + currentBuffer_->used);
+        currentBuffer_->used = keep;
+        position_ = currentBuffer_->offset + from;
+        flushCurrentBuffer();
+        acquireNext();
+        if (!carry_.empty()) {
+            std::memcpy(currentBuffer_->data.get(), carry_.data(), carry_.size());
+            currentBuffer_->used = carry_.size();
+            carry_.clear();
+        }
+    }
+
+    void acquireNext() {
+        if (spare_.empty()) {
+            // everything this chunker holds goes to the flush workers before
+            // it may wait on the pool for more
+            submitPending();
+            pool_.acquireBuffers(g_chunk.batch, spare_);
+        }
+        currentBuffer_ = std::move(spare_.back());
+        spare_.pop_back();
+        currentBuffer_->source = source_;
+        currentBuffer_->offset = position_;
+    }
+
+    // flushCurrentBuffer - hand the filled buffer to the flush workers
+    void flushCurrentBuffer() {
+        if (!currentBuffer_) {
+            return;
+        }
+        if (currentBuffer_->used == 0) {
+            pool_.releaseBuffer(std::move(currentBuffer_));
+            return;
+        }
+        currentBuffer_->seq = seq_++;
+        queueChunk(std::move(currentBuffer_));
+    }
+
+    void queueChunk(std::unique_ptr<ChunkBuffer> buf) {
+        if (buf->seq < resumeSeq_) {
+            pool_.releaseBuffer(std::move(buf)); // committed by an earlier attempt
+            return;
+        }
+        pending_.push_back(std::move(buf));
+        if (pending_.size() >= g_chunk.batch) {
+            submitPending();
+        }
+    }
+
+    void submitPending() {
+        if (!pending_.empty()) {
+            flush_.submit(std::move(pending_));
+            pending_.clear();
+        }
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 18) Streaming file read helper
+// -----------------------------------------------------------------------------
+// MappedFile - read-only private mapping of a whole input file
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size      = 0;
+
+    MappedFile(const char* d, size_t n) : data(d), size(n) {}
+    ~MappedFile() { munmap(const_cast<char*>(data), size); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
+
+// map_input - map a regular, non-empty file for sequential reading; returns
+// nullptr when the file cannot be mapped (pipes, /proc entries, ...)
+static std::shared_ptr<MappedFile> map_input(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        return nullptr;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    madvise(mem, size, MADV_SEQUENTIAL);
+    return std::make_shared<MappedFile>(static_cast<const char*>(mem), size);
+}
+
+// stream_fd - chunk everything readable from fd; regular files are mapped and
+// chunked in place (the flush workers hash and write straight from the page
+// cache), pipes and sockets are read in 64KB blocks
+static bool stream_fd(int fd, Chunker &chunker, uint64_t from = 0) {
+    std::shared_ptr<MappedFile> mapped = map_input(fd);
+    if (mapped) {
+        size_t skip = static_cast<size_t>(std::min<uint64_t>(from, mapped->size));
+        chunker.pushMapped(mapped->data + skip, mapped->size - skip, mapped);
+        return true;
+    }
+    if (from > 0 && ::lseek(fd, static_cast<off_t>(from), SEEK_SET) < 0) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: seek failed: " << std::strerror(errno) << "\n";
+        return false;
+    }
+
+    const size_t BUFSZ = 64 * 1024; // read in 64KB blocks
+    char buffer[BUFSZ];
+
+    for (;;) {
+        ssize_t bytesRead;
+        {
+            StageTimer timer(STAGE_READ);
+            bytesRead = ::read(fd, buffer, BUFSZ);
+        }
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead < 0) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: read failed: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        if (bytesRead == 0) {
+            return true;
+        }
+        chunker.pushData(buffer, static_cast<size_t>(bytesRead));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 19) Ranged file reads (--file-threads). With fixed and boundary splits a
+//     chunk's end follows from its start and at most its last --chunk-variance
+//     bytes, so the calling thread plans the cuts ahead (one small pread per
+//     chunk for boundary cuts) and worker threads preadv runs of whole chunks
+//     into pool buffers, then hash and store them on their own thread. Chunk
+//     numbers and offsets are the ones the single-threaded path produces.
+// -----------------------------------------------------------------------------
+
+// preadv_all - fill the buffers back to back from `offset`; false on a read
+// error or when the file ends first
+static bool preadv_all(int fd, std::vector<iovec>& iov, off_t offset) {
+    size_t first = 0;
+    while (first < iov.size()) {
+        int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+        ssize_t n = preadv(fd, &iov[first], count, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        offset += n;
+        size_t left = static_cast<size_t>(n);
+        while (first < iov.size() && left >= iov[first].iov_len) {
+            left -= iov[first++].iov_len;
+        }
+        if (left > 0) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+            iov[first].iov_len -= left;
+        }
+    }
+    return true;
+}
+
+// FileRange - consecutive chunks, the first one numbered seq
+struct FileRange {
+    uint64_t seq;
+    uint64_t offset;
+    std::vector<size_t> lengths;
+};
+
+// RangePlanner - the cuts pushMapped would make, one chunk at a time
+class RangePlanner {
+public:
+    RangePlanner(int fd, uint64_t size) : fd_(fd), size_(size) {}
+
+    // next - length of the chunk starting at `offset`; 0 on a read error
+    size_t next(uint64_t offset) {
+        uint64_t left = size_ - offset;
+        if (left < g_chunk.limit) {
+            return static_cast<size_t>(left); // the last chunk, never cut
+        }
+        if (g_splitMode != SplitMode::Boundary) {
+            return g_chunk.limit;
+        }
+        // boundary_cut looks at the last `variance` bytes (and the 3 before
+        // them for UTF-8), so the end of the chunk is all that is read
+        size_t tail = std::min(g_chunk.limit, g_chunk.variance + 4);
+        window_.resize(tail);
+        std::vector<iovec> iov{ { window_.data(), tail } };
+        {
+            StageTimer timer(STAGE_READ);
+            if (!preadv_all(fd_, iov, static_cast<off_t>(offset + g_chunk.limit - tail))) {
+                return 0;
+            }
+        }
+        return g_chunk.limit - tail + boundary_cut(window_.data(), tail);
+    }
+
+private:
+    int fd_;
+    uint64_t size_;
+    std::vector<char> window_;
+};
+
+// stream_ranged - chunk the regular file `fd` of `size` bytes on g_fileThreads
+// workers, from where the chunker stands; ranges of g_chunk.batch chunks are
+// planned at most a few per worker ahead of them
+static bool stream_ranged(int fd, uint64_t size, Chunker& chunker) {
+    uint64_t offset = chunker.position();
+    uint64_t seq    = chunker.nextSeq();
+    if (g_timeStages) {
+        g_stageStats.count(COUNTER_BYTES_IN, size - offset);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    BufferPool& pool = chunker.pool();
+    FlushStage& flush = chunker.flush();
+    uint32_t source = chunker.source();
+    flush.orderRows(source, seq);
+    const size_t window = g_fileThreads * 4;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<FileRange> ranges;
+    bool planned = false;
+    bool failed  = false;
+
+    auto readRange = [&](const FileRange& range) {
+        std::vector<iovec> iov;
+        uint64_t offset = range.offset;
+        for (size_t i = 0; i < range.lengths.size();) {
+            ChunkBatch batch;
+            pool.acquireBuffers(range.lengths.size() - i, batch);
+            iov.clear();
+            for (size_t k = 0; k < batch.size(); k++) {
+                iov.push_back({ batch[k]->data.get(), range.lengths[i + k] });
+            }
+            bool ok;
+            {
+                StageTimer timer(STAGE_READ);
+                ok = preadv_all(fd, iov, static_cast<off_t>(offset));
+            }
+            if (!ok) {
+                pool.releaseBuffers(batch);
+                return false;
+            }
+            for (auto& buf : batch) {
+                buf->used   = range.lengths[i];
+                buf->source = source;
+                buf->seq    = range.seq + i;
+                buf->offset = offset;
+                offset += buf->used;
+                i++;
+            }
+            flush.write(std::move(batch));
+        }
+        return true;
+    };
+    auto worker = [&] {
+        for (;;) {
+            FileRange range;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return failed || planned || !ranges.empty(); });
+                if (failed || ranges.empty()) {
+                    break;
+                }
+                range = std::move(ranges.front());
+                ranges.pop_front();
+            }
+            changed.notify_all();
+            bool ok;
+            try {
+                ok = readRange(range);
+            } catch (const std::exception&) {
+                ok = false;
+            }
+            if (!ok) {
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+            }
+        }
+        flush.detachWriter();
+        changed.notify_all();
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < g_fileThreads; t++) {
+        workers.emplace_back(worker);
+    }
+    auto finish = [&] {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            planned = true;
+        }
+        changed.notify_all();
+        for (auto& t : workers) {
+            t.join();
+        }
+        // the sink may still hold chunks (in a shared S3 pack, an HTTP batch);
+        // their rows go out in order once they complete
+        if (failed) {
+            flush.releaseRows(source);
+        }
+    };
+
+    try {
+        RangePlanner planner(fd, size);
+        while (offset < size) {
+            FileRange range{ seq, offset, {} };
+            while (range.lengths.size() < g_chunk.batch && offset < size) {
+                size_t length = planner.next(offset);
+                if (length == 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    failed = true;
+                    break;
+                }
+                range.lengths.push_back(length);
+                offset += length;
+                seq++;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return failed || ranges.size() < window; });
+            if (failed) {
+                break;
+            }
+            ranges.push_back(std::move(range));
+            lock.unlock();
+            changed.notify_all();
+        }
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = true;
+        }
+        finish();
+        throw;
+    }
+    finish();
+    if (failed) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: could not read the input in ranges\n";
+        return false;
+    }
+    chunker.skipTo(seq, size);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// 20) Compressed input - gzip, zstd, bzip2 and xz, recognized by their magic
+//     bytes whatever the file name, are decompressed on the way into the
+//     chunker in DECODE_BLOCK_BYTES blocks. With --decompress-threads, files
+//     made of independent pieces (zstd frames, BGZF blocks) are decoded on
+//     several threads and pushed in order.
+// -----------------------------------------------------------------------------
+enum class Compression { None, Gzip, Zstd, Bzip2, Xz };
+
+static const size_t COMPRESSION_MAGIC_BYTES = 10; // enough for every check below
+
+// sniff_compression - format of data starting with `p`
+static Compression sniff_compression(const unsigned char* p, size_t n) {
+    if (n >= 3 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8) {
+        return Compression::Gzip;
+    }
+    if (n >= 4 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd && p[0] == 0x28) {
+        return Compression::Zstd;
+    }
+    if (n >= 4 && (p[0] & 0xf0) == 0x50 && p[1] == 0x2a && p[2] == 0x4d && p[3] == 0x18) {
+        return Compression::Zstd; // skippable frame
+    }
+    if (n >= 10 && std::memcmp(p, "BZh", 3) == 0 && p[3] >= '1' && p[3] <= '9' &&
+        (std::memcmp(p + 4, "1AY&SY", 6) == 0 || std::memcmp(p + 4, "\x17rE8P\x90", 6) == 0)) {
+        return Compression::Bzip2;
+    }
+    if (n >= 6 && std::memcmp(p, "\xfd" "7zXZ\0", 6) == 0) {
+        return Compression::Xz;
+    }
+    return Compression::None;
+}
+
+static const char* compression_name(Compression c) {
+    switch (c) {
+        case Compression::Gzip:  return "gzip";
+        case Compression::Zstd:  return "zstd";
+        case Compression::Bzip2: return "bzip2";
+        case Compression::Xz:    return "xz";
+        case Compression::None:  break;
+    }
+    return "none";
+}
+
+// file name suffixes of compressed input, read like .txt
+bool is_compressed_extension(const std::string& extension) {
+    return extension == "gz" || extension == "zst" || extension == "bz2" || extension == "xz";
+}
+
+// Decoder - one streaming decompressor. decode() consumes from `in` and
+// writes up to `outCap` bytes to `out`; End means a complete stream (gzip
+// member, zstd frame, ...) has been decoded and reset() starts the next one.
+class Decoder {
+public:
+    enum Status { Ok, End, Error };
+
+    virtual ~Decoder() = default;
+    virtual Status decode(const unsigned char*& in, size_t& inLeft, unsigned char* out,
+                          size_t outCap, size_t& produced, bool last) = 0;
+    virtual void reset() = 0;
+    const std::string& error() const { return error_; }
+
+protected:
+    std::string error_;
+};
+
+class GzipDecoder : public Decoder {
+public:
+    GzipDecoder() {
+        if (inflateInit2(&zs_, 16 + MAX_WBITS) != Z_OK) {
+            throw std::runtime_error("Could not initialize zlib");
+        }
+    }
+    ~GzipDecoder() override { inflateEnd(&zs_); }
+
+    Status decode(const unsigned char*& in, size_t& inLeft, unsigned char* out, size_t outCap,
+                  size_t& produced, bool /*last*/) override {
+        zs_.next_in   = const_cast<Bytef*>(in);
+        zs_.avail_in  = static_cast<uInt>(std::min<size_t>(inLeft, UINT_MAX));
+        zs_.next_out  = out;
+        zs_.avail_out = static_cast<uInt>(std::min<size_t>(outCap, UINT_MAX));
+        int rc = inflate(&zs_, Z_NO_FLUSH);
+        size_t used = static_cast<size_t>(zs_.next_in - in);
+        in += used;
+        inLeft -= used;
+        produced = static_cast<size_t>(zs_.next_out - out);
+        if (rc == Z_STREAM_END) {
+            return End;
+        }
+        if (rc == Z_OK || rc == Z_BUF_ERROR) {
+            return Ok;
+        }
+        error_ = zs_.msg ? zs_.msg : "corrupt deflate data";
+        return Error;
+    }
+
+    void reset() override { inflateReset(&zs_); }
+
+private:
+    z_stream zs_{};
+};
+
+#ifdef CHUNK_WITH_ZSTD
+class ZstdDecoder : public Decoder {
+public:
+    ZstdDecoder() : dctx_(ZSTD_createDCtx()) {
+        if (!dctx_) {
+            throw std::runtime_error("Could not create a zstd context");
+        }
+    }
+    ~ZstdDecoder() override { ZSTD_freeDCtx(dctx_); }
+
+    Status decode(const unsigned char*& in, size_t& inLeft, unsigned char* out, size_t outCap,
+                  size_t& produced, bool /*last*/) override {
+        ZSTD_inBuffer src{ in, inLeft, 0 };
+        ZSTD_outBuffer dst{ out, outCap, 0 };
+        size_t rc = ZSTD_decompressStream(dctx_, &dst, &src);
+        in += src.pos;
+        inLeft -= src.pos;
+        produced = dst.pos;
+        if (ZSTD_isError(rc)) {
+            error_ = ZSTD_getErrorName(rc);
+            return Error;
+        }
+        return rc == 0 ? End : Ok;
+    }
+
+    void reset() override { ZSTD_DCtx_reset(dctx_, ZSTD_reset_session_only); }
+
+private:
+    ZSTD_DCtx* dctx_;
+};
+#endif
+
+#ifdef CHUNK_WITH_BZIP2
+class Bzip2Decoder : public Decoder {
+public:
+    Bzip2Decoder() { init(); }
+    ~Bzip2Decoder() override { BZ2_bzDecompressEnd(&bz_); }
+
+    Status decode(const unsigned char*& in, size_t& inLeft, unsigned char* out, size_t outCap,
+                  size_t& produced, bool /*last*/) override {
+        bz_.next_in   = reinterpret_cast<char*>(const_cast<unsigned char*>(in));
+        bz_.avail_in  = static_cast<unsigned>(std::min<size_t>(inLeft, UINT_MAX));
+        bz_.next_out  = reinterpret_cast<char*>(out);
+        bz_.avail_out = static_cast<unsigned>(std::min<size_t>(outCap, UINT_MAX));
+        int rc = BZ2_bzDecompress(&bz_);
+        size_t used = static_cast<size_t>(reinterpret_cast<unsigned char*>(bz_.next_in) - in);
+        in += used;
+        inLeft -= used;
+        produced = static_cast<size_t>(reinterpret_cast<unsigned char*>(bz_.next_out) - out);
+        if (rc == BZ_STREAM_END) {
+            return End;
+        }
+        if (rc == BZ_OK) {
+            return Ok;
+        }
+        error_ = "corrupt bzip2 data (error " + std::to_string(rc) + ")";
+        return Error;
+    }
+
+    void reset() override {
+        BZ2_bzDecompressEnd(&bz_);
+        init();
+    }
+
+private:
+    bz_stream bz_;
+
+    void init() {
+        std::memset(&bz_, 0, sizeof(bz_));
+        if (BZ2_bzDecompressInit(&bz_, 0, 0) != BZ_OK) {
+            throw std::runtime_error("Could not initialize bzip2");
+        }
+    }
+};
+#endif
+
+#ifdef CHUNK_WITH_LZMA
+class XzDecoder : public Decoder {
+public:
+    XzDecoder() { init(); }
+    ~XzDecoder() override { lzma_end(&strm_); }
+
+    Status decode(const unsigned char*& in, size_t& inLeft, unsigned char* out, size_t outCap,
+                  size_t& produced, bool last) override {
+        strm_.next_in   = in;
+        strm_.avail_in  = inLeft;
+        strm_.next_out  = out;
+        strm_.avail_out = outCap;
+        lzma_ret rc = lzma_code(&strm_, last ? LZMA_FINISH : LZMA_RUN);
+        size_t used = static_cast<size_t>(strm_.next_in - in);
+        in += used;
+        inLeft -= used;
+        produced = static_cast<size_t>(strm_.next_out - out);
+        if (rc == LZMA_STREAM_END) {
+            return End;
+        }
+        if (rc == LZMA_OK || rc == LZMA_BUF_ERROR) {
+            return Ok;
+        }
+        error_ = "corrupt xz data (error " + std::to_string(static_cast<int>(rc)) + ")";
+        return Error;
+    }
+
+    void reset() override {
+        lzma_end(&strm_);
+        init();
+    }
+
+private:
+    lzma_stream strm_;
+
+    void init() {
+        lzma_stream blank = LZMA_STREAM_INIT;
+        strm_ = blank;
+        if (lzma_stream_decoder(&strm_, UINT64_MAX, 0) != LZMA_OK) {
+            throw std::runtime_error("Could not initialize liblzma");
+        }
+    }
+};
+#endif
+
+// make_decoder - nullptr when support for the format is not compiled in
+static std::unique_ptr<Decoder> make_decoder(Compression c) {
+    switch (c) {
+        case Compression::Gzip:  return std::make_unique<GzipDecoder>();
+#ifdef CHUNK_WITH_ZSTD
+        case Compression::Zstd:  return std::make_unique<ZstdDecoder>();
+#endif
+#ifdef CHUNK_WITH_BZIP2
+        case Compression::Bzip2: return std::make_unique<Bzip2Decoder>();
+#endif
+#ifdef CHUNK_WITH_LZMA
+        case Compression::Xz:    return std::make_unique<XzDecoder>();
+#endif
+        default: break;
+    }
+    return nullptr;
+}
+
+// stream_decompressed - decode everything readable from fd (after the `head`
+// bytes already read from it) into the chunker. Concatenated streams are
+// decoded one after another; anything else after the last one is ignored
+// with a warning.
+static bool stream_decompressed(int fd, Compression format, const unsigned char* head,
+                                size_t headLen, Chunker& chunker) {
+    std::unique_ptr<Decoder> decoder = make_decoder(format);
+    if (!decoder) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: " << compression_name(format)
+        << " input, but this build has no " << compression_name(format) << " support\n";
+        return false;
+    }
+
+    std::vector<unsigned char> in(DECODE_BLOCK_BYTES);
+    std::vector<unsigned char> out(DECODE_BLOCK_BYTES);
+    std::memcpy(in.data(), head, headLen);
+    size_t inPos = 0;
+    size_t inLen = headLen;
+    bool eof = false;
+
+    // refill - keep the unread bytes and read more after them
+    auto refill = [&]() -> bool {
+        std::memmove(in.data(), in.data() + inPos, inLen - inPos);
+        inLen -= inPos;
+        inPos = 0;
+        while (!eof && inLen < in.size()) {
+            ssize_t n;
+            {
+                StageTimer timer(STAGE_READ);
+                n = ::read(fd, in.data() + inLen, in.size() - inLen);
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cerr << "Error: read failed: " << std::strerror(errno) << "\n";
+                return false;
+            }
+            eof = n == 0;
+            inLen += static_cast<size_t>(n);
+            break;
+        }
+        return true;
+    };
+
+    for (;;) {
+        if (inPos == inLen && !eof && !refill()) {
+            return false;
+        }
+        const unsigned char* next = in.data() + inPos;
+        size_t left = inLen - inPos;
+        size_t produced = 0;
+        Decoder::Status status;
+        {
+            StageTimer timer(STAGE_FORMAT);
+            status = decoder->decode(next, left, out.data(), out.size(), produced, eof);
+        }
+        inPos = inLen - left;
+        if (produced > 0) {
+            chunker.pushData(reinterpret_cast<const char*>(out.data()), produced);
+        }
+        if (status == Decoder::Error) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: " << compression_name(format) << ": " << decoder->error() << "\n";
+            return false;
+        }
+        if (status == Decoder::End) {
+            if (inLen - inPos < COMPRESSION_MAGIC_BYTES && !eof && !refill()) {
+                return false;
+            }
+            if (inPos == inLen) {
+                return true;
+            }
+            if (sniff_compression(in.data() + inPos, inLen - inPos) != format) {
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cerr << "Warning: ignoring data after the end of the "
+                << compression_name(format) << " stream\n";
+                return true;
+            }
+            decoder->reset();
+        } else if (produced == 0 && inPos == inLen && eof) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: " << compression_name(format) << ": unexpected end of input\n";
+            return false;
+        }
+    }
+}
+
+// DecodeTask - a run of independently decodable pieces of a mapped file
+struct DecodeTask {
+    size_t offset;
+    size_t length;
+    size_t outSize; // bytes once decompressed
+};
+
+// add_decode_piece - extend the last task, or start a new one once it holds
+// DECODE_TASK_BYTES of output
+static void add_decode_piece(std::vector<DecodeTask>& tasks, size_t offset, size_t length,
+                             size_t outSize) {
+    if (tasks.empty() || tasks.back().outSize + outSize > DECODE_TASK_BYTES) {
+        tasks.push_back({ offset, 0, 0 });
+    }
+    tasks.back().length += length;
+    tasks.back().outSize += outSize;
+}
+
+// bgzf_tasks - split BGZF (bgzip / htslib) input at its blocks: each gzip
+// member records its own compressed size in a "BC" extra subfield and its
+// decompressed size in the trailer. false unless every member does.
+static bool bgzf_tasks(const unsigned char* p, size_t n, std::vector<DecodeTask>& tasks) {
+    size_t pos = 0;
+    while (pos < n) {
+        if (n - pos < 18 || p[pos] != 0x1f || p[pos + 1] != 0x8b || p[pos + 2] != 8 ||
+            !(p[pos + 3] & 0x04)) {
+            return false;
+        }
+        size_t extraEnd = pos + 12 + (p[pos + 10] | (p[pos + 11] << 8));
+        size_t blockSize = 0;
+        for (size_t x = pos + 12; x + 4 <= extraEnd && extraEnd <= n;) {
+            size_t len = p[x + 2] | (p[x + 3] << 8);
+            if (p[x] == 'B' && p[x + 1] == 'C' && len == 2 && x + 6 <= extraEnd) {
+                blockSize = (p[x + 4] | (p[x + 5] << 8)) + 1;
+            }
+            x += 4 + len;
+        }
+        if (blockSize == 0 || blockSize < extraEnd - pos + 8 || blockSize > n - pos) {
+            return false;
+        }
+        const unsigned char* trailer = p + pos + blockSize - 4;
+        size_t outSize = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+                         (static_cast<size_t>(trailer[3]) << 24);
+        add_decode_piece(tasks, pos, blockSize, outSize);
+        pos += blockSize;
+    }
+    return true;
+}
+
+// inflate_members - decode consecutive whole gzip members into `out`
+static bool inflate_members(const unsigned char* p, const DecodeTask& task,
+                            std::vector<char>& out) {
+    out.resize(task.outSize);
+    GzipDecoder decoder;
+    const unsigned char* next = p + task.offset;
+    size_t left = task.length;
+    size_t total = 0;
+    while (left > 0) {
+        size_t produced = 0;
+        Decoder::Status status =
+            decoder.decode(next, left, reinterpret_cast<unsigned char*>(out.data()) + total,
+                           out.size() - total, produced, true);
+        total += produced;
+        if (status == Decoder::Error || (status == Decoder::Ok && produced == 0)) {
+            return false;
+        }
+        if (status == Decoder::End) {
+            decoder.reset();
+        }
+    }
+    return total == out.size();
+}
+
+#ifdef CHUNK_WITH_ZSTD
+// zstd_tasks - split input at zstd frames; false unless every frame records
+// a decompressed size of at most DECODE_MAX_FRAME_BYTES
+static bool zstd_tasks(const unsigned char* p, size_t n, std::vector<DecodeTask>& tasks) {
+    size_t pos = 0;
+    while (pos < n) {
+        size_t frame = ZSTD_findFrameCompressedSize(p + pos, n - pos);
+        if (ZSTD_isError(frame)) {
+            return false;
+        }
+        unsigned long long size = ZSTD_getFrameContentSize(p + pos, n - pos);
+        if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+            size > DECODE_MAX_FRAME_BYTES) {
+            return false;
+        }
+        add_decode_piece(tasks, pos, frame, static_cast<size_t>(size));
+        pos += frame;
+    }
+    return true;
+}
+
+static bool decompress_frames(const unsigned char* p, const DecodeTask& task,
+                              std::vector<char>& out) {
+    struct DCtxFree {
+        void operator()(ZSTD_DCtx* c) const { ZSTD_freeDCtx(c); }
+    };
+    thread_local std::unique_ptr<ZSTD_DCtx, DCtxFree> dctx(ZSTD_createDCtx());
+    out.resize(task.outSize);
+    size_t n = ZSTD_decompressDCtx(dctx.get(), out.data(), out.size(), p + task.offset,
+                                   task.length);
+    return !ZSTD_isError(n) && n == out.size();
+}
+#endif
+
+// run_ordered - produce(i, out) for every i < count on `threads` threads and
+// consume() the results on the calling thread in index order; producers stay
+// at most a small window ahead of it, which bounds the memory held. false
+// when a producer failed (results after it are dropped).
+template <typename T>
+static bool run_ordered(size_t count, size_t threads,
+                        const std::function<bool(size_t, T&)>& produce,
+                        const std::function<void(T&)>& consume) {
+    const size_t window = threads * 2;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<size_t, T> decoded;
+    size_t nextToTake = 0;
+    size_t nextToPush = 0;
+    bool stop   = false;
+    bool failed = false;
+
+    auto worker = [&] {
+        for (;;) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] {
+                    return stop || nextToTake >= count || nextToTake < nextToPush + window;
+                });
+                if (stop || nextToTake >= count) {
+                    return;
+                }
+                index = nextToTake++;
+            }
+            T out;
+            bool ok;
+            try {
+                ok = produce(index, out);
+            } catch (const std::exception&) {
+                ok = false;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (ok) {
+                    decoded[index] = std::move(out);
+                } else {
+                    failed = stop = true;
+                }
+            }
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back(worker);
+    }
+    auto finish = [&] {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        for (auto& t : workers) {
+            t.join();
+        }
+    };
+
+    try {
+        for (size_t i = 0; i < count; i++) {
+            T out;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return failed || decoded.count(i) > 0; });
+                if (failed) {
+                    break;
+                }
+                out = std::move(decoded[i]);
+                decoded.erase(i);
+                nextToPush = i + 1;
+            }
+            changed.notify_all();
+            consume(out);
+        }
+    } catch (...) {
+        finish();
+        throw;
+    }
+    finish();
+    return !failed;
+}
+
+// stream_decompressed_parallel - the --decompress-threads path for a mapped
+// file; false with nothing pushed when it does not split into several tasks
+static bool stream_decompressed_parallel(const MappedFile& file, Compression format,
+                                         Chunker& chunker, bool& ok) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(file.data);
+    std::vector<DecodeTask> tasks;
+    std::function<bool(const DecodeTask&, std::vector<char>&)> decode;
+    if (format == Compression::Gzip && bgzf_tasks(p, file.size, tasks)) {
+        decode = [p](const DecodeTask& task, std::vector<char>& out) {
+            return inflate_members(p, task, out);
+        };
+#ifdef CHUNK_WITH_ZSTD
+    } else if (format == Compression::Zstd && zstd_tasks(p, file.size, tasks)) {
+        decode = [p](const DecodeTask& task, std::vector<char>& out) {
+            return decompress_frames(p, task, out);
+        };
+#endif
+    }
+    if (!decode || tasks.size() < 2) {
+        return false;
+    }
+    ok = run_ordered<std::vector<char>>(
+        tasks.size(), std::min(g_decompressThreads, tasks.size()),
+        [&](size_t i, std::vector<char>& out) {
+            StageTimer timer(STAGE_FORMAT);
+            return decode(tasks[i], out);
+        },
+        [&](std::vector<char>& out) { chunker.pushData(out.data(), out.size()); });
+    if (!ok) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: " << compression_name(format) << ": corrupt input\n";
+    }
+    return true;
+}
+
+// stream_input - stream_fd for input that may be compressed. Regular files
+// are sniffed with pread; from a pipe the first bytes are read and handed on.
+static bool stream_input(int fd, Chunker& chunker) {
+    unsigned char head[COMPRESSION_MAGIC_BYTES];
+    size_t headLen = 0;
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    while (headLen < sizeof(head)) {
+        ssize_t n = regular ? ::pread(fd, head + headLen, sizeof(head) - headLen,
+                                      static_cast<off_t>(headLen))
+                            : ::read(fd, head + headLen, sizeof(head) - headLen);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break; // a read error shows up again below
+        }
+        headLen += static_cast<size_t>(n);
+    }
+
+    Compression format = sniff_compression(head, headLen);
+    // --resume: plain files continue after the chunks already committed
+    uint64_t from = format == Compression::None && regular ? chunker.skipCommitted() : 0;
+    if (format == Compression::None && regular && g_fileThreads > 1 &&
+        static_cast<uint64_t>(st.st_size) >= FILE_RANGE_MIN_BYTES && chunker.untouched() &&
+        (g_splitMode == SplitMode::Fixed || g_splitMode == SplitMode::Boundary)) {
+        return stream_ranged(fd, static_cast<uint64_t>(st.st_size), chunker);
+    }
+    if (format == Compression::None) {
+        if (!regular) {
+            chunker.pushData(reinterpret_cast<const char*>(head), headLen);
+        }
+        return stream_fd(fd, chunker, from);
+    }
+    if (regular && g_decompressThreads > 1) {
+        std::shared_ptr<MappedFile> mapped = map_input(fd);
+        bool ok = false;
+        if (mapped && stream_decompressed_parallel(*mapped, format, chunker, ok)) {
+            return ok;
+        }
+    }
+    return stream_decompressed(fd, format, head, regular ? 0 : headLen, chunker);
+}
+
+bool stream_file(const std::string &filePath, Chunker &chunker) {
+    int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: Could not open " << filePath << "\n";
+        return false;
+    }
+    bool ok = stream_input(fd, chunker);
+    ::close(fd);
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// 21) External Tools to convert PDF, DOC, ODT, RTF -> text on a pipe,
+//    which is streamed into the chunker as it arrives
+// -----------------------------------------------------------------------------
+
+// lowercase extension without the dot, empty when there is none
+std::string file_extension(const std::string& filePath) {
+    std::string extension;
+    size_t pos = filePath.rfind('.');
+    if (pos != std::string::npos) {
+        extension = filePath.substr(pos + 1);
+        std::transform(extension.begin(), extension.end(),
+                       extension.begin(), ::tolower);
+    }
+    return extension;
+}
+
+// converter_command - argv of the external tool that turns a PDF/DOC/ODT/RTF
+// file into text on stdout; empty for formats that are read natively
+std::vector<std::string> converter_command(const std::string& extension,
+                                           const std::string& filePath) {
+    if (extension == "pdf") {
+        return { "pdftotext", filePath, "-" };
+    } else if (extension == "doc" || extension == "docx") {
+        // If doc2txt doesn't support "-", you may need a temp file approach
+        return { "doc2txt", filePath, "-" };
+    } else if (extension == "odt") {
+        return { "odt2txt", "--stdout", filePath };
+    } else if (extension == "rtf") {
+        return { "unrtf", "--text", filePath };
+    }
+    return {};
+}
+
+// needs_converter - true when the file is read through an external process
+bool needs_converter(const std::string& filePath) {
+    std::string extension = file_extension(filePath);
+    if (extension == "pdf" && g_pdfEngine == PdfEngine::Poppler) {
+        return false;
+    }
+    if (extension == "docx" || extension == "odt") {
+        return false; // unzipped in-process, see stream_doc / stream_odt
+    }
+    return !converter_command(extension, filePath).empty();
+}
+
+static std::string join_command(const std::vector<std::string>& argv) {
+    std::string cmd;
+    for (const std::string& arg : argv) {
+        cmd += (cmd.empty() ? "" : " ") + arg;
+    }
+    return cmd;
+}
+
+// spawn_command - start argv[0] (looked up in PATH, no shell involved) with
+// stdout connected to a pipe; returns the read end in *readFd
+bool spawn_command(const std::vector<std::string>& argv, pid_t* pid, int* readFd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return false;
+    }
+    std::vector<char*> args;
+    for (const std::string& arg : argv) {
+        args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    int rc = posix_spawnp(pid, args[0], &actions, nullptr, args.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    ::close(fds[1]);
+    if (rc != 0) {
+        ::close(fds[0]);
+        errno = rc;
+        return false;
+    }
+    *readFd = fds[0];
+    return true;
+}
+
+// report_exit - warn about a converter that did not exit cleanly; false
+// then, so --state and the journal treat the input as not fully read (its
+// chunks so far are still written)
+static bool report_exit(int status, const std::vector<std::string>& argv) {
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(g_logMutex);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        std::cerr << "Warning: command not found: " << argv[0] << "\n";
+    } else if (WIFEXITED(status)) {
+        std::cerr << "Warning: command exited with code " << WEXITSTATUS(status)
+        << ": " << join_command(argv) << "\n";
+    } else {
+        std::cerr << "Warning: command terminated abnormally: " << join_command(argv) << "\n";
+    }
+    return false;
+}
+
+// Run a converter and feed its stdout directly into the chunker in small blocks
+bool stream_command_output(const std::vector<std::string>& argv, Chunker &chunker) {
+    auto started = std::chrono::steady_clock::now();
+    pid_t pid;
+    int fd;
+    if (argv.empty() || !spawn_command(argv, &pid, &fd)) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: could not start command: " << join_command(argv)
+        << " (" << std::strerror(errno) << ")\n";
+        return false;
+    }
+
+    const size_t BUFSZ = 64 * 1024;
+    char buffer[BUFSZ];
+    for (;;) {
+        ssize_t bytesRead;
+        {
+            StageTimer timer(STAGE_READ);
+            bytesRead = ::read(fd, buffer, BUFSZ);
+        }
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            break;
+        }
+        chunker.pushData(buffer, static_cast<size_t>(bytesRead));
+    }
+    ::close(fd);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    record_since(STAGE_CONVERT, started);
+    return report_exit(status, argv);
+}
+
+#ifdef CHUNK_WITH_POPPLER
+// pdf_page_text - UTF-8 text of one page followed by a form feed, the same
+// page separator pdftotext writes
+static poppler::byte_array pdf_page_text(const poppler::document& doc, int index) {
+    poppler::byte_array text;
+    std::unique_ptr<poppler::page> page(doc.create_page(index));
+    if (page) {
+        text = page->text().to_utf8();
+    }
+    text.push_back('\f');
+    return text;
+}
+
+// stream_pdf_poppler - extract in-process. With --pdf-threads N every thread
+// opens its own poppler::document (one document is not safe to share) and
+// takes the next page from a common counter; the calling thread pushes pages
+// in order and workers stay at most a small window of pages ahead of it.
+static bool stream_pdf_poppler(const std::string& filePath, Chunker& chunker) {
+    std::unique_ptr<poppler::document> doc(poppler::document::load_from_file(filePath));
+    if (!doc || doc->is_locked()) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: Poppler could not open " << filePath
+        << (doc ? " (encrypted)" : "") << "\n";
+        return false;
+    }
+    int pages = doc->pages();
+    size_t threads = std::min(g_pdfThreads,
+                              static_cast<size_t>(pages) / PDF_PAGES_PER_THREAD);
+    if (threads <= 1) {
+        for (int i = 0; i < pages; i++) {
+            poppler::byte_array text = pdf_page_text(*doc, i);
+            chunker.pushData(text.data(), text.size());
+        }
+        return true;
+    }
+
+    const int window = static_cast<int>(threads) * 4;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<int, poppler::byte_array> extracted;
+    int nextToTake = 0;
+    int nextToPush = 0;
+    bool stop = false;
+
+    auto worker = [&](const poppler::document* shared) {
+        std::unique_ptr<poppler::document> own;
+        if (!shared) {
+            own.reset(poppler::document::load_from_file(filePath));
+            if (!own) {
+                return; // the remaining workers pick up its pages
+            }
+            shared = own.get();
+        }
+        for (;;) {
+            int index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] {
+                    return stop || nextToTake >= pages || nextToTake < nextToPush + window;
+                });
+                if (stop || nextToTake >= pages) {
+                    return;
+                }
+                index = nextToTake++;
+            }
+            poppler::byte_array text = pdf_page_text(*shared, index);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                extracted[index] = std::move(text);
+            }
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.emplace_back(worker, doc.get());
+    for (size_t t = 1; t < threads; t++) {
+        workers.emplace_back(worker, nullptr);
+    }
+
+    auto joinAll = [&] {
+        for (auto& t : workers) {
+            t.join();
+        }
+    };
+    try {
+        for (int i = 0; i < pages; i++) {
+            poppler::byte_array text;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return extracted.count(i) > 0; });
+                text = std::move(extracted[i]);
+                extracted.erase(i);
+                nextToPush = i + 1;
+            }
+            changed.notify_all();
+            chunker.pushData(text.data(), text.size());
+        }
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        joinAll();
+        throw;
+    }
+    joinAll();
+    return true;
+}
+#endif
+
+// For PDF: Poppler in-process when built with it, else "pdftotext <file> -"
+bool stream_pdf(const std::string &filePath, Chunker &chunker) {
+#ifdef CHUNK_WITH_POPPLER
+    if (g_pdfEngine == PdfEngine::Poppler) {
+        return stream_pdf_poppler(filePath, chunker);
+    }
+#endif
+    return stream_command_output(converter_command("pdf", filePath), chunker);
+}
+
+// RTF: "unrtf --text <file>" -> parse from stdout
+bool stream_rtf(const std::string &filePath, Chunker &chunker) {
+    return stream_command_output(converter_command("rtf", filePath), chunker);
+}
+
+// For CSV or TXT, we can read the file directly in binary mode
+bool stream_csv_or_txt(const std::string &filePath, Chunker &chunker) {
+    return stream_file(filePath, chunker);
+}
+
+// For unknown extension, attempt plain text read
+bool stream_unknown(const std::string &filePath, Chunker &chunker) {
+    return stream_file(filePath, chunker);
+}
+
+// -----------------------------------------------------------------------------
+// 22) Native DOCX / ODT text extraction. The document XML is located through
+//     the zip central directory, inflated in 64KB steps and run through a
+//     small SAX-style scanner that keeps only text nodes - constant memory,
+//     no subprocess.
+// -----------------------------------------------------------------------------
+
+// Which elements carry text and which ones map to whitespace
+struct XmlTextRules {
+    std::vector<std::string> textScopes;           // character data inside these is text
+    std::vector<std::string> lineEnds;             // closing tag emits '\n'
+    std::vector<std::pair<std::string, char>> marks; // opening tag emits a character
+};
+
+static const XmlTextRules DOCX_RULES = {
+    { "w:t" },
+    { "w:p" },
+    { { "w:tab", '\t' }, { "w:br", '\n' }, { "w:cr", '\n' } }
+};
+
+static const XmlTextRules ODT_RULES = {
+    { "text:p", "text:h" },
+    { "text:p", "text:h" },
+    { { "text:tab", '\t' }, { "text:line-break", '\n' }, { "text:s", ' ' } }
+};
+
+class XmlTextExtractor {
+public:
+    XmlTextExtractor(const XmlTextRules& rules, Chunker& chunker)
+    : rules_(rules), chunker_(chunker) {
+        out_.reserve(OUT_BLOCK);
+    }
+
+    void feed(const char* data, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            step(data[i]);
+        }
+        if (out_.size() >= OUT_BLOCK) {
+            flush();
+        }
+    }
+
+    void finish() { flush(); }
+
+private:
+    enum State { TEXT, TAG_OPEN, TAG_NAME, ATTRS, BANG, COMMENT, CDATA, SKIP_TAG, PI, ENTITY };
+
+    static const size_t OUT_BLOCK = 64 * 1024;
+    static const size_t MAX_TOKEN = 256; // tag names, attributes, entities
+
+    const XmlTextRules& rules_;
+    Chunker& chunker_;
+    std::string out_;
+    State state_ = TEXT;
+    std::string name_;
+    std::string attrs_;
+    std::string entity_;
+    bool endTag_    = false;
+    bool selfClose_ = false;
+    char quote_     = 0;
+    int scopeDepth_ = 0;
+    int run_        = 0; // trailing '-' / ']' / '?' seen while looking for a terminator
+
+    static bool contains(const std::vector<std::string>& names, const std::string& name) {
+        return std::find(names.begin(), names.end(), name) != names.end();
+    }
+
+    void flush() {
+        if (!out_.empty()) {
+            chunker_.pushData(out_.data(), out_.size());
+            out_.clear();
+        }
+    }
+
+    void emit(char c) {
+        if (scopeDepth_ > 0) {
+            out_ += c;
+        }
+    }
+
+    void step(char c) {
+        switch (state_) {
+            case TEXT:
+                if (c == '<') {
+                    state_ = TAG_OPEN;
+                    name_.clear();
+                    attrs_.clear();
+                    endTag_ = selfClose_ = false;
+                } else if (c == '&') {
+                    state_ = ENTITY;
+                    entity_.clear();
+                } else {
+                    emit(c);
+                }
+                break;
+            case TAG_OPEN:
+                if (c == '/') {
+                    endTag_ = true;
+                    state_ = TAG_NAME;
+                } else if (c == '!') {
+                    state_ = BANG;
+                    name_.clear();
+                } else if (c == '?') {
+                    state_ = PI;
+                    run_ = 0;
+                } else {
+                    state_ = TAG_NAME;
+                    name_ += c;
+                }
+                break;
+            case TAG_NAME:
+                if (c == '>') {
+                    tagDone();
+                } else if (c == '/') {
+                    selfClose_ = true;
+                    state_ = ATTRS;
+                } else if (std::isspace(static_cast<unsigned char>(c))) {
+                    state_ = ATTRS;
+                } else if (name_.size() < MAX_TOKEN) {
+                    name_ += c;
+                }
+                break;
+            case ATTRS:
+                if (quote_) {
+                    if (c == quote_) {
+                        quote_ = 0;
+                    }
+                } else if (c == '"' || c == '\'') {
+                    quote_ = c;
+                } else if (c == '>') {
+                    tagDone();
+                    break;
+                } else {
+                    selfClose_ = (c == '/');
+                }
+                if (attrs_.size() < MAX_TOKEN) {
+                    attrs_ += c;
+                }
+                break;
+            case BANG:
+                // "<!--" comment, "<![CDATA[" section, anything else (DOCTYPE) skipped
+                name_ += c;
+                if (name_ == "--") {
+                    state_ = COMMENT;
+                    run_ = 0;
+                } else if (name_ == "[CDATA[") {
+                    state_ = CDATA;
+                    run_ = 0;
+                } else if (c == '>') {
+                    state_ = TEXT;
+                } else if (std::string("[CDATA[").compare(0, name_.size(), name_) != 0 &&
+                           std::string("--").compare(0, name_.size(), name_) != 0) {
+                    state_ = SKIP_TAG;
+                }
+                break;
+            case COMMENT:
+                if (c == '>' && run_ >= 2) {
+                    state_ = TEXT;
+                }
+                run_ = (c == '-') ? run_ + 1 : 0;
+                break;
+            case CDATA:
+                if (c == ']') {
+                    run_++;
+                } else if (c == '>' && run_ >= 2) {
+                    for (int k = 2; k < run_; k++) {
+                        emit(']');
+                    }
+                    state_ = TEXT;
+                    run_ = 0;
+                } else {
+                    for (; run_ > 0; run_--) {
+                        emit(']');
+                    }
+                    emit(c);
+                }
+                break;
+            case SKIP_TAG:
+                if (c == '>') {
+                    state_ = TEXT;
+                }
+                break;
+            case PI:
+                if (c == '>' && run_) {
+                    state_ = TEXT;
+                }
+                run_ = (c == '?');
+                break;
+            case ENTITY:
+                if (c == ';') {
+                    decodeEntity();
+                    state_ = TEXT;
+                } else if (entity_.size() < 12 && c != '<' && c != '&' &&
+                           !std::isspace(static_cast<unsigned char>(c))) {
+                    entity_ += c;
+                } else {
+                    // not an entity after all: keep it literally
+                    emit('&');
+                    for (char e : entity_) {
+                        emit(e);
+                    }
+                    state_ = TEXT;
+                    step(c);
+                }
+                break;
+        }
+    }
+
+    void tagDone() {
+        state_ = TEXT;
+        quote_ = 0;
+        if (endTag_) {
+            if (contains(rules_.textScopes, name_) && scopeDepth_ > 0) {
+                scopeDepth_--;
+            }
+            if (contains(rules_.lineEnds, name_)) {
+                out_ += '\n';
+            }
+            return;
+        }
+        for (const auto& mark : rules_.marks) {
+            if (mark.first == name_) {
+                out_.append(repeatCount(), mark.second);
+            }
+        }
+        if (!selfClose_ && contains(rules_.textScopes, name_)) {
+            scopeDepth_++;
+        }
+        if (selfClose_ && contains(rules_.lineEnds, name_)) {
+            out_ += '\n'; // <w:p/> is an empty paragraph
+        }
+    }
+
+    // ODF <text:s text:c="N"/> stands for N spaces
+    size_t repeatCount() const {
+        size_t pos = attrs_.find("text:c=");
+        if (pos == std::string::npos || pos + 8 >= attrs_.size()) {
+            return 1;
+        }
+        size_t n = std::strtoul(attrs_.c_str() + pos + 8, nullptr, 10);
+        return std::min<size_t>(std::max<size_t>(n, 1), 1024);
+    }
+
+    void decodeEntity() {
+        uint32_t cp = 0;
+        if (entity_ == "amp") cp = '&';
+        else if (entity_ == "lt") cp = '<';
+        else if (entity_ == "gt") cp = '>';
+        else if (entity_ == "quot") cp = '"';
+        else if (entity_ == "apos") cp = '\'';
+        else if (entity_.size() > 1 && entity_[0] == '#') {
+            bool hex = entity_[1] == 'x' || entity_[1] == 'X';
+            cp = static_cast<uint32_t>(std::strtoul(entity_.c_str() + (hex ? 2 : 1), nullptr,
+                                                    hex ? 16 : 10));
+        }
+        if (cp == 0 || cp > 0x10FFFF) {
+            return;
+        }
+        if (cp < 0x80) {
+            emit(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            emit(static_cast<char>(0xC0 | (cp >> 6)));
+            emit(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            emit(static_cast<char>(0xE0 | (cp >> 12)));
+            emit(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            emit(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            emit(static_cast<char>(0xF0 | (cp >> 18)));
+            emit(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            emit(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            emit(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+};
+
+// little-endian field readers for zip structures
+static uint16_t le16(const unsigned char* p) { return static_cast<uint16_t>(p[0] | (p[1] << 8)); }
+static uint32_t le32(const unsigned char* p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+static uint64_t le64(const unsigned char* p) {
+    return static_cast<uint64_t>(le32(p)) | (static_cast<uint64_t>(le32(p + 4)) << 32);
+}
+
+struct ZipEntry {
+    uint16_t method   = 0;
+    uint64_t compSize = 0;
+    uint64_t localOffset = 0;
+};
+
+// find_zip_entry - look `name` up in the central directory (zip64 aware)
+static bool find_zip_entry(int fd, const std::string& name, ZipEntry& entry) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 22) {
+        return false;
+    }
+    uint64_t fileSize = static_cast<uint64_t>(st.st_size);
+
+    // end-of-central-directory record sits within the last 64KB + 22 bytes
+    size_t tailLen = static_cast<size_t>(std::min<uint64_t>(fileSize, 65535 + 22));
+    std::vector<unsigned char> tail(tailLen);
+    if (pread(fd, tail.data(), tailLen, static_cast<off_t>(fileSize - tailLen)) !=
+        static_cast<ssize_t>(tailLen)) {
+        return false;
+    }
+    size_t eocd = std::string::npos;
+    for (size_t i = tailLen - 22 + 1; i-- > 0;) {
+        if (le32(&tail[i]) == 0x06054b50) {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd == std::string::npos) {
+        return false;
+    }
+    uint64_t cdSize   = le32(&tail[eocd + 12]);
+    uint64_t cdOffset = le32(&tail[eocd + 16]);
+    if (cdOffset == 0xFFFFFFFF && eocd >= 20 && le32(&tail[eocd - 20]) == 0x07064b50) {
+        unsigned char rec[56];
+        uint64_t recOffset = le64(&tail[eocd - 20 + 8]);
+        if (pread(fd, rec, sizeof(rec), static_cast<off_t>(recOffset)) != sizeof(rec) ||
+            le32(rec) != 0x06064b50) {
+            return false;
+        }
+        cdSize   = le64(rec + 40);
+        cdOffset = le64(rec + 48);
+    }
+    if (cdOffset + cdSize > fileSize || cdSize > 256 * 1024 * 1024) {
+        return false;
+    }
+
+    std::vector<unsigned char> cd(static_cast<size_t>(cdSize));
+    if (pread(fd, cd.data(), cd.size(), static_cast<off_t>(cdOffset)) !=
+        static_cast<ssize_t>(cd.size())) {
+        return false;
+    }
+    for (size_t p = 0; p + 46 <= cd.size() && le32(&cd[p]) == 0x02014b50;) {
+        uint16_t nameLen    = le16(&cd[p + 28]);
+        uint16_t extraLen   = le16(&cd[p + 30]);
+        uint16_t commentLen = le16(&cd[p + 32]);
+        if (p + 46 + nameLen + extraLen > cd.size()) {
+            return false;
+        }
+        if (nameLen == name.size() && std::memcmp(&cd[p + 46], name.data(), nameLen) == 0) {
+            entry.method      = le16(&cd[p + 10]);
+            entry.compSize    = le32(&cd[p + 20]);
+            entry.localOffset = le32(&cd[p + 42]);
+            uint64_t uncompSize = le32(&cd[p + 24]);
+            // zip64 extra field: 8-byte values for every 32-bit field that overflowed
+            for (size_t x = p + 46 + nameLen; x + 4 <= p + 46 + nameLen + extraLen;) {
+                uint16_t id = le16(&cd[x]), len = le16(&cd[x + 2]);
+                if (id == 0x0001) {
+                    size_t v = x + 4;
+                    if (uncompSize == 0xFFFFFFFF && v + 8 <= x + 4 + len) { v += 8; }
+                    if (entry.compSize == 0xFFFFFFFF && v + 8 <= x + 4 + len) {
+                        entry.compSize = le64(&cd[v]);
+                        v += 8;
+                    }
+                    if (entry.localOffset == 0xFFFFFFFF && v + 8 <= x + 4 + len) {
+                        entry.localOffset = le64(&cd[v]);
+                    }
+                }
+                x += 4 + len;
+            }
+            return true;
+        }
+        p += 46 + nameLen + extraLen + commentLen;
+    }
+    return false;
+}
+
+// how stream_zip_xml went: Unreadable (not a zip we can read, or no such
+// member) is reported before any text reaches the chunker, so another reader
+// may still take the file; Failed means the member broke off part way
+enum class ZipRead { Done, Unreadable, Failed };
+
+// stream_zip_xml - inflate one zip member and feed it to the text extractor
+static ZipRead stream_zip_xml(const std::string& filePath, const std::string& member,
+                              const XmlTextRules& rules, Chunker& chunker) {
+    int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return ZipRead::Unreadable;
+    }
+    ZipEntry entry;
+    unsigned char local[30];
+    bool ok = find_zip_entry(fd, member, entry) &&
+              (entry.method == 0 || entry.method == 8) &&
+              pread(fd, local, sizeof(local), static_cast<off_t>(entry.localOffset)) ==
+                  sizeof(local) &&
+              le32(local) == 0x04034b50;
+    if (!ok) {
+        ::close(fd);
+        return ZipRead::Unreadable;
+    }
+    off_t pos = static_cast<off_t>(entry.localOffset + 30 + le16(local + 26) + le16(local + 28));
+    uint64_t remaining = entry.compSize;
+
+    XmlTextExtractor extractor(rules, chunker);
+    z_stream zs{};
+    if (entry.method == 8 && inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        ::close(fd);
+        return ZipRead::Unreadable;
+    }
+    const size_t BUFSZ = 64 * 1024;
+    std::vector<unsigned char> in(BUFSZ), out(BUFSZ);
+    int zrc = Z_OK;
+    while (ok && remaining > 0 && zrc != Z_STREAM_END) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(remaining, BUFSZ));
+        ssize_t got;
+        {
+            StageTimer timer(STAGE_READ);
+            got = pread(fd, in.data(), want, pos);
+        }
+        if (got <= 0) {
+            ok = false;
+            break;
+        }
+        pos += got;
+        remaining -= static_cast<uint64_t>(got);
+        if (entry.method == 0) {
+            extractor.feed(reinterpret_cast<const char*>(in.data()), static_cast<size_t>(got));
+            continue;
+        }
+        zs.next_in  = in.data();
+        zs.avail_in = static_cast<uInt>(got);
+        while (zs.avail_in > 0 && zrc != Z_STREAM_END) {
+            zs.next_out  = out.data();
+            zs.avail_out = static_cast<uInt>(out.size());
+            zrc = inflate(&zs, Z_NO_FLUSH);
+            if (zrc != Z_OK && zrc != Z_STREAM_END) {
+                ok = false;
+                break;
+            }
+            extractor.feed(reinterpret_cast<const char*>(out.data()), out.size() - zs.avail_out);
+        }
+    }
+    if (entry.method == 8) {
+        inflateEnd(&zs);
+    }
+    ::close(fd);
+    extractor.finish();
+    if (!ok) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: " << member << " in " << filePath << " is corrupt or truncated\n";
+        return ZipRead::Failed;
+    }
+    return ZipRead::Done;
+}
+
+// For DOCX: word/document.xml is read natively; legacy binary .doc (and any
+// docx that is not a readable zip) still goes through "doc2txt <file> -"
+bool stream_doc(const std::string &filePath, Chunker &chunker) {
+    if (file_extension(filePath) == "docx") {
+        ZipRead read = stream_zip_xml(filePath, "word/document.xml", DOCX_RULES, chunker);
+        if (read != ZipRead::Unreadable) {
+            return read == ZipRead::Done;
+        }
+    }
+    return stream_command_output(converter_command("doc", filePath), chunker);
+}
+
+// For ODT: content.xml is read natively, falling back to "odt2txt --stdout <file>"
+bool stream_odt(const std::string &filePath, Chunker &chunker) {
+    ZipRead read = stream_zip_xml(filePath, "content.xml", ODT_RULES, chunker);
+    if (read != ZipRead::Unreadable) {
+        return read == ZipRead::Done;
+    }
+    return stream_command_output(converter_command("odt", filePath), chunker);
+}
+
+// -----------------------------------------------------------------------------
+// 23) JSONL / NDJSON -> text. Each line is walked once, on demand: only the
+//     values of the --json-fields paths are unescaped, everything else is
+//     skipped with a vector scan for the next quote, backslash or bracket.
+//     Each extracted field is followed by '\n' and every record that had
+//     one by a blank line.
+// -----------------------------------------------------------------------------
+#if defined(__SSE2__)
+// find_any - first byte in [p, e) that is one of the bytes of `set`, or e
+template <size_t N>
+static const char* find_any(const char* p, const char* e, const char (&set)[N]) {
+    while (e - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(set[0]));
+        for (size_t k = 1; k < N - 1; k++) {
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(set[k])));
+        }
+        unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(m));
+        if (bits) {
+            return p + __builtin_ctz(bits);
+        }
+        p += 16;
+    }
+    for (; p < e; p++) {
+        if (std::memchr(set, *p, N - 1)) {
+            return p;
+        }
+    }
+    return e;
+}
+#elif defined(__ARM_NEON)
+template <size_t N>
+static const char* find_any(const char* p, const char* e, const char (&set)[N]) {
+    while (e - p >= 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+        uint8x16_t m = vceqq_u8(v, vdupq_n_u8(static_cast<uint8_t>(set[0])));
+        for (size_t k = 1; k < N - 1; k++) {
+            m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(static_cast<uint8_t>(set[k]))));
+        }
+        if (vmaxvq_u8(m) != 0) {
+            break; // the scalar loop finds it within these 16 bytes
+        }
+        p += 16;
+    }
+    for (; p < e; p++) {
+        if (std::memchr(set, *p, N - 1)) {
+            return p;
+        }
+    }
+    return e;
+}
+#else
+template <size_t N>
+static const char* find_any(const char* p, const char* e, const char (&set)[N]) {
+    for (; p < e; p++) {
+        if (std::memchr(set, *p, N - 1)) {
+            return p;
+        }
+    }
+    return e;
+}
+#endif
+
+static const size_t JSON_MAX_DEPTH = 256;
+
+class JsonlFilter : public InputFilter {
+public:
+    explicit JsonlFilter(const std::vector<std::string>& fields) : fields_(fields) {
+        for (const std::string& f : fields_) {
+            for (size_t dot = f.find('.'); dot != std::string::npos; dot = f.find('.', dot + 1)) {
+                prefixes_.push_back(f.substr(0, dot));
+            }
+        }
+    }
+
+    void filter(const char* data, size_t len, Chunker& out) override {
+        text_.clear();
+        {
+            StageTimer timer(STAGE_FORMAT);
+            const char* end = data + len;
+            while (data < end) {
+                const char* nl = static_cast<const char*>(std::memchr(data, '\n', end - data));
+                if (!nl) {
+                    carry_.append(data, end);
+                    break;
+                }
+                if (carry_.empty()) {
+                    record(data, nl, text_);
+                } else {
+                    carry_.append(data, nl);
+                    record(carry_.data(), carry_.data() + carry_.size(), text_);
+                    carry_.clear();
+                }
+                data = nl + 1;
+            }
+        }
+        out.pushText(text_.data(), text_.size());
+    }
+
+    void finish(Chunker& out) override {
+        if (!carry_.empty()) {
+            text_.clear();
+            record(carry_.data(), carry_.data() + carry_.size(), text_);
+            carry_.clear();
+            out.pushText(text_.data(), text_.size());
+        }
+        if (malformed_ > 0) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Warning: skipped " << malformed_ << " malformed JSONL line"
+            << (malformed_ == 1 ? "" : "s") << " (first at line " << firstMalformed_ << ")\n";
+        }
+    }
+
+private:
+    std::vector<std::string> fields_;   // dotted paths
+    std::vector<std::string> prefixes_; // objects on the way to a field
+    std::string carry_;                 // partial line
+    std::string text_;                  // extracted text of the current slice
+    std::string key_;                   // scratch for escaped keys
+    uint64_t line_           = 0;
+    uint64_t malformed_      = 0;
+    uint64_t firstMalformed_ = 0;
+
+    // record - extract the fields of one line; a malformed line adds nothing
+    void record(const char* p, const char* e, std::string& out) {
+        line_++;
+        p = skipSpace(p, e);
+        if (p == e) {
+            return; // blank line
+        }
+        size_t mark = out.size();
+        std::string path;
+        if (*p != '{' || !object(p, e, path, out, 0) || skipSpace(p, e) != e) {
+            out.resize(mark);
+            if (malformed_++ == 0) {
+                firstMalformed_ = line_;
+            }
+            return;
+        }
+        if (out.size() > mark) {
+            out += '\n';
+        }
+    }
+
+    static const char* skipSpace(const char* p, const char* e) {
+        while (p < e && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+            p++;
+        }
+        return p;
+    }
+
+    bool wanted(const std::string& path, const std::vector<std::string>& list) const {
+        return std::find(list.begin(), list.end(), path) != list.end();
+    }
+
+    // object - p is at '{'; walk the members, descending into objects that
+    // lead to a wanted field
+    bool object(const char*& p, const char* e, std::string& path, std::string& out, size_t depth) {
+        if (depth > JSON_MAX_DEPTH) {
+            return false;
+        }
+        p = skipSpace(p + 1, e);
+        if (p < e && *p == '}') {
+            p++;
+            return true;
+        }
+        for (;;) {
+            if (p == e || *p != '"') {
+                return false;
+            }
+            const char* keyStart = p + 1;
+            const char* keyEnd = skipString(p, e);
+            if (!keyEnd) {
+                return false;
+            }
+            size_t base = path.size();
+            if (base > 0) {
+                path += '.';
+            }
+            if (std::memchr(keyStart, '\\', keyEnd - keyStart)) {
+                key_.clear();
+                const char* k = keyStart - 1;
+                if (!unescape(k, e, key_)) {
+                    return false;
+                }
+                path += key_;
+            } else {
+                path.append(keyStart, keyEnd);
+            }
+            p = skipSpace(keyEnd + 1, e);
+            if (p == e || *p != ':') {
+                return false;
+            }
+            p = skipSpace(p + 1, e);
+            if (p == e) {
+                return false;
+            }
+            bool ok;
+            if (*p == '"' && wanted(path, fields_)) {
+                size_t before = out.size();
+                ok = unescape(p, e, out);
+                if (ok && out.size() > before) {
+                    out += '\n';
+                }
+            } else if (*p == '{' && wanted(path, prefixes_)) {
+                ok = object(p, e, path, out, depth + 1);
+            } else {
+                ok = skipValue(p, e);
+            }
+            path.resize(base);
+            if (!ok) {
+                return false;
+            }
+            p = skipSpace(p, e);
+            if (p < e && *p == ',') {
+                p = skipSpace(p + 1, e);
+                continue;
+            }
+            if (p < e && *p == '}') {
+                p++;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    // skipString - p is at the opening quote; the closing quote, or nullptr
+    static const char* skipString(const char* p, const char* e) {
+        static const char stops[] = "\"\\";
+        for (p++;;) {
+            p = find_any(p, e, stops);
+            if (p == e) {
+                return nullptr;
+            }
+            if (*p == '"') {
+                return p;
+            }
+            p += 2; // escaped character
+            if (p > e) {
+                return nullptr;
+            }
+        }
+    }
+
+    // skipValue - step over any value; containers are matched by bracket
+    // depth, looking only at quotes and brackets
+    static bool skipValue(const char*& p, const char* e) {
+        if (*p == '"') {
+            const char* q = skipString(p, e);
+            p = q ? q + 1 : e;
+            return q != nullptr;
+        }
+        if (*p == '{' || *p == '[') {
+            static const char structural[] = "\"{}[]";
+            size_t depth = 0;
+            while (p < e) {
+                p = find_any(p, e, structural);
+                if (p == e) {
+                    return false;
+                }
+                if (*p == '"') {
+                    const char* q = skipString(p, e);
+                    if (!q) {
+                        return false;
+                    }
+                    p = q + 1;
+                    continue;
+                }
+                if (*p == '{' || *p == '[') {
+                    depth++;
+                } else if (--depth == 0) {
+                    p++;
+                    return true;
+                }
+                p++;
+            }
+            return false;
+        }
+        // number, true, false, null
+        const char* start = p;
+        while (p < e && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' &&
+               *p != '\r' && *p != '\n') {
+            p++;
+        }
+        return p > start;
+    }
+
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static bool hex4(const char* p, const char* e, unsigned& out) {
+        if (e - p < 4) {
+            return false;
+        }
+        out = 0;
+        for (int i = 0; i < 4; i++) {
+            int v = hexValue(p[i]);
+            if (v < 0) {
+                return false;
+            }
+            out = (out << 4) | static_cast<unsigned>(v);
+        }
+        return true;
+    }
+
+    static void appendUtf8(unsigned cp, std::string& out) {
+        if (cp < 0x80) {
+            out += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            out += static_cast<char>(0xC0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += static_cast<char>(0xE0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+
+    // unescape - p is at the opening quote; append the string's content to
+    // `out` and leave p after the closing quote. Runs without escapes are
+    // copied whole.
+    static bool unescape(const char*& p, const char* e, std::string& out) {
+        static const char stops[] = "\"\\";
+        for (p++;;) {
+            const char* q = find_any(p, e, stops);
+            out.append(p, q);
+            if (q == e) {
+                return false;
+            }
+            if (*q == '"') {
+                p = q + 1;
+                return true;
+            }
+            if (e - q < 2) {
+                return false;
+            }
+            p = q + 2;
+            switch (q[1]) {
+                case '"':  out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/':  out += '/'; break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u': {
+                    unsigned cp;
+                    if (!hex4(p, e, cp)) {
+                        return false;
+                    }
+                    p += 4;
+                    unsigned low;
+                    if (cp >= 0xD800 && cp < 0xDC00 && e - p >= 6 && p[0] == '\\' &&
+                        p[1] == 'u' && hex4(p + 2, e, low) && low >= 0xDC00 && low < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    } else if (cp >= 0xD800 && cp < 0xE000) {
+                        cp = 0xFFFD; // lone surrogate
+                    }
+                    appendUtf8(cp, out);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 24) CSV records. Fields are split with RFC 4180 quoting, projected to
+//     --columns and written as "a | b | c" lines like Parquet rows. The header
+//     row starts every chunk and chunks end between records. With
+//     --csv-threads a mapped file is cut into ranges that are realigned to
+//     record starts and parsed in parallel.
+// -----------------------------------------------------------------------------
+
+// csv_record_end - the first '\n' in [p, e) outside quotes, or e; `quoted`
+// carries the quote state across calls. Every quote toggles it (an escaped
+// "" twice), so the state at any byte follows from the quotes before it.
+static const char* csv_record_end(const char* p, const char* e, bool& quoted) {
+    static const char stops[] = "\"\n";
+    for (;;) {
+        p = find_any(p, e, stops);
+        if (p == e || (*p == '\n' && !quoted)) {
+            return p;
+        }
+        if (*p == '"') {
+            quoted = !quoted;
+        }
+        p++;
+    }
+}
+
+#if defined(__SSE2__)
+static size_t count_quotes(const char* p, const char* e) {
+    const __m128i quote = _mm_set1_epi8('"');
+    size_t n = 0;
+    for (; e - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        n += static_cast<size_t>(
+            __builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)))));
+    }
+    return n + static_cast<size_t>(std::count(p, e, '"'));
+}
+#else
+static size_t count_quotes(const char* p, const char* e) {
+    return static_cast<size_t>(std::count(p, e, '"'));
+}
+#endif
+
+// CsvRows - formatted rows, each ending where `ends` says
+struct CsvRows {
+    std::string text;
+    std::vector<size_t> ends;
+    uint64_t ragged = 0; // rows whose field count differs from the header's
+};
+
+// push_rows - hand the rows to the chunker one record at a time
+static void push_rows(const CsvRows& rows, Chunker& chunker) {
+    size_t begin = 0;
+    for (size_t end : rows.ends) {
+        chunker.pushRecord(rows.text.data() + begin, end - begin);
+        begin = end;
+    }
+}
+
+static void warn_ragged(const std::string& source, uint64_t ragged) {
+    if (ragged > 0) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Warning: " << ragged << " CSV row" << (ragged == 1 ? "" : "s")
+        << " of " << source << " differ from the header in their number of fields\n";
+    }
+}
+
+// CsvFormat - the column projection of one file, taken from its header row;
+// each parsing thread works on its own copy
+class CsvFormat {
+public:
+    explicit CsvFormat(char delimiter) : delimiter_(delimiter) {}
+
+    // setHeader - resolve `columns` (every column when empty) against the
+    // header record [p, e); unknown names are reported and skipped, false
+    // when none is left
+    bool setHeader(const char* p, const char* e, const std::vector<std::string>& columns,
+                   const std::string& source) {
+        fields_ = split(p, e, true);
+        std::vector<std::string> names(cells_.begin(), cells_.begin() + fields_);
+        slots_.assign(fields_, -1);
+        header_.clear();
+        int slots = 0;
+        auto select = [&](size_t col) {
+            if (slots_[col] < 0) {
+                header_ += slots > 0 ? " | " : "";
+                header_ += names[col];
+                slots_[col] = slots++;
+            }
+        };
+        if (columns.empty()) {
+            for (size_t col = 0; col < fields_; col++) {
+                select(col);
+            }
+        }
+        for (const std::string& name : columns) {
+            auto it = std::find(names.begin(), names.end(), name);
+            if (it == names.end()) {
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cerr << "Warning: CSV file " << source
+                << " has no column named " << name << "\n";
+                continue;
+            }
+            select(static_cast<size_t>(it - names.begin()));
+        }
+        header_ += '\n';
+        cells_.assign(static_cast<size_t>(slots), std::string());
+        return slots > 0;
+    }
+
+    const std::string& header() const { return header_; }
+
+    // appendRow - format record [p, e) into `rows`; blank lines are skipped
+    void appendRow(const char* p, const char* e, CsvRows& rows) {
+        if (p == e || (e - p == 1 && *p == '\r')) {
+            return;
+        }
+        if (split(p, e, false) != fields_) {
+            rows.ragged++;
+        }
+        for (size_t slot = 0; slot < cells_.size(); slot++) {
+            if (slot > 0) {
+                rows.text.append(" | ", 3);
+            }
+            rows.text += cells_[slot];
+        }
+        rows.text += '\n';
+        rows.ends.push_back(rows.text.size());
+    }
+
+private:
+    char delimiter_;
+    size_t fields_ = 0;               // fields in the header
+    std::vector<int> slots_;          // field -> output position, -1 when dropped
+    std::vector<std::string> cells_;  // field text of the current record
+    std::string header_;
+
+    std::string* cell(size_t field, bool all) {
+        if (all) {
+            if (cells_.size() <= field) {
+                cells_.resize(field + 1);
+            }
+            return &cells_[field];
+        }
+        return field < slots_.size() && slots_[field] >= 0 ? &cells_[slots_[field]] : nullptr;
+    }
+
+    // split - the fields of record [p, e) into cells_, every one when `all`
+    // (the header), else only those with a slot; the number of fields.
+    // Unquoted runs are found with find_any and copied whole.
+    size_t split(const char* p, const char* e, bool all) {
+        if (e > p && e[-1] == '\r') {
+            e--;
+        }
+        if (all) {
+            cells_.clear();
+        }
+        for (std::string& c : cells_) {
+            c.clear();
+        }
+        const char stops[] = { delimiter_, '"', '\0' };
+        size_t field = 0;
+        bool quoted = false;
+        std::string* out = cell(field, all);
+        for (;;) {
+            const char* q = quoted ? static_cast<const char*>(std::memchr(p, '"', e - p))
+                                   : find_any(p, e, stops);
+            if (!q) {
+                q = e; // unterminated quote: the rest is the field
+            }
+            if (out) {
+                out->append(p, q);
+            }
+            if (q == e) {
+                return field + 1;
+            }
+            p = q + 1;
+            if (*q == '"') {
+                if (quoted && p < e && *p == '"') {
+                    if (out) {
+                        *out += '"';
+                    }
+                    p++;
+                } else {
+                    quoted = !quoted;
+                }
+                continue;
+            }
+            out = cell(++field, all);
+        }
+    }
+};
+
+// CsvFilter - records mode for streamed input (compressed files, or
+// --csv-threads 1); the first non-blank record is the header
+class CsvFilter : public InputFilter {
+public:
+    CsvFilter(const std::string& source, char delimiter) : source_(source), format_(delimiter) {}
+
+    bool ok() const { return state_ != State::NoColumns; }
+
+    void filter(const char* data, size_t len, Chunker& out) override {
+        rows_.text.clear();
+        rows_.ends.clear();
+        {
+            StageTimer timer(STAGE_FORMAT);
+            const char* end = data + len;
+            while (data < end) {
+                const char* nl = csv_record_end(data, end, quoted_);
+                if (nl == end) {
+                    carry_.append(data, end);
+                    break;
+                }
+                if (carry_.empty()) {
+                    record(data, nl);
+                } else {
+                    carry_.append(data, nl);
+                    record(carry_.data(), carry_.data() + carry_.size());
+                    carry_.clear();
+                }
+                data = nl + 1;
+            }
+        }
+        push(out);
+    }
+
+    void finish(Chunker& out) override {
+        rows_.text.clear();
+        rows_.ends.clear();
+        if (!carry_.empty()) {
+            record(carry_.data(), carry_.data() + carry_.size());
+            carry_.clear();
+        }
+        push(out);
+        warn_ragged(source_, rows_.ragged);
+    }
+
+private:
+    enum class State { Header, NewHeader, Rows, NoColumns };
+    std::string source_;
+    CsvFormat format_;
+    CsvRows rows_;          // rows of the current slice; ragged counts for the file
+    std::string carry_;     // partial record
+    bool quoted_  = false;  // quote state at the end of carry_
+    State state_  = State::Header;
+
+    void record(const char* p, const char* e) {
+        switch (state_) {
+            case State::Header:
+                if (p == e || (e - p == 1 && *p == '\r')) {
+                    return;
+                }
+                state_ = format_.setHeader(p, e, g_csvColumns, source_) ? State::NewHeader
+                                                                            : State::NoColumns;
+                return;
+            case State::NewHeader:
+            case State::Rows:
+                format_.appendRow(p, e, rows_);
+                return;
+            case State::NoColumns:
+                return;
+        }
+    }
+
+    void push(Chunker& out) {
+        if (state_ == State::NewHeader) {
+            out.setRecordHeader(format_.header());
+            state_ = State::Rows;
+        }
+        push_rows(rows_, out);
+    }
+};
+
+// stream_csv_parallel - --csv-threads for a mapped, uncompressed file. A first
+// pass counts the quotes of every range, which gives the quote state at each
+// range start; a range's records then run from its first newline outside
+// quotes to the same point of the next range.
+static bool stream_csv_parallel(const std::string& filePath, const MappedFile& file,
+                                char delimiter, Chunker& chunker) {
+    if (g_timeStages) {
+        g_stageStats.count(COUNTER_BYTES_IN, file.size);
+    }
+    const char* end = file.data + file.size;
+    const char* p = file.data;
+    const char* headerEnd;
+    for (;;) {
+        bool quoted = false;
+        headerEnd = csv_record_end(p, end, quoted);
+        if (headerEnd > p && !(headerEnd - p == 1 && *p == '\r')) {
+            break;
+        }
+        if (headerEnd == end) {
+            return true; // nothing but blank lines
+        }
+        p = headerEnd + 1;
+    }
+    CsvFormat format(delimiter);
+    if (!format.setHeader(p, headerEnd, g_csvColumns, filePath)) {
+        return false;
+    }
+    chunker.setRecordHeader(format.header());
+    const char* body = headerEnd == end ? end : headerEnd + 1;
+
+    size_t ranges = (static_cast<size_t>(end - body) + CSV_RANGE_BYTES - 1) / CSV_RANGE_BYTES;
+    size_t threads = std::min(g_csvThreads, std::max<size_t>(ranges, 1));
+    auto rangeBegin = [&](size_t i) {
+        return body + std::min(i * CSV_RANGE_BYTES, static_cast<size_t>(end - body));
+    };
+
+    // quote state at each range start
+    std::vector<char> quotedAt(ranges + 1, 0);
+    size_t counted = 0;
+    run_ordered<size_t>(
+        ranges, threads,
+        [&](size_t i, size_t& quotes) {
+            StageTimer timer(STAGE_FORMAT);
+            quotes = count_quotes(rangeBegin(i), rangeBegin(i + 1));
+            return true;
+        },
+        [&](size_t& quotes) {
+            quotedAt[counted + 1] = static_cast<char>(quotedAt[counted] ^ (quotes & 1));
+            counted++;
+        });
+
+    auto recordStart = [&](size_t i) {
+        if (i == 0) {
+            return body;
+        }
+        bool quoted = quotedAt[i] != 0;
+        const char* nl = csv_record_end(rangeBegin(i), end, quoted);
+        return nl == end ? end : nl + 1;
+    };
+    uint64_t ragged = 0;
+    run_ordered<CsvRows>(
+        ranges, threads,
+        [&](size_t i, CsvRows& rows) {
+            StageTimer timer(STAGE_FORMAT);
+            CsvFormat local = format;
+            const char* from = recordStart(i);
+            const char* to = std::max(from, recordStart(i + 1));
+            while (from < to) {
+                bool quoted = false;
+                const char* nl = csv_record_end(from, to, quoted);
+                local.appendRow(from, nl, rows);
+                from = nl == to ? to : nl + 1;
+            }
+            return true;
+        },
+        [&](CsvRows& rows) {
+            push_rows(rows, chunker);
+            ragged += rows.ragged;
+        });
+    warn_ragged(filePath, ragged);
+    return true;
+}
+
+// stream_csv - CSV in records mode: large uncompressed files take the
+// parallel path with --csv-threads, everything else is streamed through a
+// CsvFilter
+bool stream_csv(const std::string& filePath, char delimiter, Chunker& chunker) {
+    if (g_csvThreads > 1) {
+        int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+        std::shared_ptr<MappedFile> mapped = fd < 0 ? nullptr : map_input(fd);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (mapped && mapped->size >= 2 * CSV_RANGE_BYTES &&
+            sniff_compression(reinterpret_cast<const unsigned char*>(mapped->data),
+                              mapped->size) == Compression::None) {
+            return stream_csv_parallel(filePath, *mapped, delimiter, chunker);
+        }
+    }
+    auto filter = std::make_unique<CsvFilter>(filePath, delimiter);
+    const CsvFilter* csv = filter.get();
+    chunker.setFilter(std::move(filter));
+    return stream_file(filePath, chunker) && csv->ok();
+}
+
+// -----------------------------------------------------------------------------
+// 25) Parquet -> text. Each column of a record batch gets a formatter picked
+//    once from its Arrow type; cells are then written straight from the typed
+//    buffers (offsets, values, validity bitmap) into the chunker.
+// -----------------------------------------------------------------------------
+class ColumnFormatter {
+public:
+    explicit ColumnFormatter(const arrow::Array& arr)
+    : validity_(arr.null_count() > 0 ? arr.null_bitmap_data() : nullptr),
+      offset_(arr.offset()) {}
+    virtual ~ColumnFormatter() = default;
+
+    void write(int64_t row, Chunker& out) {
+        if (validity_) {
+            int64_t bit = offset_ + row;
+            if (((validity_[bit >> 3] >> (bit & 7)) & 1) == 0) {
+                out.pushData("NULL", 4);
+                return;
+            }
+        }
+        writeValue(row, out);
+    }
+
+protected:
+    virtual void writeValue(int64_t row, Chunker& out) = 0;
+
+private:
+    const uint8_t* validity_;
+    int64_t offset_;
+};
+
+// STRING / BINARY (int32 offsets) and their LARGE_ variants (int64 offsets)
+template <typename ArrayT, typename OffsetT>
+class StringFormatter : public ColumnFormatter {
+public:
+    explicit StringFormatter(const arrow::Array& arr)
+    : ColumnFormatter(arr),
+      offsets_(static_cast<const ArrayT&>(arr).raw_value_offsets()),
+      data_(reinterpret_cast<const char*>(static_cast<const ArrayT&>(arr).raw_data())) {}
+
+protected:
+    void writeValue(int64_t row, Chunker& out) override {
+        OffsetT begin = offsets_[row];
+        out.pushData(data_ + begin, static_cast<size_t>(offsets_[row + 1] - begin));
+    }
+
+private:
+    const OffsetT* offsets_;
+    const char* data_;
+};
+
+// integers and floating point, formatted with std::to_chars (no locale, no heap)
+template <typename ArrayT>
+class NumberFormatter : public ColumnFormatter {
+public:
+    explicit NumberFormatter(const arrow::Array& arr)
+    : ColumnFormatter(arr), values_(static_cast<const ArrayT&>(arr).raw_values()) {}
+
+protected:
+    void writeValue(int64_t row, Chunker& out) override {
+        char text[64];
+        auto res = std::to_chars(text, text + sizeof(text), values_[row]);
+        out.pushData(text, static_cast<size_t>(res.ptr - text));
+    }
+
+private:
+    const typename ArrayT::value_type* values_;
+};
+
+class BooleanFormatter : public ColumnFormatter {
+public:
+    explicit BooleanFormatter(const arrow::Array& arr)
+    : ColumnFormatter(arr), arr_(static_cast<const arrow::BooleanArray&>(arr)) {}
+
+protected:
+    void writeValue(int64_t row, Chunker& out) override {
+        if (arr_.Value(row)) {
+            out.pushData("true", 4);
+        } else {
+            out.pushData("false", 5);
+        }
+    }
+
+private:
+    const arrow::BooleanArray& arr_;
+};
+
+// anything else (timestamps, decimals, nested types, ...) goes through Scalar
+class ScalarFormatter : public ColumnFormatter {
+public:
+    explicit ScalarFormatter(const arrow::Array& arr) : ColumnFormatter(arr), arr_(arr) {}
+
+protected:
+    void writeValue(int64_t row, Chunker& out) override {
+        auto scalar_result = arr_.GetScalar(row);
+        std::string text;
+        if (!scalar_result.ok()) {
+            // Can't retrieve the scalar for some reason
+            text = "[ERROR: " + scalar_result.status().ToString() + "]";
+        } else if (!(*scalar_result)->is_valid) {
+            text = "NULL";
+        } else {
+            text = (*scalar_result)->ToString();
+        }
+        out.pushData(text.data(), text.size());
+    }
+
+private:
+    const arrow::Array& arr_;
+};
+
+std::unique_ptr<ColumnFormatter> make_column_formatter(const arrow::Array& arr) {
+    switch (arr.type_id()) {
+        case arrow::Type::STRING:
+            return std::make_unique<StringFormatter<arrow::StringArray, int32_t>>(arr);
+        case arrow::Type::BINARY:
+            return std::make_unique<StringFormatter<arrow::BinaryArray, int32_t>>(arr);
+        case arrow::Type::LARGE_STRING:
+            return std::make_unique<StringFormatter<arrow::LargeStringArray, int64_t>>(arr);
+        case arrow::Type::LARGE_BINARY:
+            return std::make_unique<StringFormatter<arrow::LargeBinaryArray, int64_t>>(arr);
+        case arrow::Type::INT8:   return std::make_unique<NumberFormatter<arrow::Int8Array>>(arr);
+        case arrow::Type::INT16:  return std::make_unique<NumberFormatter<arrow::Int16Array>>(arr);
+        case arrow::Type::INT32:  return std::make_unique<NumberFormatter<arrow::Int32Array>>(arr);
+        case arrow::Type::INT64:  return std::make_unique<NumberFormatter<arrow::Int64Array>>(arr);
+        case arrow::Type::UINT8:  return std::make_unique<NumberFormatter<arrow::UInt8Array>>(arr);
+        case arrow::Type::UINT16: return std::make_unique<NumberFormatter<arrow::UInt16Array>>(arr);
+        case arrow::Type::UINT32: return std::make_unique<NumberFormatter<arrow::UInt32Array>>(arr);
+        case arrow::Type::UINT64: return std::make_unique<NumberFormatter<arrow::UInt64Array>>(arr);
+        case arrow::Type::FLOAT:  return std::make_unique<NumberFormatter<arrow::FloatArray>>(arr);
+        case arrow::Type::DOUBLE: return std::make_unique<NumberFormatter<arrow::DoubleArray>>(arr);
+        case arrow::Type::BOOL:   return std::make_unique<BooleanFormatter>(arr);
+        default:
+            return std::make_unique<ScalarFormatter>(arr);
+    }
+}
+
+// format_record_batch - one "a | b | c" line per row
+void format_record_batch(const arrow::RecordBatch& batch, Chunker& chunker) {
+    StageTimer timer(STAGE_FORMAT);
+    int num_columns = batch.num_columns();
+    std::vector<std::unique_ptr<ColumnFormatter>> formatters;
+    formatters.reserve(num_columns);
+    for (int col_idx = 0; col_idx < num_columns; col_idx++) {
+        formatters.push_back(make_column_formatter(*batch.column(col_idx)));
+    }
+
+    int64_t num_rows = batch.num_rows();
+    for (int64_t row_idx = 0; row_idx < num_rows; row_idx++) {
+        for (int col_idx = 0; col_idx < num_columns; col_idx++) {
+            if (col_idx > 0) {
+                chunker.pushData(" | ", 3);
+            }
+            formatters[col_idx]->write(row_idx, chunker);
+        }
+        chunker.pushData("\n", 1);
+    }
+}
+
+bool stream_parquet(const std::string &filePath, Chunker &chunker) {
+    // 1. Open file as Arrow input
+    auto infileResult = arrow::io::ReadableFile::Open(filePath);
+    if (!infileResult.ok()) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: Could not open Parquet file: " << filePath
+        << "\n" << infileResult.status().ToString() << "\n";
+        return false;
+    }
+    auto infile = *infileResult;
+
+    // 2. Create a Parquet->Arrow reader that decodes g_parquetBatchRows rows at
+    //    a time; buffered column streams keep reads bounded for wide files
+    parquet::ReaderProperties readerProps = parquet::default_reader_properties();
+    readerProps.enable_buffered_stream();
+    parquet::ArrowReaderProperties arrowProps = parquet::default_arrow_reader_properties();
+    arrowProps.set_batch_size(g_parquetBatchRows);
+    if (g_parquetReadahead > 0) {
+        // coalesced column-chunk reads are issued ahead on Arrow's I/O pool
+        arrowProps.set_pre_buffer(true);
+    }
+
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    parquet::arrow::FileReaderBuilder builder;
+    auto st_reader = builder.Open(infile, readerProps);
+    if (st_reader.ok()) {
+        st_reader = builder.memory_pool(arrow::default_memory_pool())
+                           ->properties(arrowProps)
+                           ->Build(&reader);
+    }
+    if (!st_reader.ok()) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: parquet::arrow::OpenFile failed: "
+        << st_reader.ToString() << "\n";
+        return false;
+    }
+
+    // 3. Resolve --columns to leaf column indices (dotted paths for nested
+    //    fields); unknown names are reported and skipped
+    auto metadata = reader->parquet_reader()->metadata();
+    std::vector<int> columnIndices;
+    if (g_parquetColumns.empty()) {
+        for (int c = 0; c < metadata->num_columns(); c++) {
+            columnIndices.push_back(c);
+        }
+    } else {
+        for (const std::string& name : g_parquetColumns) {
+            int idx = metadata->schema()->ColumnIndex(name);
+            if (idx < 0) {
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cerr << "Warning: Parquet file " << filePath
+                << " has no column named " << name << "\n";
+                continue;
+            }
+            columnIndices.push_back(idx);
+        }
+        if (columnIndices.empty()) {
+            return false;
+        }
+    }
+
+    std::vector<int> rowGroups;
+    for (int rg = 0; rg < reader->num_row_groups(); rg++) {
+        rowGroups.push_back(rg);
+    }
+    if (rowGroups.empty()) {
+        return true;
+    }
+
+    // 4a. Default: stream record batches one at a time
+    if (g_parquetReadahead == 0) {
+        std::unique_ptr<arrow::RecordBatchReader> batchReader;
+        auto st_batches = reader->GetRecordBatchReader(rowGroups, columnIndices, &batchReader);
+        if (!st_batches.ok()) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: Could not read record batches from file "
+            << filePath << ": " << st_batches.ToString() << "\n";
+            return false;
+        }
+        std::shared_ptr<arrow::RecordBatch> batch;
+        for (;;) {
+            arrow::Status st_batch;
+            {
+                StageTimer timer(STAGE_READ);
+                st_batch = batchReader->ReadNext(&batch);
+            }
+            if (!st_batch.ok()) {
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cerr << "Warning: Stopped reading " << filePath
+                << ": " << st_batch.ToString() << "\n";
+                break;
+            }
+            if (!batch) {
+                break;
+            }
+            format_record_batch(*batch, chunker);
+        }
+        return true;
+    }
+
+    // 4b. --parquet-readahead N: up to N row groups are decoded concurrently
+    //     on Arrow's CPU pool while earlier batches are being formatted
+    int64_t rowsPerGroup = metadata->num_rows() / metadata->num_row_groups();
+    int64_t readaheadRows = std::max<int64_t>(1, rowsPerGroup) * g_parquetReadahead;
+    std::shared_ptr<parquet::arrow::FileReader> sharedReader(std::move(reader));
+    auto genResult = sharedReader->GetRecordBatchGenerator(
+        sharedReader, rowGroups, columnIndices,
+        arrow::internal::GetCpuThreadPool(), readaheadRows);
+    if (!genResult.ok()) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: Could not read record batches from file "
+        << filePath << ": " << genResult.status().ToString() << "\n";
+        return false;
+    }
+    auto nextBatch = *genResult;
+    for (;;) {
+        auto batchFuture = nextBatch();
+        {
+            StageTimer timer(STAGE_READ);
+            batchFuture.Wait();
+        }
+        const auto& batchResult = batchFuture.result();
+        if (!batchResult.ok()) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Warning: Stopped reading " << filePath
+            << ": " << batchResult.status().ToString() << "\n";
+            break;
+        }
+        std::shared_ptr<arrow::RecordBatch> batch = *batchResult;
+        if (!batch) {
+            break; // end of stream
+        }
+        format_record_batch(*batch, chunker);
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// 26) Per-file dispatch: pick a reader by extension and stream into a fresh Chunker
+// -----------------------------------------------------------------------------
+void process_file(const std::string& filePath, BufferPool& pool, FlushStage& flush) {
+    {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cout << "\nProcessing file: " << filePath << "\n";
+    }
+
+    std::string extension = file_extension(filePath);
+    // "name.jsonl.gz" is decompressed and read as JSONL
+    std::string inner = extension;
+    if (is_compressed_extension(extension)) {
+        inner = file_extension(filePath.substr(0, filePath.size() - extension.size() - 1));
+    }
+
+    bool success = false;
+    bool partial = false;
+    try {
+        // Acquire a chunker for this file
+        Chunker chunker(pool, flush, filePath, filePath == "-" ? "stdin" : extension);
+
+        if (filePath == "-") {
+            success = stream_input(STDIN_FILENO, chunker);
+        } else if (extension == "pdf") {
+            success = stream_pdf(filePath, chunker);
+        } else if (extension == "doc" || extension == "docx") {
+            success = stream_doc(filePath, chunker);
         } else if (extension == "odt") {
             success = stream_odt(filePath, chunker);
         } else if (extension == "rtf") {
             success = stream_rtf(filePath, chunker);
-        } else if (extension == "csv" || extension == "txt") {
+        } else if (inner == "jsonl" || inner == "ndjson") {
+            chunker.setFilter(std::make_unique<JsonlFilter>(g_jsonFields));
+            success = stream_file(filePath, chunker);
+        } else if ((inner == "csv" || inner == "tsv") && g_csvMode == CsvMode::Records) {
+            char delimiter = g_csvDelimiter ? g_csvDelimiter : inner == "tsv" ? '\t' : ',';
+            success = stream_csv(filePath, delimiter, chunker);
+        } else if (extension == "csv" || extension == "txt" ||
+                   is_compressed_extension(extension)) {
             success = stream_file(filePath, chunker);
         } else if (extension == "parquet") {
             success = stream_parquet(filePath, chunker);
         } else {
-            std::cout << "Unknown extension: " << extension
-            << " -> attempting plain text read...\n";
-            success = stream_file(filePath, chunker);
+            {
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cout << "Unknown extension: " << extension
+                << " -> attempting plain text read...\n";
+            }
+            success = stream_file(filePath, chunker);
+        }
+        partial = !success && chunker.chunkedAny();
+    } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error processing " << filePath << ": " << e.what() << "\n";
+    }
+
+    if (!success) {
+        flush.sourceFailed(filePath);
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << (partial ? "Warning: File not fully processed: "
+                              : "Warning: No content processed from file: ") << filePath << "\n";
+    } else {
+        flush.sourceDone(filePath);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// 27) WorkStealingPool - one deque per worker; a worker pops its own tasks from
+//     the back and, when it runs dry, steals from the front of the others
+// -----------------------------------------------------------------------------
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(size_t numThreads) {
+        numThreads = std::max<size_t>(1, numThreads);
+        for (size_t i = 0; i < numThreads; i++) {
+            queues_.emplace_back(std::make_unique<WorkQueue>());
+        }
+        for (size_t i = 0; i < numThreads; i++) {
+            threads_.emplace_back(&WorkStealingPool::workerLoop, this, i);
+        }
+    }
+
+    ~WorkStealingPool() {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        workAvailable_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    // tasks are dealt round-robin; idle workers rebalance by stealing
+    void submit(Task task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        WorkQueue& q = *queues_[nextQueue_++ % queues_.size()];
+        {
+            std::lock_guard<std::mutex> qlock(q.mutex);
+            q.tasks.push_back(std::move(task));
+        }
+        queued_++;
+        pending_++;
+        workAvailable_.notify_one();
+    }
+
+    // block until every submitted task has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        allDone_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable workAvailable_;
+    std::condition_variable allDone_;
+    size_t nextQueue_ = 0;
+    size_t queued_    = 0; // tasks sitting in some deque
+    size_t pending_   = 0; // tasks submitted but not yet finished
+    bool stop_        = false;
+
+    bool popLocal(size_t self, Task& out) {
+        WorkQueue& q = *queues_[self];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) {
+            return false;
+        }
+        out = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t self, Task& out) {
+        for (size_t k = 1; k < queues_.size(); k++) {
+            WorkQueue& q = *queues_[(self + k) % queues_.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                out = std::move(q.tasks.front());
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t self) {
+        for (;;) {
+            Task task;
+            if (popLocal(self, task) || steal(self, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    queued_--;
+                }
+                task();
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (--pending_ == 0) {
+                    allDone_.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            workAvailable_.wait(lock, [this] { return stop_ || queued_ > 0; });
+            if (stop_ && queued_ == 0) {
+                return;
+            }
+        }
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 28) ConverterScheduler - keeps up to N converter processes running at once
+//     (--converters N). Their stdout pipes are non-blocking and multiplexed
+//     with epoll on one thread; each stream feeds its own Chunker. The thread
+//     can only wait on the pool for one job at a time, so a job whose pipe
+//     ran dry returns its spare buffers, and N is capped at half the pool.
+// -----------------------------------------------------------------------------
+class ConverterScheduler {
+public:
+    ConverterScheduler(BufferPool& pool, FlushStage& flush, size_t maxRunning)
+    : pool_(pool), flush_(flush), maxRunning_(std::max<size_t>(1, maxRunning))
+    {
+        size_t limit = std::max<size_t>(1, pool.capacity() / 2);
+        if (maxRunning_ > limit) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Warning: --converters " << maxRunning_ << " lowered to " << limit
+            << " to fit --max-buffers\n";
+            maxRunning_ = limit;
+        }
+    }
+
+    // run - convert every file, returns once the last converter has exited
+    void run(const std::vector<std::string>& files) {
+        int epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: epoll_create1 failed: " << std::strerror(errno) << "\n";
+            return;
+        }
+        size_t next = 0;
+        std::vector<char> buffer(64 * 1024);
+        std::vector<epoll_event> events(maxRunning_);
+
+        for (;;) {
+            while (jobs_.size() < maxRunning_ && next < files.size()) {
+                start(epfd, files[next++]);
+            }
+            if (jobs_.empty()) {
+                break;
+            }
+            int n = epoll_wait(epfd, events.data(), static_cast<int>(events.size()), -1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cerr << "Error: epoll_wait failed: " << std::strerror(errno) << "\n";
+                break;
+            }
+            for (int e = 0; e < n; e++) {
+                auto it = jobs_.find(events[e].data.fd);
+                if (it == jobs_.end()) {
+                    continue;
+                }
+                bool more;
+                try {
+                    more = drain(*it->second, buffer);
+                } catch (const std::exception& ex) {
+                    // only this document is lost; the other converters go on
+                    Job& job = *it->second;
+                    {
+                        std::lock_guard<std::mutex> lock(g_logMutex);
+                        std::cerr << "Error: " << job.path << ": " << ex.what() << "\n";
+                    }
+                    job.failed = true;
+                    kill(job.pid, SIGTERM);
+                    more = false;
+                }
+                if (!more) {
+                    finish(epfd, it);
+                }
+            }
+        }
+        // only non-empty after an epoll failure: reap whatever is left
+        while (!jobs_.empty()) {
+            finish(epfd, jobs_.begin());
+        }
+        ::close(epfd);
+    }
+
+private:
+    struct Job {
+        std::vector<std::string> argv;
+        std::string path;
+        pid_t pid    = -1;
+        int fd       = -1;
+        size_t bytes = 0;
+        bool failed  = false;
+        std::chrono::steady_clock::time_point started;
+        std::unique_ptr<Chunker> chunker;
+    };
+
+    BufferPool& pool_;
+    FlushStage& flush_;
+    size_t maxRunning_;
+    std::map<int, std::unique_ptr<Job>> jobs_; // keyed by pipe fd
+
+    void start(int epfd, const std::string& path) {
+        {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cout << "\nProcessing file: " << path << "\n";
+        }
+        auto job = std::make_unique<Job>();
+        job->path = path;
+        job->argv = converter_command(file_extension(path), path);
+        job->started = std::chrono::steady_clock::now();
+        if (!spawn_command(job->argv, &job->pid, &job->fd)) {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Error: could not start command: " << join_command(job->argv)
+            << " (" << std::strerror(errno) << ")\n"
+            << "Warning: No content processed from file: " << path << "\n";
+            return;
+        }
+        fcntl(job->fd, F_SETFL, fcntl(job->fd, F_GETFL) | O_NONBLOCK);
+        try {
+            job->chunker = std::make_unique<Chunker>(pool_, flush_, path, file_extension(path));
+        } catch (const std::exception& e) {
+            {
+                std::lock_guard<std::mutex> lock(g_logMutex);
+                std::cerr << "Error: " << path << ": " << e.what() << "\n";
+            }
+            kill(job->pid, SIGTERM);
+            ::close(job->fd);
+            while (waitpid(job->pid, nullptr, 0) < 0 && errno == EINTR) {
+            }
+            flush_.sourceFailed(path);
+            return;
+        }
+
+        epoll_event ev{};
+        ev.events  = EPOLLIN;
+        ev.data.fd = job->fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, job->fd, &ev);
+        jobs_[job->fd] = std::move(job);
+    }
+
+    // drain - read what the pipe holds right now; false once it hit EOF
+    bool drain(Job& job, std::vector<char>& buffer) {
+        for (;;) {
+            ssize_t bytesRead = ::read(job.fd, buffer.data(), buffer.size());
+            if (bytesRead > 0) {
+                job.bytes += static_cast<size_t>(bytesRead);
+                job.chunker->pushData(buffer.data(), static_cast<size_t>(bytesRead));
+                if (static_cast<size_t>(bytesRead) < buffer.size()) {
+                    job.chunker->releaseSpare();
+                    return true; // pipe emptied; give the other converters a turn
+                }
+                continue;
+            }
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                job.chunker->releaseSpare();
+                return true;
+            }
+            return false;
+        }
+    }
+
+    void finish(int epfd, std::map<int, std::unique_ptr<Job>>::iterator it) {
+        Job& job = *it->second;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, job.fd, nullptr);
+        ::close(job.fd);
+        int status = 0;
+        while (waitpid(job.pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        record_since(STAGE_CONVERT, job.started);
+        bool exited = report_exit(status, job.argv);
+        job.chunker.reset(); // flushes the last partial chunk
+        if (job.bytes == 0) {
+            flush_.sourceFailed(job.path);
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cerr << "Warning: No content processed from file: " << job.path << "\n";
+        } else if (job.failed || !exited) {
+            flush_.sourceFailed(job.path);
+        } else {
+            flush_.sourceDone(job.path);
+        }
+        jobs_.erase(it);
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 29) Server mode (--listen unix:PATH | tcp:[HOST:]PORT). Clients stream
+//     documents as frames, each a 1-byte type, a 4-byte big-endian payload
+//     length and the payload:
+//       'N' <name>   start a document (the name is its source in the output)
+//       'D' <bytes>  document content, any number of frames
+//       'E' (empty)  end of document; answered with "OK <bytes>\n"
+//     Every document gets its own Chunker over the shared pool and flush
+//     stage; connections are served in parallel on a WorkStealingPool (-j).
+// -----------------------------------------------------------------------------
+static const size_t MAX_DOCUMENT_NAME = 4096;
+
+// written by SIGINT / SIGTERM and never drained, so the read end stays
+// readable once a stop is requested; the accept loop and idle connections
+// poll it. g_stopSignals counts the signals for the second-signal cutoff.
+static int g_stopPipe[2] = { -1, -1 };
+static std::atomic<int> g_stopSignals{0};
+
+static void request_stop(int) {
+    char c = 1;
+    g_stopSignals.fetch_add(1);
+    ssize_t ignored = ::write(g_stopPipe[1], &c, 1);
+    (void)ignored;
+}
+
+// wait_frame - block until the next frame arrives; false when the server is
+// stopping and the client has nothing in flight
+static bool wait_frame(int fd) {
+    for (;;) {
+        pollfd fds[2] = { { fd, POLLIN, 0 }, { g_stopPipe[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return true; // let the read report the problem
+        }
+        if (fds[0].revents) {
+            return true;
+        }
+        if (fds[1].revents) {
+            return false;
+        }
+    }
+}
+
+// Connections - sockets being served, so a second stop signal can cut off
+// clients that stall in the middle of a frame
+class Connections {
+public:
+    void add(int fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fds_.insert(fd);
+    }
+
+    // close under the lock, so shutdownAll never touches a reused fd
+    void close(int fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fds_.erase(fd);
+        ::close(fd);
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return fds_.size();
+    }
+
+    // blocked reads return EOF and each connection winds down as if its
+    // client had hung up
+    void shutdownAll() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int fd : fds_) {
+            ::shutdown(fd, SHUT_RDWR);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_set<int> fds_;
+};
+
+// read_full - exactly n bytes; false on EOF or error before that
+static bool read_full(int fd, char* buf, size_t n) {
+    while (n > 0) {
+        ssize_t got = ::read(fd, buf, n);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        buf += got;
+        n -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+static void send_line(int fd, const std::string& line) {
+    const char* p = line.data();
+    size_t n = line.size();
+    while (n > 0) {
+        ssize_t sent = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return;
+        }
+        p += sent;
+        n -= static_cast<size_t>(sent);
+    }
+}
+
+// serve_connection - read frames until the client hangs up, or until the
+// server stops while the client is between frames; the caller closes fd
+static void serve_connection(int fd, const std::string& peer, BufferPool& pool, FlushStage& flush) {
+    std::unique_ptr<Chunker> chunker;
+    std::string name;
+    size_t bytes = 0;
+    size_t unnamed = 0;
+    std::vector<char> buffer(64 * 1024);
+    auto fail = [&](const std::string& msg) {
+        send_line(fd, "ERR " + msg + "\n");
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: " << peer << ": " << msg << "\n";
+    };
+
+    try {
+        for (;;) {
+            unsigned char header[5];
+            if (!wait_frame(fd)) { // the client's idle time is not read time
+                break;
+            }
+            {
+                StageTimer timer(STAGE_READ);
+                if (!read_full(fd, reinterpret_cast<char*>(header), sizeof(header))) {
+                    break;
+                }
+            }
+            uint32_t length = (uint32_t(header[1]) << 24) | (uint32_t(header[2]) << 16) |
+                              (uint32_t(header[3]) << 8) | uint32_t(header[4]);
+            char type = static_cast<char>(header[0]);
+
+            if (type == 'N') {
+                if (chunker) {
+                    fail("'N' inside a document");
+                    break;
+                }
+                if (length > MAX_DOCUMENT_NAME) {
+                    fail("document name too long");
+                    break;
+                }
+                name.assign(length, '\0');
+                if (!read_full(fd, &name[0], length)) {
+                    break;
+                }
+                chunker = std::make_unique<Chunker>(pool, flush, name, "stream");
+                bytes = 0;
+            } else if (type == 'D') {
+                if (!chunker) {
+                    // content without a name: label it after the connection
+                    name = peer + "#" + std::to_string(unnamed++);
+                    chunker = std::make_unique<Chunker>(pool, flush, name, "stream");
+                    bytes = 0;
+                }
+                for (size_t left = length; left > 0;) {
+                    size_t want = std::min(left, buffer.size());
+                    bool ok;
+                    {
+                        StageTimer timer(STAGE_READ);
+                        ok = read_full(fd, buffer.data(), want);
+                    }
+                    if (!ok) {
+                        throw std::runtime_error("connection closed inside a 'D' frame");
+                    }
+                    chunker->pushData(buffer.data(), want);
+                    bytes += want;
+                    left -= want;
+                }
+            } else if (type == 'E' && length == 0) {
+                chunker.reset(); // flushes the last partial chunk
+                send_line(fd, "OK " + std::to_string(bytes) + "\n");
+                if (g_logChunks) {
+                    std::lock_guard<std::mutex> lock(g_logMutex);
+                    std::cout << "Received document: " << (name.empty() ? peer : name)
+                    << " (" << bytes << " bytes)\n";
+                }
+                name.clear();
+                bytes = 0;
+            } else {
+                fail(std::string("bad frame type '") + type + "'");
+                break;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Error: " << peer << ": " << e.what() << "\n";
+    }
+    if (chunker) {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cerr << "Warning: " << peer << " disconnected inside document " << name
+        << "; keeping the " << bytes << " bytes received\n";
+    }
+    chunker.reset();
+}
+
+// open_listener - bound, listening socket for unix:PATH or tcp:[HOST:]PORT
+// (HOST defaults to 127.0.0.1); -1 after logging on failure
+static int open_listener(const std::string& address) {
+    if (address.compare(0, 5, "unix:") == 0) {
+        std::string path = address.substr(5);
+        sockaddr_un sa{};
+        if (path.empty() || path.size() >= sizeof(sa.sun_path)) {
+            std::cerr << "Error: bad unix socket path: " << path << "\n";
+            return -1;
+        }
+        sa.sun_family = AF_UNIX;
+        std::memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ::unlink(path.c_str()); // stale socket from an earlier run
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 ||
+            listen(fd, SOMAXCONN) != 0) {
+            std::cerr << "Error: could not listen on " << address << ": "
+            << std::strerror(errno) << "\n";
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            return -1;
+        }
+        return fd;
+    }
+    if (address.compare(0, 4, "tcp:") == 0) {
+        std::string hostPort = address.substr(4);
+        size_t colon = hostPort.rfind(':');
+        std::string host = colon == std::string::npos ? "127.0.0.1" : hostPort.substr(0, colon);
+        std::string port = colon == std::string::npos ? hostPort : hostPort.substr(colon + 1);
+        addrinfo hints{};
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+        addrinfo* res = nullptr;
+        int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+        if (rc != 0) {
+            std::cerr << "Error: " << address << ": " << gai_strerror(rc) << "\n";
+            return -1;
+        }
+        int fd = -1;
+        for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+                break;
+            }
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd < 0) {
+            std::cerr << "Error: could not listen on " << address << ": "
+            << std::strerror(errno) << "\n";
+        }
+        return fd;
+    }
+    std::cerr << "Error: --listen expects unix:PATH or tcp:[HOST:]PORT\n";
+    return -1;
+}
+
+// run_server - accept connections until SIGINT / SIGTERM. Connections then
+// finish the frame they are reading and end at the next frame boundary (a
+// document cut short keeps what arrived); a second signal shuts down the
+// sockets still open.
+static bool run_server(const std::string& address, size_t connections,
+                       BufferPool& pool, FlushStage& flush) {
+    int listenFd = open_listener(address);
+    if (listenFd < 0) {
+        return false;
+    }
+    if (pipe2(g_stopPipe, O_CLOEXEC) != 0) {
+        ::close(listenFd);
+        return false;
+    }
+    struct sigaction sa{};
+    sa.sa_handler = request_stop;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    {
+        std::lock_guard<std::mutex> lock(g_logMutex);
+        std::cout << "Listening on " << address << "\n";
+    }
+
+    {
+        Connections live;
+        WorkStealingPool workers(connections);
+        size_t accepted = 0;
+        bool outOfFds = false;
+        for (;;) {
+            pollfd fds[2] = { { listenFd, POLLIN, 0 }, { g_stopPipe[0], POLLIN, 0 } };
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (fds[1].revents) {
+                break;
+            }
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    // the pending connection stays queued and keeps the
+                    // listener readable: back off until a connection closes
+                    if (!outOfFds) {
+                        std::lock_guard<std::mutex> lock(g_logMutex);
+                        std::cerr << "Warning: accept: " << std::strerror(errno)
+                        << "; retrying every 100 ms\n";
+                    }
+                    outOfFds = true;
+                    poll(&fds[1], 1, 100);
+                }
+                continue;
+            }
+            outOfFds = false;
+            std::string peer = "conn" + std::to_string(++accepted);
+            live.add(fd);
+            workers.submit([fd, peer, &pool, &flush, &live] {
+                serve_connection(fd, peer, pool, flush);
+                live.close(fd);
+            });
+        }
+        {
+            std::lock_guard<std::mutex> lock(g_logMutex);
+            std::cout << "Stopping: finishing open connections (signal again to close them)\n";
+        }
+        while (live.size() > 0) {
+            if (g_stopSignals.load() >= 2) {
+                live.shutdownAll();
+                break;
+            }
+            poll(nullptr, 0, 100);
+        }
+    } // ~WorkStealingPool waits for the connections
+
+    ::close(listenFd);
+    if (address.compare(0, 5, "unix:") == 0) {
+        ::unlink(address.c_str() + 5);
+    }
+    ::close(g_stopPipe[0]);
+    ::close(g_stopPipe[1]);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// 30) Metrics export (--metrics FILE, --metrics-listen ADDR). A background
+//     thread rewrites a JSON summary every --metrics-interval seconds and/or
+//     answers HTTP requests on ADDR with the Prometheus text format. Both read
+//     a snapshot of the stage shards, so the pipeline threads never block.
+// -----------------------------------------------------------------------------
+static std::string metrics_json(const StageStats::Snapshot& snap, double uptime) {
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(3) << "{\"uptime_s\":" << uptime;
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        oss << ",\"" << COUNTER_NAMES[c] << "\":" << snap.counters[c];
+    }
+    oss << ",\"stages\":{";
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        oss << (s ? "," : "") << "\"" << STAGE_NAMES[s] << "\":{\"events\":" << snap.events[s]
+        << ",\"seconds\":" << static_cast<double>(snap.nanos[s]) / 1e9
+        << ",\"p50_us\":" << static_cast<double>(snap.quantile(s, 0.50)) / 1e3
+        << ",\"p90_us\":" << static_cast<double>(snap.quantile(s, 0.90)) / 1e3
+        << ",\"p99_us\":" << static_cast<double>(snap.quantile(s, 0.99)) / 1e3
+        << ",\"max_us\":" << static_cast<double>(snap.max(s)) / 1e3 << "}";
+    }
+    oss << "}}\n";
+    return oss.str();
+}
+
+// metrics_prometheus - counters plus one histogram per stage; the fine
+// buckets are folded into decade `le` bounds from 1us to 10s
+static std::string metrics_prometheus(const StageStats::Snapshot& snap) {
+    static const double BOUNDS[] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10 };
+    std::ostringstream oss;
+    oss << std::setprecision(9);
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        oss << "# TYPE chunk_" << COUNTER_NAMES[c] << "_total counter\n"
+        << "chunk_" << COUNTER_NAMES[c] << "_total " << snap.counters[c] << "\n";
+    }
+    oss << "# HELP chunk_stage_seconds Time spent per pipeline stage event.\n"
+    << "# TYPE chunk_stage_seconds histogram\n";
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        const uint64_t* h = &snap.buckets[s * HIST_BUCKETS];
+        uint64_t cumulative = 0;
+        size_t b = 0;
+        for (double bound : BOUNDS) {
+            uint64_t limit = static_cast<uint64_t>(bound * 1e9);
+            for (; b < HIST_BUCKETS && hist_upper(b) <= limit; b++) {
+                cumulative += h[b];
+            }
+            oss << "chunk_stage_seconds_bucket{stage=\"" << STAGE_NAMES[s] << "\",le=\""
+            << bound << "\"} " << cumulative << "\n";
+        }
+        oss << "chunk_stage_seconds_bucket{stage=\"" << STAGE_NAMES[s] << "\",le=\"+Inf\"} "
+        << snap.events[s] << "\n"
+        << "chunk_stage_seconds_sum{stage=\"" << STAGE_NAMES[s] << "\"} "
+        << static_cast<double>(snap.nanos[s]) / 1e9 << "\n"
+        << "chunk_stage_seconds_count{stage=\"" << STAGE_NAMES[s] << "\"} "
+        << snap.events[s] << "\n";
+    }
+    return oss.str();
+}
+
+class MetricsExporter {
+public:
+    // jsonPath may be empty (no dump), listenFd -1 (no endpoint); the
+    // exporter owns listenFd
+    MetricsExporter(const std::string& jsonPath, size_t intervalSeconds, int listenFd)
+    : jsonPath_(jsonPath), interval_(std::chrono::seconds(intervalSeconds)),
+      listenFd_(listenFd), started_(std::chrono::steady_clock::now())
+    {
+        if (pipe2(stopPipe_, O_CLOEXEC) != 0) {
+            throw std::runtime_error(std::string("pipe2 failed: ") + std::strerror(errno));
+        }
+        thread_ = std::thread(&MetricsExporter::loop, this);
+    }
+
+    ~MetricsExporter() {
+        stop();
+    }
+
+    // stop - end the thread and write the final JSON summary
+    void stop() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        char c = 1;
+        ssize_t ignored = ::write(stopPipe_[1], &c, 1);
+        (void)ignored;
+        thread_.join();
+        dump();
+        ::close(stopPipe_[0]);
+        ::close(stopPipe_[1]);
+        if (listenFd_ >= 0) {
+            ::close(listenFd_);
+        }
+    }
+
+private:
+    std::string jsonPath_;
+    std::chrono::seconds interval_;
+    int listenFd_;
+    std::chrono::steady_clock::time_point started_;
+    int stopPipe_[2] = { -1, -1 };
+    std::thread thread_;
+
+    void loop() {
+        auto nextDump = std::chrono::steady_clock::now() + interval_;
+        for (;;) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                nextDump - std::chrono::steady_clock::now()).count();
+            pollfd fds[2] = { { stopPipe_[0], POLLIN, 0 }, { listenFd_, POLLIN, 0 } };
+            int rc = poll(fds, listenFd_ >= 0 ? 2 : 1,
+                          jsonPath_.empty() ? -1 : static_cast<int>(std::max<long long>(0, wait)));
+            if (rc < 0 && errno != EINTR) {
+                return;
+            }
+            if (fds[0].revents) {
+                return;
+            }
+            if (listenFd_ >= 0 && fds[1].revents) {
+                serve();
+            }
+            if (!jsonPath_.empty() && std::chrono::steady_clock::now() >= nextDump) {
+                dump();
+                nextDump += interval_;
+            }
+        }
+    }
+
+    // dump - replace the JSON file, so readers never see a partial one
+    void dump() {
+        if (jsonPath_.empty()) {
+            return;
+        }
+        double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                       started_).count();
+        std::string tmp = jsonPath_ + ".tmp";
+        {
+            std::ofstream ofs(tmp, std::ios::trunc);
+            ofs << metrics_json(g_stageStats.snapshot(), uptime);
+        }
+        std::rename(tmp.c_str(), jsonPath_.c_str());
+    }
+
+    // serve - answer one HTTP request (any path) with the Prometheus text
+    void serve() {
+        int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        // read the request head; a client that sends nothing gets a second
+        char request[4096];
+        pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) > 0) {
+            ssize_t ignored = ::read(fd, request, sizeof(request));
+            (void)ignored;
+        }
+        std::string body = metrics_prometheus(g_stageStats.snapshot());
+        send_line(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+        ::close(fd);
+    }
+};
+
+// -----------------------------------------------------------------------------
+// 31) Help message
+// -----------------------------------------------------------------------------
+void print_help(const char* progName) {
+    std::cout << R"(
+
+ ██████╗██╗  ██╗██╗   ██╗███╗   ██╗██╗  ██╗
+██╔════╝██║  ██║██║   ██║████╗  ██║██║ ██╔╝
+██║     ███████║██║   ██║██╔██╗ ██║█████╔╝
+██║     ██╔══██║██║   ██║██║╚██╗██║██╔═██╗
+╚██████╗██║  ██║╚██████╔╝██║ ╚████║██║  ██╗
+ ╚═════╝╚═╝  ╚═╝ ╚═════╝ ╚═╝  ╚═══╝╚═╝  ╚═╝
+
+)" << "\n";
+
+std::cout << "\n--- Chunk Stream Program ---\n\n"
+<< "Usage:\n"
+<< "  " << progName << " [options] <file1> [file2 ...]   (- reads stdin)\n"
+<< "  " << progName << " [options] --listen unix:PATH|tcp:[HOST:]PORT\n\n"
+<< "Options:\n"
+<< "  -j, --jobs N        Process up to N input files in parallel (default 1).\n"
+<< "  --converters N      Run up to N PDF/DOC/RTF converters at once,\n"
+<< "                      alongside the other files.\n"
+#ifdef CHUNK_WITH_POPPLER
+<< "  --pdf-engine E      poppler: extract PDF text in-process (default);\n"
+<< "                      pdftotext: run the external tool.\n"
+<< "  --pdf-threads N     Poppler: extract pages of one PDF on N threads.\n"
+#endif
+<< "  --file-threads N    Read and chunk one large uncompressed file in ranges\n"
+<< "                      on N threads (--split fixed or boundary).\n"
+<< "  --decompress-threads N  Decode independent zstd frames or BGZF blocks of\n"
+<< "                      one compressed input on N threads.\n"
+<< "  --flush-threads N   Worker threads hashing and writing chunks (default "
+<< DEFAULT_FLUSH_THREADS << ").\n"
+<< "  --max-buffers N     Upper bound on chunk buffers allocated on demand (default\n"
+<< "                      " << NUM_BUFFERS << ", more for small chunks: ~500MB in total).\n"
+<< "  --chunk-size SIZE   Chunk size, K/M/G suffixes (default 5M, at least "
+<< MIN_CHUNK_SIZE << ").\n"
+<< "  --chunk-variance SIZE  Slack past --chunk-size: fixed chunks are SIZE +\n"
+<< "                      variance, boundary cuts look back this far (default\n"
+<< "                      5K, or an eighth of a smaller --chunk-size).\n"
+<< "  --split MODE        fixed: cut every ~5MB (default); cdc: content-defined\n"
+<< "                      cuts (rolling hash, 2.5MB-10MB, ~5MB average);\n"
+<< "                      boundary: ~5MB, ending on a paragraph, sentence or\n"
+<< "                      UTF-8 boundary within the last 5KB. Sizes scale\n"
+<< "                      with --chunk-size.\n"
+<< "  --max-tokens N      End chunks after N WordPiece tokens (between words,\n"
+<< "                      still capped at the chunk size); needs --vocab.\n"
+<< "  --vocab FILE        WordPiece vocab, one token per line (BERT vocab.txt).\n"
+<< "  --token-overlap N   Repeat the last N tokens at the start of the next chunk.\n"
+<< "  --hash ALGO         Chunk digest: sha512 (default), sha256"
+#ifdef CHUNK_WITH_BLAKE3
+<< ", blake3"
+#endif
+#ifdef CHUNK_WITH_XXHASH
+<< ", xxh3"
+#endif
+<< ".\n"
+<< "  --output FORMAT     files: one file per chunk (default); segments: append\n"
+<< "                      chunks to segment files indexed by chunks.idx"
+#ifdef CHUNK_WITH_CURL
+<< ";\n"
+<< "                      s3: multipart uploads of chunk packs to --s3-url;\n"
+<< "                      http: POST batches of chunks to --http-url"
+#endif
+<< ".\n"
+<< "  --manifest FORMAT   Per-chunk source/offset/hash table written to the output\n"
+<< "                      directory: jsonl (default), parquet or none.\n"
+<< "  --segment-size SIZE Start a new segment file (or S3 pack) after SIZE bytes\n"
+<< "                      (default 1G).\n"
+#ifdef CHUNK_WITH_CURL
+<< "  --s3-url URL        http(s)://HOST[:PORT]/BUCKET[/PREFIX] (path-style); keys\n"
+<< "                      come from AWS_ACCESS_KEY_ID / AWS_SECRET_ACCESS_KEY.\n"
+<< "  --s3-region REGION  Signing region (default $AWS_REGION or us-east-1).\n"
+<< "  --http-url URL      Ingest endpoint for --output http.\n"
+<< "  --http-header 'K: V'  Extra request header for --output http (repeatable).\n"
+<< "  --upload-concurrency N  Upload requests in flight (default 4).\n"
+<< "  --upload-batch SIZE Bytes per S3 part or HTTP batch (default 8M).\n"
+#endif
+#ifdef CHUNK_WITH_ZSTD
+<< "  --zstd LEVEL        Compress each chunk in segment output with zstd.\n"
+#endif
+#ifdef CHUNK_WITH_URING
+<< "  --io BACKEND        sync: write chunk files from the flush workers (default);\n"
+<< "                      uring: batched open/write/close through io_uring.\n"
+<< "  --direct            With --io uring: write chunk files with O_DIRECT.\n"
+#endif
+<< "  --index FILE        Persistent chunk-hash index; chunks already in it are\n"
+<< "                      not written again (listed in references.txt instead).\n"
+<< "  --near-dup MODE     Sketch every chunk (MinHash) and find near duplicates of\n"
+<< "                      earlier chunks: tag marks them in the manifest, drop\n"
+<< "                      does not write them.\n"
+<< "  --near-dup-threshold J  Estimated Jaccard similarity of 8-byte shingles\n"
+<< "                      that makes a near duplicate (default 0.9).\n"
+<< "  --state FILE        Remember inputs and their chunks; inputs whose size and\n"
+<< "                      mtime are unchanged are skipped on the next run.\n"
+<< "  --state-hash        Also compare a sampled content hash of each input.\n"
+<< "  --journal           Keep a run journal and fdatasync every chunk file before\n"
+<< "                      it is renamed into place, so --resume can continue the\n"
+<< "                      run after a crash (--output files).\n"
+<< "  --resume DIR        Continue an interrupted --journal run in its output\n"
+<< "                      directory DIR (same options and inputs): finished inputs\n"
+<< "                      are skipped, the others go on after their last committed\n"
+<< "                      chunk.\n"
+<< "  --columns a,b,...   Parquet: only decode and emit these columns.\n"
+<< "  --json-fields a,b.c JSONL: chunk only these string fields (default text);\n"
+<< "                      dotted paths reach into nested objects.\n"
+<< "  --csv MODE          raw: chunk the file bytes (default); records: parse\n"
+<< "                      CSV/TSV rows and write them as 'a | b' lines, chunks\n"
+<< "                      start with the header row and end between rows.\n"
+<< "  --csv-columns a,b   CSV records: only emit these columns.\n"
+<< "  --csv-delimiter C   Field separator (default ',', tab for .tsv).\n"
+<< "  --csv-threads N     Parse ranges of one uncompressed CSV file on N threads.\n"
+<< "  --parquet-batch-rows N  Parquet: rows per streamed record batch (default "
+<< DEFAULT_PARQUET_BATCH_ROWS << ").\n"
+<< "  --parquet-readahead N   Parquet: decode up to N row groups concurrently.\n"
+<< "  --listen ADDR       Serve documents sent over a socket (frames: 'N' name,\n"
+<< "                      'D' data, 'E' end; see README) until SIGINT/SIGTERM.\n"
+<< "  --bench             Benchmark each ingestion path on synthetic inputs.\n"
+<< "  --bench-size SIZE   Bytes per synthetic input, K/M/G suffixes (default 256M).\n"
+<< "  -q, --quiet         Do not print a line per chunk.\n"
+<< "  --metrics FILE      Rewrite FILE with JSON stage counters and latency\n"
+<< "                      percentiles every --metrics-interval seconds (default 10).\n"
+<< "  --metrics-listen ADDR  Serve the same metrics in Prometheus text format over\n"
+<< "                      HTTP on unix:PATH or tcp:[HOST:]PORT.\n"
+<< "  --config FILE       Read options from FILE, one per line: 'name value',\n"
+<< "                      'name = value' or a bare flag name ('#' comments).\n"
+<< "  -h, --help          Show this message.\n\n"
+<< "Description:\n"
+<< "  - Reads each file using external tools if needed (PDF, DOC, DOCX, ODT, RTF) or\n"
+<< "    direct read (CSV, TXT), decompressing gzip"
+#ifdef CHUNK_WITH_ZSTD
+<< ", zstd"
+#endif
+#ifdef CHUNK_WITH_BZIP2
+<< ", bzip2"
+#endif
+#ifdef CHUNK_WITH_LZMA
+<< ", xz"
+#endif
+<< " input.\n"
+<< "  - JSONL / NDJSON: only the --json-fields values are chunked.\n"
+<< "  - CSV / TSV: rows are split into fields (RFC 4180 quoting) and chunked\n"
+<< "    as 'a | b | c' lines, each chunk starting with the header row.\n"
+<< "  - Streams all data in ~5MB chunks, writes them as <hash>_<timestamp>.txt\n"
+<< "    in a directory under /tmp (like /tmp/chunked_<timestamp>_XXXXXX).\n"
+<< "  - Buffers are allocated on demand, up to ~500MB total by default.\n\n"
+<< "Requirements:\n"
+<< "  - OpenSSL (libssl-dev) for SHA-512 / SHA-256.\n"
+<< "  - External commands: pdftotext, doc2txt, odt2txt, unrtf.\n\n"
+<< "Example:\n"
+<< "  " << progName << " big_file.pdf notes.csv doc1.docx\n\n";
+}
+
+// -----------------------------------------------------------------------------
+// 32) Command-line options
+// -----------------------------------------------------------------------------
+enum class OutputFormat { Files, Segments, S3, Http };
+enum class ManifestFormat { None, Jsonl, Parquet };
+
+struct Options {
+    size_t flushThreads = DEFAULT_FLUSH_THREADS;
+    size_t maxBuffers   = 0; // 0 => ~500MB worth of chunk buffers
+    size_t chunkSize    = DEFAULT_CHUNK_SIZE;
+    size_t chunkVariance = 0; // 0 => min(DEFAULT_CHUNK_VARIANCE, chunkSize / 8)
+    size_t jobs         = 1;
+    size_t converters   = 0; // 0 => converters run inline in process_file
+    PdfEngine pdfEngine = g_pdfEngine;
+    size_t pdfThreads   = 1;
+    size_t decompressThreads = 1;
+    size_t fileThreads  = 1;
+    SplitMode splitMode = SplitMode::Fixed;
+    HashAlgo hashAlgo   = HashAlgo::Sha512;
+    size_t parquetBatchRows = DEFAULT_PARQUET_BATCH_ROWS;
+    size_t parquetReadahead = 0;
+    std::vector<std::string> columns;
+    std::vector<std::string> jsonFields = g_jsonFields;
+    CsvMode csvMode     = CsvMode::Raw;
+    std::vector<std::string> csvColumns;
+    char csvDelimiter   = 0; // 0 => ',' or tab by extension
+    size_t csvThreads   = 1;
+    std::string indexPath;
+    NearDupMode nearDup = NearDupMode::Off;
+    double nearDupThreshold = 0.9;
+    std::string statePath;
+    bool stateHash      = false;
+    bool journal        = false; // --journal: checkpoint the run for --resume
+    std::string resumeDir; // --resume: continue the run in this output directory
+    OutputFormat output = OutputFormat::Files;
+    ManifestFormat manifest = ManifestFormat::Jsonl;
+    size_t segmentSize  = DEFAULT_SEGMENT_SIZE;
+    std::string s3Url;  // --output s3: http(s)://host[:port]/bucket[/prefix]
+    std::string s3Region;
+    std::string httpUrl; // --output http: the ingest endpoint
+    std::vector<std::string> httpHeaders;
+    size_t uploadConcurrency = DEFAULT_UPLOAD_CONCURRENCY;
+    size_t uploadBatch  = DEFAULT_UPLOAD_BATCH;
+    size_t zstdLevel    = 0; // 0 => stored uncompressed
+    bool uring          = false;
+    bool direct         = false;
+    size_t maxTokens    = 0;
+    size_t tokenOverlap = 0;
+    std::string vocabPath;
+    std::string listen; // --listen address; empty => process the input files
+    bool bench          = false;
+    size_t benchSize    = DEFAULT_BENCH_SIZE;
+    bool quiet          = false;
+    std::string metricsPath;
+    std::string metricsListen;
+    size_t metricsInterval = 10; // seconds between --metrics dumps
+    bool showHelp       = false;
+    std::vector<std::string> files;
+};
+
+static std::vector<std::string> split_list(const std::string& text) {
+    std::vector<std::string> items;
+    std::istringstream iss(text);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+static bool parse_count(const std::string& text, size_t& out) {
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    out = std::strtoull(text.c_str(), nullptr, 10);
+    return true;
+}
+
+// parse_size - byte count with an optional K/M/G suffix (powers of 1024)
+static bool parse_size(const std::string& text, size_t& out) {
+    if (text.empty()) {
+        return false;
+    }
+    size_t shift = 0;
+    std::string digits = text;
+    switch (std::toupper(static_cast<unsigned char>(text.back()))) {
+        case 'K': shift = 10; break;
+        case 'M': shift = 20; break;
+        case 'G': shift = 30; break;
+        default: break;
+    }
+    if (shift) {
+        digits.pop_back();
+    }
+    if (!parse_count(digits, out)) {
+        return false;
+    }
+    out <<= shift;
+    return true;
+}
+
+// read_config - append the options in a --config file to `args`. Each line
+// is "name value", "name = value" or a bare flag name, with or without the
+// leading "--"; blank lines and text after '#' are ignored.
+static bool read_config(const std::string& path, std::vector<std::string>& args) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Error: could not open config file " << path << "\n";
+        return false;
+    }
+    std::string line;
+    for (size_t lineNo = 1; std::getline(in, line); lineNo++) {
+        line = line.substr(0, line.find('#'));
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos) {
+            continue;
+        }
+        size_t end = line.find_last_not_of(" \t\r");
+        line = line.substr(start, end - start + 1);
+
+        size_t nameEnd = line.find_first_of(" \t=");
+        std::string name = line.substr(0, nameEnd);
+        std::string value;
+        if (nameEnd != std::string::npos) {
+            size_t valueStart = line.find_first_not_of(" \t", nameEnd);
+            if (valueStart != std::string::npos && line[valueStart] == '=') {
+                valueStart = line.find_first_not_of(" \t", valueStart + 1);
+            }
+            if (valueStart != std::string::npos) {
+                value = line.substr(valueStart);
+            }
+        }
+        if (name[0] != '-') {
+            name = "--" + name;
+        }
+        if (name == "--config") {
+            std::cerr << "Error: " << path << ":" << lineNo << ": --config cannot be nested\n";
+            return false;
+        }
+        args.push_back(name);
+        if (!value.empty()) {
+            args.push_back(value);
+        }
+    }
+    return true;
+}
+
+static bool parse_args(std::vector<std::string> args, Options& opts);
+
+// parse_args - options first, everything else is an input file
+bool parse_args(int argc, char* argv[], Options& opts) {
+    return parse_args(std::vector<std::string>(argv + 1, argv + argc), opts);
+}
+
+// the options in a --config file take the place of the --config argument
+static bool parse_args(std::vector<std::string> args, Options& opts) {
+    for (size_t i = 0; i < args.size(); ++i) {
+        std::string arg = args[i];
+        if (arg == "-h" || arg == "--help") {
+            opts.showHelp = true;
+        } else if (arg == "-q" || arg == "--quiet") {
+            opts.quiet = true;
+        } else if (arg == "--metrics") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --metrics expects a file path\n";
+                return false;
+            }
+            opts.metricsPath = args[++i];
+        } else if (arg == "--metrics-interval") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.metricsInterval) ||
+                opts.metricsInterval == 0) {
+                std::cerr << "Error: --metrics-interval expects a positive number of seconds\n";
+                return false;
+            }
+        } else if (arg == "--metrics-listen") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --metrics-listen expects unix:PATH or tcp:[HOST:]PORT\n";
+                return false;
+            }
+            opts.metricsListen = args[++i];
+        } else if (arg == "--flush-threads") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.flushThreads) ||
+                opts.flushThreads == 0) {
+                std::cerr << "Error: --flush-threads expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "-j" || arg == "--jobs") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.jobs) || opts.jobs == 0) {
+                std::cerr << "Error: -j expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "--split") {
+            std::string mode = i + 1 < args.size() ? args[++i] : "";
+            if (mode == "fixed") {
+                opts.splitMode = SplitMode::Fixed;
+            } else if (mode == "cdc") {
+                opts.splitMode = SplitMode::ContentDefined;
+            } else if (mode == "boundary") {
+                opts.splitMode = SplitMode::Boundary;
+            } else {
+                std::cerr << "Error: --split expects fixed, cdc or boundary\n";
+                return false;
+            }
+        } else if (arg == "--hash") {
+            if (i + 1 >= args.size() || !parse_hash_algo(args[++i], opts.hashAlgo)) {
+                std::cerr << "Error: --hash expects sha512 or sha256"
+#ifdef CHUNK_WITH_BLAKE3
+                << ", blake3"
+#endif
+#ifdef CHUNK_WITH_XXHASH
+                << ", xxh3"
+#endif
+                << "\n";
+                return false;
+            }
+        } else if (arg == "--columns") {
+            if (i + 1 >= args.size() || (opts.columns = split_list(args[++i])).empty()) {
+                std::cerr << "Error: --columns expects a comma-separated list of names\n";
+                return false;
+            }
+        } else if (arg == "--parquet-batch-rows") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.parquetBatchRows) ||
+                opts.parquetBatchRows == 0) {
+                std::cerr << "Error: --parquet-batch-rows expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "--parquet-readahead") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.parquetReadahead)) {
+                std::cerr << "Error: --parquet-readahead expects a number\n";
+                return false;
+            }
+        } else if (arg == "--output") {
+            std::string format = i + 1 < args.size() ? args[++i] : "";
+            if (format == "files") {
+                opts.output = OutputFormat::Files;
+            } else if (format == "segments") {
+                opts.output = OutputFormat::Segments;
+#ifdef CHUNK_WITH_CURL
+            } else if (format == "s3") {
+                opts.output = OutputFormat::S3;
+            } else if (format == "http") {
+                opts.output = OutputFormat::Http;
+#endif
+            } else {
+#ifdef CHUNK_WITH_CURL
+                std::cerr << "Error: --output expects files, segments, s3 or http\n";
+#else
+                std::cerr << "Error: --output expects files or segments\n";
+#endif
+                return false;
+            }
+        } else if (arg == "--manifest") {
+            std::string format = i + 1 < args.size() ? args[++i] : "";
+            if (format == "jsonl") {
+                opts.manifest = ManifestFormat::Jsonl;
+            } else if (format == "parquet") {
+                opts.manifest = ManifestFormat::Parquet;
+            } else if (format == "none") {
+                opts.manifest = ManifestFormat::None;
+            } else {
+                std::cerr << "Error: --manifest expects jsonl, parquet or none\n";
+                return false;
+            }
+        } else if (arg == "--segment-size") {
+            if (i + 1 >= args.size() || !parse_size(args[++i], opts.segmentSize) ||
+                opts.segmentSize == 0) {
+                std::cerr << "Error: --segment-size expects a size such as 1G\n";
+                return false;
+            }
+#ifdef CHUNK_WITH_ZSTD
+        } else if (arg == "--zstd") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.zstdLevel) ||
+                opts.zstdLevel == 0 || opts.zstdLevel > static_cast<size_t>(ZSTD_maxCLevel())) {
+                std::cerr << "Error: --zstd expects a level from 1 to " << ZSTD_maxCLevel() << "\n";
+                return false;
+            }
+#endif
+#ifdef CHUNK_WITH_CURL
+        } else if (arg == "--s3-url") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --s3-url expects http(s)://HOST/BUCKET[/PREFIX]\n";
+                return false;
+            }
+            opts.s3Url = args[++i];
+        } else if (arg == "--s3-region") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --s3-region expects a region name\n";
+                return false;
+            }
+            opts.s3Region = args[++i];
+        } else if (arg == "--http-url") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --http-url expects an http(s):// URL\n";
+                return false;
+            }
+            opts.httpUrl = args[++i];
+        } else if (arg == "--http-header") {
+            if (i + 1 >= args.size() || args[i + 1].find(':') == std::string::npos) {
+                std::cerr << "Error: --http-header expects 'NAME: VALUE'\n";
+                return false;
+            }
+            opts.httpHeaders.push_back(args[++i]);
+        } else if (arg == "--upload-concurrency") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.uploadConcurrency) ||
+                opts.uploadConcurrency == 0) {
+                std::cerr << "Error: --upload-concurrency expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "--upload-batch") {
+            if (i + 1 >= args.size() || !parse_size(args[++i], opts.uploadBatch) ||
+                opts.uploadBatch == 0) {
+                std::cerr << "Error: --upload-batch expects a size such as 8M\n";
+                return false;
+            }
+#endif
+#ifdef CHUNK_WITH_URING
+        } else if (arg == "--io") {
+            std::string backend = i + 1 < args.size() ? args[++i] : "";
+            if (backend == "sync") {
+                opts.uring = false;
+            } else if (backend == "uring") {
+                opts.uring = true;
+            } else {
+                std::cerr << "Error: --io expects sync or uring\n";
+                return false;
+            }
+        } else if (arg == "--direct") {
+            opts.direct = true;
+#endif
+        } else if (arg == "--max-tokens") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.maxTokens) ||
+                opts.maxTokens == 0) {
+                std::cerr << "Error: --max-tokens expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "--token-overlap") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.tokenOverlap)) {
+                std::cerr << "Error: --token-overlap expects a number\n";
+                return false;
+            }
+        } else if (arg == "--vocab") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --vocab expects a file path\n";
+                return false;
+            }
+            opts.vocabPath = args[++i];
+        } else if (arg == "--index") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --index expects a file path\n";
+                return false;
+            }
+            opts.indexPath = args[++i];
+        } else if (arg == "--listen") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --listen expects unix:PATH or tcp:[HOST:]PORT\n";
+                return false;
+            }
+            opts.listen = args[++i];
+        } else if (arg == "--state") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --state expects a file path\n";
+                return false;
+            }
+            opts.statePath = args[++i];
+        } else if (arg == "--state-hash") {
+            opts.stateHash = true;
+        } else if (arg == "--journal") {
+            opts.journal = true;
+        } else if (arg == "--resume") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --resume expects an output directory\n";
+                return false;
+            }
+            opts.resumeDir = args[++i];
+        } else if (arg == "--bench") {
+            opts.bench = true;
+        } else if (arg == "--bench-size") {
+            if (i + 1 >= args.size() || !parse_size(args[++i], opts.benchSize) ||
+                opts.benchSize == 0) {
+                std::cerr << "Error: --bench-size expects a size such as 512M\n";
+                return false;
+            }
+        } else if (arg == "--converters") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.converters) ||
+                opts.converters == 0) {
+                std::cerr << "Error: --converters expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "--pdf-engine") {
+            std::string engine = i + 1 < args.size() ? args[++i] : "";
+            if (engine == "pdftotext") {
+                opts.pdfEngine = PdfEngine::Pdftotext;
+#ifdef CHUNK_WITH_POPPLER
+            } else if (engine == "poppler") {
+                opts.pdfEngine = PdfEngine::Poppler;
+#endif
+            } else {
+                std::cerr << "Error: --pdf-engine expects pdftotext"
+#ifdef CHUNK_WITH_POPPLER
+                << " or poppler"
+#endif
+                << "\n";
+                return false;
+            }
+        } else if (arg == "--pdf-threads") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.pdfThreads) ||
+                opts.pdfThreads == 0) {
+                std::cerr << "Error: --pdf-threads expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "--json-fields") {
+            if (i + 1 >= args.size() || (opts.jsonFields = split_list(args[++i])).empty()) {
+                std::cerr << "Error: --json-fields expects a comma-separated list of fields\n";
+                return false;
+            }
+        } else if (arg == "--csv") {
+            std::string mode = i + 1 < args.size() ? args[++i] : "";
+            if (mode == "records") {
+                opts.csvMode = CsvMode::Records;
+            } else if (mode == "raw") {
+                opts.csvMode = CsvMode::Raw;
+            } else {
+                std::cerr << "Error: --csv expects records or raw\n";
+                return false;
+            }
+        } else if (arg == "--csv-columns") {
+            if (i + 1 >= args.size() || (opts.csvColumns = split_list(args[++i])).empty()) {
+                std::cerr << "Error: --csv-columns expects a comma-separated list of names\n";
+                return false;
+            }
+        } else if (arg == "--csv-delimiter") {
+            std::string delim = i + 1 < args.size() ? args[++i] : "";
+            if (delim == "tab" || delim == "\\t") {
+                delim = "\t";
+            }
+            if (delim.size() != 1 || delim[0] == '"' || delim[0] == '\n' || delim[0] == '\r') {
+                std::cerr << "Error: --csv-delimiter expects one character (or tab)\n";
+                return false;
+            }
+            opts.csvDelimiter = delim[0];
+        } else if (arg == "--csv-threads") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.csvThreads) ||
+                opts.csvThreads == 0) {
+                std::cerr << "Error: --csv-threads expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "--near-dup") {
+            std::string mode = i + 1 < args.size() ? args[++i] : "";
+            if (mode == "tag") {
+                opts.nearDup = NearDupMode::Tag;
+            } else if (mode == "drop") {
+                opts.nearDup = NearDupMode::Drop;
+            } else {
+                std::cerr << "Error: --near-dup expects tag or drop\n";
+                return false;
+            }
+        } else if (arg == "--near-dup-threshold") {
+            char* end = nullptr;
+            const char* text = i + 1 < args.size() ? args[++i].c_str() : "";
+            opts.nearDupThreshold = std::strtod(text, &end);
+            if (end == text || *end != '\0' || !(opts.nearDupThreshold > 0) ||
+                opts.nearDupThreshold > 1) {
+                std::cerr << "Error: --near-dup-threshold expects a number in (0, 1]\n";
+                return false;
+            }
+        } else if (arg == "--file-threads") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.fileThreads) ||
+                opts.fileThreads == 0) {
+                std::cerr << "Error: --file-threads expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "--decompress-threads") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.decompressThreads) ||
+                opts.decompressThreads == 0) {
+                std::cerr << "Error: --decompress-threads expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "--max-buffers") {
+            if (i + 1 >= args.size() || !parse_count(args[++i], opts.maxBuffers) ||
+                opts.maxBuffers == 0) {
+                std::cerr << "Error: --max-buffers expects a positive number\n";
+                return false;
+            }
+        } else if (arg == "--chunk-size") {
+            if (i + 1 >= args.size() || !parse_size(args[++i], opts.chunkSize) ||
+                opts.chunkSize < MIN_CHUNK_SIZE || opts.chunkSize > MAX_CHUNK_SIZE) {
+                std::cerr << "Error: --chunk-size expects a size between " << MIN_CHUNK_SIZE
+                << " and 1G\n";
+                return false;
+            }
+        } else if (arg == "--chunk-variance") {
+            if (i + 1 >= args.size() || !parse_size(args[++i], opts.chunkVariance) ||
+                opts.chunkVariance == 0) {
+                std::cerr << "Error: --chunk-variance expects a positive size\n";
+                return false;
+            }
+        } else if (arg == "--config") {
+            if (i + 1 >= args.size()) {
+                std::cerr << "Error: --config expects a file path\n";
+                return false;
+            }
+            std::vector<std::string> included;
+            if (!read_config(args[i + 1], included)) {
+                return false;
+            }
+            args.erase(args.begin() + i, args.begin() + i + 2);
+            args.insert(args.begin() + i, included.begin(), included.end());
+            --i;
+        } else {
+            opts.files.push_back(arg);
+        }
+    }
+    if (opts.chunkVariance == 0) {
+        opts.chunkVariance = std::min(DEFAULT_CHUNK_VARIANCE, opts.chunkSize / 8);
+    } else if (opts.chunkVariance >= opts.chunkSize) {
+        std::cerr << "Error: --chunk-variance must be smaller than --chunk-size\n";
+        return false;
+    }
+    if (std::count(opts.files.begin(), opts.files.end(), "-") > 1) {
+        std::cerr << "Error: - (stdin) can only be given once\n";
+        return false;
+    }
+    if (!opts.listen.empty() && !opts.files.empty()) {
+        std::cerr << "Error: --listen does not take input files\n";
+        return false;
+    }
+    if (opts.uring && opts.output != OutputFormat::Files) {
+        std::cerr << "Error: --io uring writes --output files\n";
+        return false;
+    }
+    if (opts.journal && opts.output != OutputFormat::Files) {
+        std::cerr << "Error: --journal checkpoints runs with --output files\n";
+        return false;
+    }
+    if (!opts.resumeDir.empty() && !opts.journal) {
+        std::cerr << "Error: --resume needs --journal\n";
+        return false;
+    }
+    if (!opts.resumeDir.empty() && !opts.listen.empty()) {
+        std::cerr << "Error: --resume does not take --listen\n";
+        return false;
+    }
+    if (opts.stateHash && opts.statePath.empty()) {
+        std::cerr << "Error: --state-hash needs --state\n";
+        return false;
+    }
+    if (opts.direct && !opts.uring) {
+        std::cerr << "Error: --direct needs --io uring\n";
+        return false;
+    }
+    if (opts.zstdLevel > 0 && opts.output != OutputFormat::Segments) {
+        std::cerr << "Error: --zstd needs --output segments\n";
+        return false;
+    }
+#ifdef CHUNK_WITH_CURL
+    HttpUrl url;
+    if (opts.output == OutputFormat::S3) {
+        if (!HttpUrl::parse(opts.s3Url, url)) {
+            std::cerr << "Error: --output s3 needs --s3-url http(s)://HOST/BUCKET[/PREFIX]\n";
+            return false;
+        }
+        if (opts.uploadBatch < S3_MIN_PART_SIZE) {
+            std::cerr << "Error: --upload-batch must be at least 5M with --output s3\n";
+            return false;
+        }
+        if (opts.segmentSize / opts.uploadBatch >= S3_MAX_PARTS) {
+            std::cerr << "Error: --segment-size must be under " << S3_MAX_PARTS
+            << " times --upload-batch with --output s3\n";
+            return false;
+        }
+    }
+    if (opts.output == OutputFormat::Http && !HttpUrl::parse(opts.httpUrl, url)) {
+        std::cerr << "Error: --output http needs --http-url http(s)://...\n";
+        return false;
+    }
+#endif
+    if (opts.maxTokens > 0) {
+        if (opts.splitMode != SplitMode::Fixed) {
+            std::cerr << "Error: --max-tokens cannot be combined with --split\n";
+            return false;
+        }
+        if (opts.vocabPath.empty()) {
+            std::cerr << "Error: --max-tokens needs a --vocab file\n";
+            return false;
+        }
+        if (opts.tokenOverlap >= opts.maxTokens) {
+            std::cerr << "Error: --token-overlap must be smaller than --max-tokens\n";
+            return false;
+        }
+        opts.splitMode = SplitMode::Tokens;
+    } else if (opts.tokenOverlap > 0) {
+        std::cerr << "Error: --token-overlap needs --max-tokens\n";
+        return false;
+    }
+    return true;
+}
+
+// open_chunk_sink - the --output / --io target for chunks going to `dir`;
+// throws when it cannot be set up. `durable` (the run journal is kept) syncs
+// every chunk file before it is renamed into place.
+static std::unique_ptr<ChunkSink> open_chunk_sink(const Options& opts, const std::string& dir,
+                                                  BufferPool& pool, bool durable) {
+    if (opts.output == OutputFormat::Segments) {
+        return std::make_unique<SegmentSink>(dir, opts.segmentSize,
+                                             static_cast<int>(opts.zstdLevel));
+    }
+#ifdef CHUNK_WITH_CURL
+    if (opts.output == OutputFormat::S3) {
+        HttpUrl url;
+        HttpUrl::parse(opts.s3Url, url);
+        const char* accessKey = std::getenv("AWS_ACCESS_KEY_ID");
+        const char* secretKey = std::getenv("AWS_SECRET_ACCESS_KEY");
+        const char* token     = std::getenv("AWS_SESSION_TOKEN");
+        if (!accessKey || !secretKey) {
+            throw std::runtime_error("--output s3 needs AWS_ACCESS_KEY_ID and "
+                                     "AWS_SECRET_ACCESS_KEY");
+        }
+        std::string region = opts.s3Region;
+        for (const char* name : { "AWS_REGION", "AWS_DEFAULT_REGION" }) {
+            const char* value = std::getenv(name);
+            if (region.empty() && value) {
+                region = value;
+            }
+        }
+        S3Signer signer(accessKey, secretKey, token ? token : "",
+                        region.empty() ? "us-east-1" : region);
+        return std::make_unique<S3Sink>(dir, pool, url, std::move(signer), opts.segmentSize,
+                                        opts.uploadBatch, opts.uploadConcurrency);
+    }
+    if (opts.output == OutputFormat::Http) {
+        return std::make_unique<HttpSink>(dir, pool, opts.httpUrl, opts.httpHeaders,
+                                          opts.uploadBatch, opts.uploadConcurrency);
+    }
+#endif
+#ifdef CHUNK_WITH_URING
+    if (opts.uring) {
+        return std::make_unique<UringSink>(dir, pool, opts.direct, durable);
+    }
+#endif
+#if !defined(CHUNK_WITH_URING) && !defined(CHUNK_WITH_CURL)
+    (void)pool;
+#endif
+    return std::make_unique<DirectorySink>(dir, durable);
+}
+
+// state_settings - the options that decide chunk boundaries and digests; a
+// --state file or a run journal is only reused by runs with the same settings
+static std::string state_settings(const Options& opts) {
+    static const char* const SPLIT_NAMES[] = { "fixed", "cdc", "boundary", "tokens" };
+    std::ostringstream oss;
+    oss << "hash=" << hash_algo_name(opts.hashAlgo)
+    << " split=" << SPLIT_NAMES[static_cast<int>(opts.splitMode)];
+    if (opts.chunkSize != DEFAULT_CHUNK_SIZE || opts.chunkVariance != DEFAULT_CHUNK_VARIANCE) {
+        oss << " chunk-size=" << opts.chunkSize << " variance=" << opts.chunkVariance;
+    }
+    if (opts.splitMode == SplitMode::Tokens) {
+        oss << " max-tokens=" << opts.maxTokens << " overlap=" << opts.tokenOverlap
+        << " vocab=" << opts.vocabPath;
+    }
+    if (opts.jsonFields != std::vector<std::string>{ "text" }) {
+        oss << " json-fields=";
+        for (size_t i = 0; i < opts.jsonFields.size(); i++) {
+            oss << (i ? "," : "") << opts.jsonFields[i];
+        }
+    }
+    if (opts.csvMode == CsvMode::Records) {
+        oss << " csv=records";
+        if (opts.csvDelimiter) {
+            oss << " csv-delimiter=" << static_cast<int>(opts.csvDelimiter);
+        }
+        if (!opts.csvColumns.empty()) {
+            oss << " csv-columns=";
+            for (size_t i = 0; i < opts.csvColumns.size(); i++) {
+                oss << (i ? "," : "") << opts.csvColumns[i];
+            }
+        }
+    }
+    if (!opts.columns.empty()) {
+        oss << " columns=";
+        for (size_t i = 0; i < opts.columns.size(); i++) {
+            oss << (i ? "," : "") << opts.columns[i];
+        }
+    }
+    return oss.str();
+}
+
+// open_manifest - the --manifest writer for `dir`, nullptr for none; throws
+// when the file cannot be created, or when `dir` already has a manifest of
+// another run and this one is not resuming it
+static std::unique_ptr<Manifest> open_manifest(const Options& opts, const std::string& dir) {
+    struct stat st;
+    for (const char* name : { "/manifest.jsonl", "/manifest.parquet" }) {
+        if (opts.manifest != ManifestFormat::None && opts.resumeDir.empty() &&
+            stat((dir + name).c_str(), &st) == 0) {
+            throw std::runtime_error(dir + name + " already exists; use --resume to continue "
+                                     "that run");
+        }
+    }
+    switch (opts.manifest) {
+        case ManifestFormat::Jsonl:   return std::make_unique<JsonlManifest>(dir);
+        case ManifestFormat::Parquet: return std::make_unique<ParquetManifest>(dir);
+        case ManifestFormat::None:    break;
+    }
+    return nullptr;
+}
+
+// make_buffer_pool - chunk buffers for the chosen split mode; O_DIRECT wants
+// them block aligned and a whole number of blocks long
+static std::unique_ptr<BufferPool> make_buffer_pool(const Options& opts) {
+    size_t size = chunk_buffer_size();
+    if (!opts.direct) {
+        return std::make_unique<BufferPool>(opts.maxBuffers, size);
+    }
+    size = (size + DIRECT_IO_ALIGNMENT - 1) & ~(DIRECT_IO_ALIGNMENT - 1);
+    return std::make_unique<BufferPool>(opts.maxBuffers, size, DIRECT_IO_ALIGNMENT);
+}
+
+// -----------------------------------------------------------------------------
+// 33) Benchmark (--bench) - generate synthetic inputs, push each through its
+//     ingestion path and report throughput with a per-stage time split
+// -----------------------------------------------------------------------------
+
+// deterministic word stream so runs are comparable
+class SyntheticText {
+public:
+    void appendWord(std::string& out) {
+        static const char* const WORDS[] = {
+            "the", "chunk", "stream", "buffer", "vector", "index", "semantic", "search",
+            "knowledge", "base", "document", "parquet", "column", "row", "embedding",
+            "throughput", "pipeline", "hash", "disk", "memory", "of", "and", "to", "in"
+        };
+        state_ = state_ * 6364136223846793005ULL + 1442695040888963407ULL;
+        out += WORDS[(state_ >> 33) % (sizeof(WORDS) / sizeof(WORDS[0]))];
+    }
+
+    uint64_t next() {
+        state_ = state_ * 6364136223846793005ULL + 1442695040888963407ULL;
+        return state_ >> 33;
+    }
+
+    // sentence of roughly `len` bytes, no trailing newline
+    void appendSentence(std::string& out, size_t len) {
+        size_t start = out.size();
+        while (out.size() - start < len) {
+            if (out.size() > start) {
+                out += ' ';
+            }
+            appendWord(out);
+        }
+    }
+
+private:
+    uint64_t state_ = 42;
+};
+
+static bool write_synthetic_file(const std::string& path, size_t targetBytes, bool csv) {
+    std::ofstream ofs(path, std::ios::binary);
+    if (!ofs.is_open()) {
+        return false;
+    }
+    SyntheticText gen;
+    std::string block;
+    size_t written = 0;
+    uint64_t row = 0;
+    if (csv) {
+        block = "id,name,score,comment\n";
+    }
+    while (written < targetBytes) {
+        if (csv) {
+            block += std::to_string(row++);
+            block += ',';
+            gen.appendWord(block);
+            block += ',';
+            block += std::to_string(gen.next() % 10000);
+            block += ",\"";
+            gen.appendSentence(block, 60);
+            block += "\"\n";
+        } else {
+            gen.appendSentence(block, 80);
+            block += '\n';
+        }
+        if (block.size() >= 1024 * 1024) {
+            ofs.write(block.data(), static_cast<std::streamsize>(block.size()));
+            written += block.size();
+            block.clear();
+        }
+    }
+    ofs.write(block.data(), static_cast<std::streamsize>(block.size()));
+    return static_cast<bool>(ofs);
+}
+
+static bool write_synthetic_parquet(const std::string& path, size_t targetBytes) {
+    auto schema = arrow::schema({arrow::field("id", arrow::int64()),
+                                 arrow::field("score", arrow::float64()),
+                                 arrow::field("text", arrow::utf8())});
+    auto sinkResult = arrow::io::FileOutputStream::Open(path);
+    if (!sinkResult.ok()) {
+        return false;
+    }
+    std::unique_ptr<parquet::arrow::FileWriter> writer;
+    auto st = parquet::arrow::FileWriter::Open(*schema, arrow::default_memory_pool(),
+                                               *sinkResult,
+                                               parquet::default_writer_properties(),
+                                               &writer);
+    if (!st.ok()) {
+        return false;
+    }
+
+    // one row group per ~8MB of text keeps generation memory bounded
+    const int64_t ROWS_PER_GROUP = 64 * 1024;
+    SyntheticText gen;
+    size_t written = 0;
+    int64_t row = 0;
+    std::string sentence;
+    while (written < targetBytes && st.ok()) {
+        arrow::Int64Builder ids;
+        arrow::DoubleBuilder scores;
+        arrow::StringBuilder texts;
+        for (int64_t r = 0; r < ROWS_PER_GROUP && written < targetBytes; r++, row++) {
+            sentence.clear();
+            gen.appendSentence(sentence, 100);
+            st = ids.Append(row);
+            if (st.ok()) st = scores.Append(static_cast<double>(gen.next() % 100000) / 100.0);
+            if (st.ok()) st = texts.Append(sentence);
+            if (!st.ok()) {
+                break;
+            }
+            written += sentence.size() + 16;
+        }
+        std::shared_ptr<arrow::Array> idArr, scoreArr, textArr;
+        if (st.ok()) st = ids.Finish(&idArr);
+        if (st.ok()) st = scores.Finish(&scoreArr);
+        if (st.ok()) st = texts.Finish(&textArr);
+        if (st.ok()) {
+            auto table = arrow::Table::Make(schema, {idArr, scoreArr, textArr});
+            st = writer->WriteTable(*table, ROWS_PER_GROUP);
+        }
+    }
+    if (st.ok()) {
+        st = writer->Close();
+    }
+    return st.ok();
+}
+
+// remove_files_in - delete the plain files directly inside dir, then dir itself
+static void remove_files_in(const std::string& dir) {
+    if (DIR* d = opendir(dir.c_str())) {
+        while (struct dirent* ent = readdir(d)) {
+            std::string name = ent->d_name;
+            if (name != "." && name != "..") {
+                unlink((dir + "/" + name).c_str());
+            }
+        }
+        closedir(d);
+    }
+    rmdir(dir.c_str());
+}
+
+int run_bench(const Options& opts) {
+    std::ostringstream dirss;
+    dirss << "/tmp/chunk_bench_" << std::time(nullptr);
+    std::string benchDir = dirss.str();
+    if (mkdir(benchDir.c_str(), 0777) && errno != EEXIST) {
+        std::cerr << "Error: Could not create directory: " << benchDir << "\n";
+        return 1;
+    }
+
+    std::string txtPath     = benchDir + "/bench.txt";
+    std::string csvPath     = benchDir + "/bench.csv";
+    std::string parquetPath = benchDir + "/bench.parquet";
+    std::cout << "Generating " << opts.benchSize << " bytes per input in " << benchDir << "\n";
+    if (!write_synthetic_file(txtPath, opts.benchSize, false) ||
+        !write_synthetic_file(csvPath, opts.benchSize, true) ||
+        !write_synthetic_parquet(parquetPath, opts.benchSize)) {
+        std::cerr << "Error: Could not generate benchmark inputs in " << benchDir << "\n";
+        remove_files_in(benchDir);
+        return 1;
+    }
+
+    struct BenchCase {
+        const char* name;
+        std::function<bool(Chunker&)> run;
+    };
+    std::vector<BenchCase> cases = {
+        { "txt  stream_file",           [&](Chunker& c) { return stream_file(txtPath, c); } },
+        { "csv  stream_file",           [&](Chunker& c) { return stream_file(csvPath, c); } },
+        { "txt  stream_command_output", [&](Chunker& c) {
+              return stream_command_output({ "cat", txtPath }, c); } },
+        { "parquet stream_parquet",     [&](Chunker& c) { return stream_parquet(parquetPath, c); } },
+    };
+
+    g_logChunks  = false;
+    g_timeStages = true;
+    std::unique_ptr<BufferPool> poolPtr = make_buffer_pool(opts);
+    BufferPool& pool = *poolPtr;
+
+    std::cout << "\n" << std::left << std::setw(28) << "path"
+    << std::right << std::setw(10) << "in MB" << std::setw(8) << "chunks"
+    << std::setw(9) << "wall s" << std::setw(9) << "MB/s";
+    for (const char* stage : STAGE_NAMES) {
+        std::cout << std::setw(8) << stage;
+    }
+    std::cout << "\n";
+
+    bool ok = true;
+    for (const BenchCase& bc : cases) {
+        std::string outDir = benchDir + "/out";
+        mkdir(outDir.c_str(), 0777);
+        g_stageStats.reset();
+
+        auto start = std::chrono::steady_clock::now();
+        bool success;
+        {
+            std::unique_ptr<ChunkSink> sink = open_chunk_sink(opts, outDir, pool, false);
+            FlushStage flush(pool, *sink, opts.flushThreads,
+                             opts.flushThreads * FLUSH_QUEUE_PER_WORKER);
+            {
+                Chunker chunker(pool, flush, bc.name);
+                success = bc.run(chunker);
+            }
+            flush.finish();
+        }
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        remove_files_in(outDir);
+        ok = ok && success;
+
+        StageStats::Snapshot stats = g_stageStats.snapshot();
+        double mb = static_cast<double>(stats.counters[COUNTER_BYTES_IN]) / (1024.0 * 1024.0);
+        std::cout << std::left << std::setw(28) << bc.name << std::right
+        << std::fixed << std::setprecision(1) << std::setw(10) << mb
+        << std::setw(8) << stats.counters[COUNTER_CHUNKS]
+        << std::setprecision(3) << std::setw(9) << wall
+        << std::setprecision(1) << std::setw(9) << (wall > 0 ? mb / wall : 0.0);
+        // summed thread time per stage; stages overlap, so these can exceed wall
+        for (uint64_t n : stats.nanos) {
+            std::cout << std::setprecision(3) << std::setw(8) << static_cast<double>(n) / 1e9;
+        }
+        std::cout << (success ? "" : "  (failed)") << "\n";
+    }
+    std::cout << "\nStage columns are seconds summed over all threads; stages run\n"
+    << "concurrently, so they can add up to more than the wall time.\n";
+
+    remove_files_in(benchDir);
+    return ok ? 0 : 1;
+}
+
+// -----------------------------------------------------------------------------
+// 34) Main
+// -----------------------------------------------------------------------------
+int main(int argc, char* argv[]) {
+    Options opts;
+    if (!parse_args(argc, argv, opts)) {
+        return 1;
+    }
+    if (opts.showHelp || (opts.files.empty() && !opts.bench && opts.listen.empty())) {
+        print_help(argv[0]);
+        return 0;
+    }
+
+    g_logChunks        = !opts.quiet;
+    g_timeStages       = !opts.metricsPath.empty() || !opts.metricsListen.empty();
+    g_splitMode        = opts.splitMode;
+    g_maxTokens        = opts.maxTokens;
+    g_tokenOverlap     = opts.tokenOverlap;
+    g_hashAlgo         = opts.hashAlgo;
+    g_pdfEngine        = opts.pdfEngine;
+    g_pdfThreads       = opts.pdfThreads;
+    g_decompressThreads = opts.decompressThreads;
+    g_fileThreads      = opts.fileThreads;
+    g_parquetBatchRows = static_cast<int64_t>(opts.parquetBatchRows);
+    g_parquetColumns   = opts.columns;
+    g_csvColumns       = opts.csvColumns;
+    g_jsonFields       = opts.jsonFields;
+    g_csvMode          = opts.csvMode;
+    g_csvDelimiter     = opts.csvDelimiter;
+    g_csvThreads       = opts.csvThreads;
+    g_parquetReadahead = static_cast<int>(opts.parquetReadahead);
+    g_chunk            = ChunkGeometry::make(opts.chunkSize, opts.chunkVariance);
+
+    // the same ~500MB of buffers by default whatever the chunk size, and
+    // batches small enough that every chunker can still get a few
+    if (opts.maxBuffers == 0) {
+        opts.maxBuffers = std::max(NUM_BUFFERS, NUM_BUFFERS * (DEFAULT_CHUNK_SIZE +
+                                   DEFAULT_CHUNK_VARIANCE) / chunk_buffer_size());
+    }
+    // uploads hold on to the buffers of every request in flight and of the
+    // one being filled; leave the chunkers at least as many again
+    if (opts.output == OutputFormat::S3 || opts.output == OutputFormat::Http) {
+        size_t perRequest = opts.uploadBatch / chunk_buffer_size() + 1;
+        opts.maxBuffers = std::max(opts.maxBuffers,
+                                   2 * (opts.uploadConcurrency + 1) * perRequest);
+    }
+    g_chunk.batch = std::min(g_chunk.batch, std::max<size_t>(1, opts.maxBuffers / 8));
+
+    if (!opts.vocabPath.empty()) {
+        g_vocab = std::make_unique<WordPieceVocab>();
+        if (!g_vocab->load(opts.vocabPath)) {
+            std::cerr << "Error: could not load vocab file " << opts.vocabPath << "\n";
+            return 1;
+        }
+    }
+
+    if (opts.bench) {
+        return run_bench(opts);
+    }
+
+    // Create an output directory in /tmp, or carry on in the one to resume
+    if (!opts.resumeDir.empty()) {
+        g_outputDir = opts.resumeDir;
+        struct stat st;
+        if (stat(g_outputDir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            std::cerr << "Error: no output directory to resume: " << g_outputDir << "\n";
+            return 1;
+        }
+        std::cout << "Resuming the run in: " << g_outputDir << "\n";
+    } else {
+        // unique, so runs started in the same second never share a journal
+        // or a manifest
+        std::time_t now = std::time(nullptr);
+        std::ostringstream dirss;
+        dirss << "/tmp/chunked_" << now << "_XXXXXX";
+        std::string dirTemplate = dirss.str();
+
+        if (!mkdtemp(&dirTemplate[0])) {
+            std::cerr << "Error: Could not create directory: " << dirTemplate << "\n";
+            return 1;
+        }
+        g_outputDir = dirTemplate;
+        mode_t mask = umask(0); // mkdtemp makes it 0700; keep mkdir's mode
+        umask(mask);
+        chmod(g_outputDir.c_str(), 0777 & ~mask);
+
+        std::cout << "Chunks will be written to: " << g_outputDir << "\n";
+    }
+
+    // Create a buffer pool (buffers are allocated as chunks are filled, up to
+    // --max-buffers; past that the chunker waits for the flush workers)
+    std::unique_ptr<BufferPool> bufferPoolPtr = make_buffer_pool(opts);
+    BufferPool& bufferPool = *bufferPoolPtr;
+    std::unique_ptr<HashIndex> hashIndex;
+    if (!opts.indexPath.empty()) {
+        try {
+            hashIndex = std::make_unique<HashIndex>(opts.indexPath, g_hashAlgo);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
+    std::unique_ptr<InputState> inputState;
+    if (!opts.statePath.empty()) {
+        inputState = std::make_unique<InputState>(opts.statePath, state_settings(opts),
+                                                  opts.stateHash);
+        if (!inputState->load()) {
+            std::cerr << "Warning: could not read state file " << opts.statePath
+            << "; every input is processed again\n";
+        }
+    }
+    // The run journal (--journal) lets --resume continue this run after a crash
+    std::unique_ptr<Journal> journal;
+    if (opts.journal) {
+        journal = std::make_unique<Journal>(g_outputDir, state_settings(opts));
+        if (!journal->lock() || (!opts.resumeDir.empty() && !journal->recover(hashIndex.get()))) {
+            return 1;
+        }
+        if (!journal->open()) {
+            std::cerr << "Error: could not open the run journal in " << g_outputDir << "\n";
+            return 1;
+        }
+    }
+    std::unique_ptr<ChunkSink> sink;
+    std::unique_ptr<Manifest> manifest;
+    try {
+        sink = open_chunk_sink(opts, g_outputDir, bufferPool, journal != nullptr);
+        manifest = open_manifest(opts, g_outputDir);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    std::unique_ptr<NearDupIndex> nearDup;
+    if (opts.nearDup != NearDupMode::Off) {
+        nearDup = std::make_unique<NearDupIndex>(opts.nearDup, opts.nearDupThreshold);
+    }
+    FlushStage flushStage(bufferPool, *sink, opts.flushThreads,
+                          opts.flushThreads * FLUSH_QUEUE_PER_WORKER, hashIndex.get(),
+                          manifest.get(), inputState.get(), nearDup.get(), journal.get());
+    flushStage.replayJournal();
+
+    std::unique_ptr<MetricsExporter> metrics;
+    if (g_timeStages) {
+        int listenFd = -1;
+        if (!opts.metricsListen.empty() && (listenFd = open_listener(opts.metricsListen)) < 0) {
+            return 1;
+        }
+        metrics = std::make_unique<MetricsExporter>(opts.metricsPath, opts.metricsInterval,
+                                                    listenFd);
+    }
+
+    // wait for the last chunks to hit the disk, then finish the metadata
+    auto finishOutput = [&] {
+        flushStage.finish();
+        sink->close();
+        if (journal) {
+            journal->close();
+        }
+        if (manifest && manifest->close()) {
+            std::cout << "Manifest written to: " << manifest->path() << "\n";
+        }
+        if (inputState && !inputState->save()) {
+            std::cerr << "Error: could not write state file " << opts.statePath << "\n";
+        }
+        if (metrics) {
+            metrics->stop(); // final --metrics dump covers the whole run
         }
+    };
+
+    if (!opts.listen.empty()) {
+        bool served = run_server(opts.listen, opts.jobs, bufferPool, flushStage);
+        finishOutput();
+        if (!served) {
+            return 1;
+        }
+        std::cout << "\nAll done. Chunks are located in: " << g_outputDir << "\n";
+        return 0;
+    }
 
-        if (!success) {
-            std::cerr << "Warning: No content processed from file: " << filePath << "\n";
+    // Inputs an interrupted attempt finished (--resume) or unchanged since the
+    // last run (--state) are not read again
+    std::vector<std::string> files = opts.files;
+    files.erase(std::remove_if(files.begin(), files.end(), [&flushStage](const std::string& f) {
+        return flushStage.reuseCommitted(f) || flushStage.reuseUnchanged(f);
+    }), files.end());
+
+    // With --converters, PDF/DOC/ODT/RTF files go to the converter scheduler,
+    // which runs on its own thread next to the regular files
+    std::vector<std::string> converterFiles;
+    if (opts.converters > 0) {
+        auto isConverted = [](const std::string& f) { return needs_converter(f); };
+        std::copy_if(files.begin(), files.end(), std::back_inserter(converterFiles), isConverted);
+        files.erase(std::remove_if(files.begin(), files.end(), isConverted), files.end());
+    }
+    ConverterScheduler converterScheduler(bufferPool, flushStage, opts.converters);
+    std::thread converterThread;
+    if (!converterFiles.empty()) {
+        converterThread = std::thread([&converterScheduler, &converterFiles] {
+            converterScheduler.run(converterFiles);
+        });
+    }
+
+    // Process each file, one after another or as tasks on a work-stealing pool
+    if (opts.jobs <= 1) {
+        for (const std::string& filePath : files) {
+            process_file(filePath, bufferPool, flushStage);
         }
+    } else if (!files.empty()) {
+        WorkStealingPool scheduler(std::min(opts.jobs, files.size()));
+        for (const std::string& filePath : files) {
+            scheduler.submit([&bufferPool, &flushStage, &filePath] {
+                process_file(filePath, bufferPool, flushStage);
+            });
+        }
+        scheduler.wait();
+    }
+
+    if (converterThread.joinable()) {
+        converterThread.join();
     }
 
+    finishOutput();
+
     std::cout << "\nAll done. Chunks are located in: " << g_outputDir << "\n";
     return 0;
 }